@@ -0,0 +1,174 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "event.h"
+#include "timer.h"
+#include "mempool.h"
+#include "log.h"
+
+/*
+ * event loop scaling: 'nloop' loops on threads of their own, each with
+ * 'npair' unix socket pairs bouncing a small message between their ends.
+ * without 'shared' the loops are independent shards, as the torrent tasks
+ * are, each on a loop of its own. with it every handler takes one lock, what
+ * state shared by all loops would cost.
+ * usage: reactor_bench [nloop] [npair] [seconds] [shared]
+ */
+
+#define BENCH_MSG_SZ 64
+
+struct bench_conn {
+    int fd;
+    long long nmsg;
+};
+
+static pthread_mutex_t bench_lock = PTHREAD_MUTEX_INITIALIZER;
+static int bench_shared;
+
+static double
+bench_now(void)
+{
+    struct timespec tp;
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    return tp.tv_sec + tp.tv_nsec / 1e9;
+}
+
+static int
+bench_echo_handle(int event, void *evt_ctx)
+{
+    struct bench_conn *bc = (struct bench_conn *)evt_ctx;
+    char buf[BENCH_MSG_SZ * 16];
+    int ret = 0;
+
+    if(bench_shared) {
+        pthread_mutex_lock(&bench_lock);
+    }
+
+    int n = recv(bc->fd, buf, sizeof(buf), 0);
+    if(n <= 0 || send(bc->fd, buf, n, 0) != n) {
+        ret = -1;
+    } else {
+        bc->nmsg += n / BENCH_MSG_SZ;
+    }
+
+    if(bench_shared) {
+        pthread_mutex_unlock(&bench_lock);
+    }
+
+    return ret;
+}
+
+static int
+bench_stop_handle(int event, void *evt_ctx)
+{
+    event_loop_quit();
+    return 0;
+}
+
+static int
+bench_add_pair(int epfd, struct bench_conn *bc)
+{
+    int sv[2];
+    if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) {
+        return -1;
+    }
+
+    int i;
+    for(i = 0; i < 2; i++) {
+        fcntl(sv[i], F_SETFL, fcntl(sv[i], F_GETFL) | O_NONBLOCK);
+        bc[i].fd = sv[i];
+        bc[i].nmsg = 0;
+
+        struct event_param ep;
+        ep.fd = sv[i];
+        ep.event = EPOLLIN;
+        ep.evt_hdl = bench_echo_handle;
+        ep.evt_ctx = &bc[i];
+        if(event_add(epfd, &ep)) {
+            return -1;
+        }
+    }
+
+    char msg[BENCH_MSG_SZ];
+    memset(msg, 'b', sizeof(msg));
+
+    return send(sv[0], msg, sizeof(msg), 0) == sizeof(msg) ? 0 : -1;
+}
+
+int
+main(int argc, char *argv[])
+{
+    int nloop = argc > 1 ? atoi(argv[1]) : 1;
+    int npair = argc > 2 ? atoi(argv[2]) : 64;
+    int seconds = argc > 3 ? atoi(argv[3]) : 2;
+    int shared = argc > 4 ? atoi(argv[4]) : 0;
+
+    if(nloop <= 0 || nloop > EVENT_MAX_LOOPS || npair <= 0 || seconds <= 0) {
+        fprintf(stderr, "usage: %s [nloop] [npair] [seconds] [shared]\n", argv[0]);
+        return -1;
+    }
+
+    set_log_level(LOG_LEVEL_ERROR, LOG_TIME_FMT_SHORT);
+
+    if(mempool_init_global()) {
+        return -1;
+    }
+
+    struct bench_conn *bc = calloc(nloop * npair * 2, sizeof(*bc));
+    int *epfds = calloc(nloop, sizeof(*epfds));
+    if(!bc || !epfds) {
+        return -1;
+    }
+
+    int i, j;
+    for(i = 0; i < nloop; i++) {
+        if((epfds[i] = event_create()) < 0) {
+            return -1;
+        }
+        for(j = 0; j < npair; j++) {
+            if(bench_add_pair(epfds[i], &bc[(i * npair + j) * 2])) {
+                fprintf(stderr, "socket pair setup failed!\n");
+                return -1;
+            }
+        }
+    }
+
+    struct timer_param tp;
+    memset(&tp, 0, sizeof(tp));
+    tp.epfd = epfds[0];
+    tp.tmr_hdl = bench_stop_handle;
+    if(timer_creat(&tp)) {
+        return -1;
+    }
+    tp.time = seconds * 1000 / TIME_UNIT;
+    timer_start(&tp);
+
+    bench_shared = shared;
+
+    double start = bench_now();
+    for(i = 1; i < nloop; i++) {
+        if(event_loop_spawn(epfds[i])) {
+            return -1;
+        }
+    }
+    event_loop(epfds[0]);
+    event_loop_join();
+    double elapsed = bench_now() - start;
+
+    long long total = 0;
+    for(i = 0; i < nloop * npair * 2; i++) {
+        total += bc[i].nmsg;
+    }
+
+    printf("%-7s loops %2d pairs %4d: %10.0f msg/s\n", shared ? "shared" : "sharded",
+                nloop, npair, total / elapsed);
+
+    return 0;
+}
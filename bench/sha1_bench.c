@@ -0,0 +1,132 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "sha1_accel.h"
+#include "log.h"
+
+/*
+ * sha1 backends throughput: 'nbuf' pieces of 'piecesz' bytes are hashed
+ * one by one and through the multi-buffer api, every digest is checked
+ * against the sha1.c reference first.
+ * usage: sha1_bench [piecesz] [nbuf] [rounds]
+ */
+
+static double
+bench_now(void)
+{
+    struct timespec tp;
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    return tp.tv_sec + tp.tv_nsec / 1e9;
+}
+
+int
+main(int argc, char *argv[])
+{
+    size_t piecesz = argc > 1 ? atoi(argv[1]) : 256*1024;
+    int nbuf = argc > 2 ? atoi(argv[2]) : 64;
+    int rounds = argc > 3 ? atoi(argv[3]) : 8;
+
+    if(piecesz <= 0 || nbuf <= 0 || rounds <= 0) {
+        fprintf(stderr, "usage: %s [piecesz] [nbuf] [rounds]\n", argv[0]);
+        return -1;
+    }
+
+    set_log_level(LOG_LEVEL_ERROR, LOG_TIME_FMT_SHORT);
+
+    const unsigned char **data = calloc(nbuf, sizeof(*data));
+    size_t *len = calloc(nbuf, sizeof(*len));
+    unsigned char *ref = calloc(nbuf, 20), *digest = calloc(nbuf, 20);
+    if(!data || !len || !ref || !digest) {
+        return -1;
+    }
+
+    int i, b;
+    srand(1);
+    for(i = 0; i < nbuf; i++) {
+        unsigned char *p = malloc(piecesz);
+        if(!p) {
+            return -1;
+        }
+        size_t k;
+        for(k = 0; k < piecesz; k++) {
+            p[k] = rand();
+        }
+        data[i] = p;
+        /* a short last piece, like a torrent */
+        len[i] = i == nbuf - 1 && piecesz > 1000 ? piecesz - 1000 + 3 : piecesz;
+    }
+
+    sha1_accel_select(SHA1_BACKEND_REF);
+    for(i = 0; i < nbuf; i++) {
+        sha1_accel_digest(data[i], len[i], ref + i * 20);
+    }
+
+    double total = 0;
+    for(i = 0; i < nbuf; i++) {
+        total += len[i];
+    }
+    total *= rounds;
+
+    printf("%zu bytes x %d buffers x %d rounds\n", piecesz, nbuf, rounds);
+    printf("%-10s %12s %12s\n", "backend", "single MB/s", "multi MB/s");
+
+    /* auto, the mix picked at run time, goes last */
+    static const int backends[] = {
+        SHA1_BACKEND_REF, SHA1_BACKEND_SCALAR, SHA1_BACKEND_SHANI,
+        SHA1_BACKEND_AVX2, SHA1_BACKEND_AUTO
+    };
+
+    int j;
+    for(j = 0; j < sizeof(backends)/sizeof(backends[0]); j++) {
+        b = backends[j];
+        if(!sha1_accel_supported(b)) {
+            printf("%-10s %12s %12s\n", sha1_accel_name(b), "n/a", "n/a");
+            continue;
+        }
+        sha1_accel_select(b);
+
+        /* correctness on every length around the padding edges too */
+        size_t n;
+        for(n = 0; n < 300 && n <= piecesz; n++) {
+            unsigned char d1[20], d2[20];
+            sha1_accel_select(SHA1_BACKEND_REF);
+            sha1_accel_digest(data[0], n, d1);
+            sha1_accel_select(b);
+            sha1_accel_digest(data[0], n, d2);
+            if(memcmp(d1, d2, 20)) {
+                printf("%s: digest mismatch at length %zu!\n", sha1_accel_name(b), n);
+                return -1;
+            }
+        }
+
+        int r;
+        double start = bench_now();
+        for(r = 0; r < rounds; r++) {
+            for(i = 0; i < nbuf; i++) {
+                sha1_accel_digest(data[i], len[i], digest + i * 20);
+            }
+        }
+        double single = bench_now() - start;
+        if(memcmp(ref, digest, nbuf * 20)) {
+            printf("%s: single digest mismatch!\n", sha1_accel_name(b));
+            return -1;
+        }
+
+        memset(digest, 0, nbuf * 20);
+        start = bench_now();
+        for(r = 0; r < rounds; r++) {
+            sha1_accel_digest_multi(data, len, nbuf, digest);
+        }
+        double multi = bench_now() - start;
+        if(memcmp(ref, digest, nbuf * 20)) {
+            printf("%s: multi digest mismatch!\n", sha1_accel_name(b));
+            return -1;
+        }
+
+        printf("%-10s %12.1f %12.1f\n", sha1_accel_name(b),
+                    total / single / 1e6, total / multi / 1e6);
+    }
+
+    return 0;
+}
@@ -9,29 +9,62 @@ extern "C" {
 
 struct bitfield;
 struct slice;
-struct peer_rcv_msg;
+struct down_piece;
 
 int bitfield_create(struct bitfield *bf, int pieces_num, int piece_sz, int64 totalsz);
 
+int bitfield_destroy(struct bitfield *bf);
+
 int bitfield_dup(struct bitfield *bf, char *bitmap, int nbyte);
 
 int bitfield_intrested(struct bitfield *local, struct bitfield *peer);
 
+int bitfield_avail_create(struct bitfield *local);
+
+int bitfield_down_create(struct bitfield *local);
+
+int bitfield_piecebuf_budget(struct bitfield *local, int64 budget);
+
+char *bitfield_piecebuf_get(struct bitfield *local);
+
+void bitfield_piecebuf_put(struct bitfield *local, char *buf);
+
+int bitfield_avail_add_peer(struct bitfield *local, struct bitfield *peer);
+
+int bitfield_avail_del_peer(struct bitfield *local, struct bitfield *peer);
+
 int bitfield_local_have(struct bitfield *local, int idx);
 
 int bitfield_peer_giveup_piece(struct bitfield *local, int idx);
 
 int bitfield_peer_have(struct bitfield *local, struct bitfield *peer, int idx);
 
-int bitfield_get_request_piece(struct bitfield *local, struct bitfield *peer,
-                                                       struct peer_rcv_msg *pm);
-
 int bitfield_is_local_have(struct bitfield *local, int idx);
 
-int bitfield_add_piece_to_stoped_list(struct bitfield *bf, int idx, char *piecebuf,
-                                    struct slice *base, struct slice *wait_list);
+int bitfield_piece_slices(struct bitfield *bf, int idx);
+
+struct down_piece *bitfield_down_piece_find(struct bitfield *local, int idx);
+
+int bitfield_pick_rarest(struct bitfield *local, struct bitfield *peer);
+
+struct down_piece *bitfield_down_piece_add(struct bitfield *local, int idx, char *piecebuf);
+
+struct down_piece *bitfield_down_piece_lru(struct bitfield *local);
+
+int bitfield_down_piece_write_done(struct bitfield *local, struct down_piece *dp);
+
+struct slice *bitfield_get_request_block(struct bitfield *local, struct bitfield *peer);
+
+struct slice *bitfield_get_endgame_block(struct bitfield *local, struct bitfield *peer,
+                                                            const struct slice *reqs);
+
+int bitfield_all_requested(struct bitfield *local, int nleft);
+
+int bitfield_release_block(struct bitfield *local, struct slice *sl);
+
+int bitfield_block_received(struct bitfield *local, struct down_piece *dp, int offset);
 
-int bitfield_rm_stoped_piece(struct bitfield *bf, struct peer_rcv_msg *pm, int idx);
+int bitfield_restore_down_piece(struct bitfield *bf, int idx, const char *donemap);
 
 #ifdef __cplusplus
 extern "C" }
@@ -12,7 +12,9 @@ extern "C" {
 #endif
 
 #include <stddef.h>
+#include <pthread.h>
 #include "type.h"
+#include "event.h"
 
 #define DOWN_TYPE_TYPE_SINGLE 1
 #define DOWN_TYPE_TYPE_MANY 2
@@ -22,6 +24,13 @@ extern "C" {
 #define MAX_TRACKER_NUM 32
 #define MAX_PEER_NUM 50 
 #define SLICE_SZ (16*1024)
+#define PIECE_HDR_SZ (13)
+#define PEER_OUTBUF_MIN_SZ (256)
+#define PEER_OUTQ_BUDGET (1024*1024)
+#define PEER_REQ_DEPTH_MIN (4)
+#define PEER_REQ_DEPTH_MAX (128)
+#define PIECE_BUF_BUDGET (64*1024*1024)
+#define PIECE_BUF_MIN (2)
 #define MTU_SZ (1400)
 
 enum {
@@ -60,6 +69,88 @@ struct multi_files {
     struct single_file *files;
 };
 
+/* max fds one task keeps open for piece reading and writing */
+#define MAX_OPEN_FILES 128
+
+struct open_file {
+    int fd, ref;
+    int64 offset, size; /* file position in the torrent's byte stream */
+    struct open_file *prev, *next;
+};
+
+struct file_cache {
+    int nfiles, nopen;
+    pthread_mutex_t lock;
+    struct open_file *files;
+    struct open_file *lru_head, *lru_tail; /* most recently used at head */
+};
+
+/* 0 means one disk thread per online cpu */
+#define DISK_IO_THREADS 0
+#define DISK_IO_MAX_THREADS 8
+#define DISK_IO_MAX_JOBS 256 /* the peers stop reading at this many jobs in flight */
+
+/* event loops the peers are spread over, 0 means one per online cpu */
+#define EVENT_LOOP_THREADS 0
+
+/* a running task rewrites its resume file this often */
+#define RESUME_SAVE_INTERVAL 60 /* seconds */
+
+/* all the tasks of a process, 0 is no limit */
+#define MGR_MAX_PEERS 0
+#define MGR_TICK 10 /* time units the rate buckets refill at */
+#define MGR_HANDSHAKE_TIMEOUT 30 /* seconds an incoming handshake may take */
+
+enum {
+    DISK_JOB_READ = 0,
+    DISK_JOB_WRITE,
+    DISK_JOB_HASH,
+    DISK_JOB_CHECK, /* read + hash, with read-ahead of the following pieces */
+    DISK_JOB_RESUME, /* buffer is a resume snapshot to write out */
+};
+
+struct disk_job;
+typedef int (*disk_job_done_t)(struct disk_job *job);
+
+struct disk_job {
+    int type, pieceidx;
+    int result;
+    char *buffer;
+    int buflen;
+    int offset; /* of the buffer in the piece */
+    void *ctx;
+    disk_job_done_t done; /* called on the task's loop, with its lock held */
+    struct torrent_task *tsk;
+    struct disk_job *next;
+};
+
+/* startup piece recheck, 'window' jobs are kept in flight */
+struct torrent_check {
+    int checking;
+    int next, done, have, total;
+    int inflight, window;
+    int64 start_time;
+    char *check_map; /* pieces to check, NULL for all */
+};
+
+/* the completions of the tasks on one loop, its eventfd wakes that loop */
+struct disk_port {
+    int epfd, efd;
+    struct disk_io *dio;
+    struct disk_job *done_list, **done_tail;
+};
+
+struct disk_io {
+    int nthread, stop;
+    int njob; /* atomic, the loops of all ports submit */
+    pthread_t *threads;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct disk_job *job_list, **job_tail;
+    int nport;
+    struct disk_port port[EVENT_MAX_LOOPS];
+};
+
 struct torrent_file {
     char *torfile;
     struct benc_type bt;
@@ -127,54 +218,127 @@ enum {
 struct pieces {
     int idx;
     struct pieces *next;
+};
 
-    /* for down stoped list */
+enum {
+    BLOCK_FREE = 0,
+    BLOCK_REQUESTED,
+    BLOCK_RECEIVED,
+};
+
+/* a requested block has 'nreq' peers asked for it, more than one in endgame */
+struct piece_block {
+    int state;
+    int nreq;
+};
+
+/* 
+ * a piece in download, any peer that has it fills its free blocks.
+ * once all are received the buffer goes to the hash job, the piece
+ * stays here until it is written. a piece without a buffer has its
+ * blocks written through to disk and is hashed from there.
+ */
+struct down_piece {
+    int idx;
+    int nblock, nfree, nrecv;
+    int nwrite;    /* block writes in the disk jobs */
+    int verifying; /* all blocks are here, in the hash job */
+    int orphan;    /* left the download with writes in flight, the last one frees it */
+    int64 atime;
     char *piecebuf;
-    struct slice *base, *wait_list;
+    char *flushbuf; /* the buffer of a flushed piece until its writes are done */
+    struct piece_block *blocks;
+    struct down_piece *next, **pprev;
 };
 
+/* 
+ * pieces ordered by pick bucket: bucket 0 are the pieces we have or
+ * download, bucket a+1 the other pieces 'a' peers have. order[bucket[k]..
+ * bucket[k+1]-1] is bucket k, a piece moves one bucket with a swap at the
+ * bucket edge.
+ */
+#define PICK_BUCKET_NUM (MAX_PEER_NUM+3)
+
+/* bitmap is padded to whole 64-bit words, the bits past npieces stay 0 */
 struct bitfield {
     char *bitmap;
-    int nbyte, npieces;
+    int nbyte, nword, npieces;
     int piecesz, last_piecesz;
     int64 totalsz;
-    struct pieces *down_list;
-    struct pieces *stoped_list;
+
+    /* 
+     * local bitfield only, the pieces in download oldest first, indexed
+     * by piece too. 'nfree' counts their free blocks.
+     */
+    struct down_piece *down_pieces, **down_tail;
+    struct down_piece **down_index;
+    int ndown, nfree;
+
+    /* 
+     * local bitfield only, the pool of piece buffers. 'nbuf' are
+     * allocated, at most 'maxbuf', the free ones are linked by their
+     * first word.
+     */
+    char *buf_free;
+    int nbuf, maxbuf;
+
+    /* local bitfield only, swarm availability and rarest first order */
+    int *avail;
+    int *order, *orderpos;
+    int *bucket;
+
+    /* peer bitfield only, the order position its last pick was found at */
+    int pickpos;
 };
 
 struct slice {
     int idx, offset;
     int slicesz, downsz, sendsz;
+    int64 reqtime;
     struct slice *next;
 };
 
 struct peer_rcv_msg {
-    int rcvlen;
+    int rcvpos, rcvlen;
     char *rcvbuf;
 
     int data_transfering;
 
-    int piecelen;
-    char *piecebuf;
+    /* the piece of the block in flight */
+    struct down_piece *dp;
+
+    /* bytes left of a block nobody wants anymore, read and dropped */
+    int discard;
+
+    /* the block in flight goes to 'blockbuf', its piece has no buffer */
+    int through;
+    char *blockbuf;
 
     struct slice **req_tail;
     struct slice *req_list;
-    struct slice *base, *wait_list;
-};
 
-struct peer_simple_msg {
-    int msgtype;
-    int offset, bufsz;
-    char *buffer, smallbuf[32];
-    struct peer_simple_msg *next;
+    /* requests in req_list, and how many we keep outstanding */
+    int nreq, reqdepth;
+
+    /* download rate(B/s) and min block rtt(ms) of the last window */
+    int rate, rtt;
+    int win_bytes, win_rtt;
+    int64 win_start;
 };
 
 struct peer_send_msg {
-    int pieceidx,piecesz;
-    char *piecedata;
     struct slice *req_list;
     struct slice **req_tail;
-    struct peer_simple_msg *msg_list;
+
+    /* ring of serialized bt msgs, 'outlen' bytes from 'outhead' */
+    char *outbuf;
+    int outsz, outhead, outlen;
+
+    /* piece hdr bytes at the ring head, its block follows them */
+    int outhdr;
+
+    /* requested block bytes not sent yet, with outlen the queued bytes */
+    int reqsz;
 };
 
 struct tracker;
@@ -182,6 +346,8 @@ struct peer {
     int isused;
     int state;
     int sockid;
+    int epfd; /* of the loop it is assigned to */
+    int event;
     int tmrfd;
     int heartbeat;
     int am_unchoking;
@@ -197,6 +363,7 @@ struct peer {
     struct torrent_task *tsk;
     struct peer_addrinfo *ipaddr;
     struct pieces *having_pieces;
+    int throttled; /* events waiting for rate tokens */
 };
 
 enum {
@@ -253,16 +420,37 @@ enum {
     PEER_TYPE_ACTIVE_NUM,
 };
 
+/*
+ * the timer, trackers and disk completions of a task run on the loop of
+ * 'epfd', its peers go round robin over all the loops. whatever runs for
+ * the task holds 'lock', a peer drops it only around the socket io that
+ * touches nothing but its own buffers.
+ */
 struct torrent_task {
-    int epfd;
-    int listenfd, tmrfd;
+    pthread_mutex_t lock;
+    int epfd, tmrfd;
+    int next_loop; /* the loop the next peer goes to */
     uint16 listen_port;
     int task_state;
     int64 down_size;
     int64 upload_size;
     int leftpieces;
+    int resume_time;
+    int resume_saving; /* a snapshot is queued on the disk io */
+    int throttled; /* atomic, a peer waits for rate tokens */
+    int max_reqdepth;
+
+    /* all missing blocks are requested, the rest go to several peers */
+    int endgame;
+    int64 dup_size;
+
+    /* piece buffers flushed to disk, blocks written through */
+    int nflush, nthrough;
     struct bitfield bf;
     struct torrent_file tor;
+    struct file_cache fc;
+    struct disk_io *dio;
+    struct torrent_check chk;
 
     struct pieces *havelist;
 
@@ -273,10 +461,53 @@ struct torrent_task {
     struct tracker *tr_active_list;
     struct tracker *tr_inactive_list;
     struct tracker **tr_inactive_list_tail;
+
+    struct torrent_mgr *mgr;
+    struct torrent_task *next;
 };
 
+enum {
+    RATE_DOWN = 0,
+    RATE_UP,
+    RATE_DIR_NUM,
+};
+
+/* a token bucket refilled every MGR_TICK, 'rate' B/s and 0 is no limit */
+struct rate_limit {
+    int rate;
+    int64 tokens;
+};
+
+/* an accepted connection waiting for the info_hash of its handshake */
+struct torrent_conn {
+    int fd, ip;
+    uint16 port;
+    int expire;
+    int parked; /* part of the handshake in, waits for the next tick */
+    struct torrent_mgr *mgr;
+    struct torrent_task *tsk; /* its handshake is for, set at the handoff */
+    struct torrent_conn *next;
+};
+
+/*
+ * the tasks of a process share its listen socket, disk io and limits, the
+ * peers of each task are spread over the event loops. the manager runs on
+ * the first loop, what the other loops touch of it is atomic.
+ */
 struct torrent_mgr {
-    int tmrfd; 
+    int epfd, tmrfd;
+    int nloop, next_loop;
+    int loop_epfd[EVENT_MAX_LOOPS];
+
+    int listenfd;
+    uint16 listen_port;
+    struct torrent_conn *conn_list;
+
+    struct disk_io *dio;
+
+    int npeer, max_peer;
+    struct rate_limit limit[RATE_DIR_NUM];
+
     int ntask;
     struct torrent_task *tsklist;
 };
@@ -5,6 +5,9 @@
 extern "C" {
 #endif
 
+/* epoll fds from event_create, each runs one loop */
+#define EVENT_MAX_LOOPS 16
+
 typedef int (*event_handle_t)(int event, void *evt_ctx);
 
 struct event_param {
@@ -17,12 +20,29 @@ int event_create(void);
 
 int event_add(int epfd, struct event_param *ep);
 
+/* no events parks the fd, only errors are reported */
 int event_mod(int epfd, struct event_param *ep);
 
 int event_del(int epfd, struct event_param *ep);
 
 int event_loop(int epfd);
 
+void event_loop_quit(void);
+
+/* breaks the epoll_wait of epfd's loop, from any thread */
+int event_wakeup(int epfd);
+
+/* runs hdl(0, ctx) on epfd's loop after its next wakeup, from any thread */
+int event_call(int epfd, event_handle_t hdl, void *ctx);
+
+/* runs event_loop(epfd) on a thread of its own */
+int event_loop_spawn(int epfd);
+
+int event_loop_join(void);
+
+/* closes the fds of a loop that is not running, after its last event_del */
+int event_destroy(int epfd);
+
 #ifdef __cplusplus
 extern "C" }
 #endif
@@ -8,6 +8,9 @@ extern "C" {
 #define USED_MEMPOOL
 
 #ifdef USED_MEMPOOL
+
+#include <pthread.h>
+
 enum {
     MEM_POOL_TYPE_16B = 0,
     MEM_POOL_TYPE_64B,
@@ -28,19 +31,46 @@ enum {
     MEM_POOL_NUM,
 };
 
+/* 
+ * a unit records its size class, so alloc and free are O(1). units are
+ * linked on the used list for the mem_dump leak report with MEMPOOL_DEBUG
+ * only, a free unit keeps the free list link in its buffer.
+ */
+/* #define MEMPOOL_DEBUG */
+
 struct mem_unit {
-    struct mem_unit *next;
-    int time;
-    int line;
+#ifdef MEMPOOL_DEBUG
+    struct mem_unit *prev, *next;
     const char *file;
+    int line;
+    int time;
+#endif
     int size;
+    short type;
+    short pad;
     int magic;
-    char *buffer;
+    int reserved;
+};
+
+/* classes up to 4096B carve their units from 64K aligned slabs */
+#define MEM_SLAB_SIZE (64*1024)
+#define MEM_SLAB_MAX_UNITSZ 4096
+
+struct mem_slab {
+    struct mem_slab *prev, *next;
+    struct mem_unit *free;
+    int nused, ncarved, nunits;
+    int full;
 };
 
+/* a size class is shared by the event loop threads, it has its own lock */
 struct mempool_unit {
-    int unitsz, nused, ntotals;
+    pthread_mutex_t lock;
+    int type, unitsz, nused, ntotals;
+    int nused_max, nslab, nslab_max;
+    long long usedsz;
     struct mem_unit *pool[MEM_POOL_NUM];
+    struct mem_slab *slabs, *full_slabs;
 };
 
 struct mempool {
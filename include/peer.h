@@ -7,8 +7,13 @@ extern "C" {
 
 int peer_init(struct peer *tr);
 
+int peer_uninit(struct peer *pr);
+
 int peer_modify_timer_time(struct peer *pr, int time);
 
+/* events held back by the rate limits are wanted again */
+int peer_unthrottle(struct peer *pr);
+
 #ifdef __cplusplus
 extern "C" }
 #endif
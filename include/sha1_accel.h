@@ -0,0 +1,43 @@
+#ifndef SHA1_ACCEL_H
+#define SHA1_ACCEL_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* buffers hashed together by the multi-buffer backend */
+#define SHA1_MB_LANES 8
+
+enum {
+    SHA1_BACKEND_AUTO,
+    SHA1_BACKEND_REF,       /* sha1.c */
+    SHA1_BACKEND_SCALAR,
+    SHA1_BACKEND_SHANI,
+    SHA1_BACKEND_AVX2,      /* multi-buffer, single buffers use scalar */
+    SHA1_BACKEND_NUM
+};
+
+int sha1_accel_init(void);
+
+int sha1_accel_supported(int backend);
+
+int sha1_accel_select(int backend);
+
+int sha1_accel_backend(void);
+
+const char *sha1_accel_name(int backend);
+
+int sha1_accel_lanes(void);
+
+void sha1_accel_digest(const unsigned char *data, size_t len, unsigned char *digest);
+
+void sha1_accel_digest_multi(const unsigned char **data, const size_t *len,
+                                                int n, unsigned char *digest);
+
+#ifdef __cplusplus
+extern "C" }
+#endif
+
+#endif
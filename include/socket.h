@@ -18,10 +18,12 @@ int get_socket_error(int sfd, int *error);
 
 int socket_tcp_send(int sfd, char *buf, int buflen, int flags);
 int socket_tcp_send_until_block(int sfd, char *buf, int buflen);
-int socket_tcp_send_all(int sfd, char *buf, int buflen);
+
+int socket_tcp_sendfile(int sfd, int fd, int64 *offset, int len);
 
 struct iovec;
-int socket_tcp_send_iovs(int fd, const struct iovec *iov, int iovcnt);
+int socket_tcp_send_iovs(int fd, const struct iovec *iov, int iovcnt, int flags);
+int socket_tcp_recv_iovs(int fd, const struct iovec *iov, int iovcnt);
 
 int socket_tcp_recv(int sfd, char *buf, int buflen, int flags);
 int socket_tcp_recv_until_block(int fd, char **dst, int *dstlen);
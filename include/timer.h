@@ -5,11 +5,65 @@
 extern "C" {
 #endif
 
+#include <pthread.h>
+#include "type.h"
 #include "event.h"
 
 /* 10 ms per unit */
 #define TIME_UNIT 10
 
+/*
+ * one timer wheel per event loop, a tick is TIME_UNIT. the first level has
+ * 256 slots of a tick, the next four 64 slots each of the level below.
+ */
+#define TVR_BITS 8
+#define TVN_BITS 6
+#define TVR_SIZE (1 << TVR_BITS)
+#define TVN_SIZE (1 << TVN_BITS)
+#define TVR_MASK (TVR_SIZE - 1)
+#define TVN_MASK (TVN_SIZE - 1)
+#define TVN_LEVELS 4
+
+#define TIMER_MAX_WHEELS 16
+
+/* a timer id is the wheel index above these bits, id 0 is never used */
+#define TIMER_ID_BITS 20
+
+struct timer_list {
+    struct timer_list *prev, *next;
+};
+
+struct timer_node {
+    struct timer_list link;
+    int id, active;
+    int interval;
+    int64 expires;
+    event_handle_t tmr_hdl;
+    void *tmr_ctx;
+};
+
+/*
+ * run by the thread of epfd's loop, 'owner' once it is running. the other
+ * loops may start and stop its timers too, all of it is under 'lock'.
+ */
+struct timer_wheel {
+    pthread_mutex_t lock;
+    int epfd, widx;
+    int owned;
+    pthread_t owner;
+    int64 tick; /* the next tick to run */
+    int64 next; /* no timer expires before this tick */
+    int nactive;
+    struct timer_list tv1[TVR_SIZE];
+    struct timer_list tvn[TVN_LEVELS][TVN_SIZE];
+
+    /* timers by id, the free ids are on a stack */
+    struct timer_node **nodes;
+    int nnode, maxnode;
+    int *freeid, nfree;
+};
+
+/* tmrfd is the timer id in the wheel of epfd, the api keeps the fd name */
 struct timer_param {
     int epfd, tmrfd;
     int time, interval;
@@ -25,8 +79,11 @@ int timer_stop(struct timer_param *tp);
 
 int timer_destroy(struct timer_param *tp);
 
+/* runs the expired timers of epfd's loop, returns ms to the next one or -1 */
+int timer_expire(int epfd);
+
 #ifdef __cplusplus
-extern "C" } 
+extern "C" }
 #endif
 
 #endif
@@ -0,0 +1,38 @@
+#ifndef TORMGR_H
+#define TORMGR_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct torrent_mgr;
+struct torrent_task;
+
+/* 'epfd' is the first of the 'nloop' loops, 0 is one per online cpu */
+int torrent_mgr_init(struct torrent_mgr *mgr, int epfd, int nloop);
+
+/* stops the tasks and drains the disk io before their resume files are saved */
+int torrent_mgr_uninit(struct torrent_mgr *mgr);
+
+/* the loops past the first one run on threads of their own, after the tasks are added */
+int torrent_mgr_start_loops(struct torrent_mgr *mgr);
+
+/* the tasks go round robin over the loops, the peers of each task over all of them */
+int torrent_mgr_add_task(struct torrent_mgr *mgr, char *torfile);
+
+/* connections over all tasks and B/s each way, 0 is no limit */
+int torrent_mgr_set_limit(struct torrent_mgr *mgr, int max_peer, int down_rate, int up_rate);
+
+/*
+ * bytes the task's peers may move now out of 'want', 0 until the next tick
+ * or, downloading, while the disk queue is full
+ */
+int torrent_mgr_quota(struct torrent_task *tsk, int dir, int want);
+
+void torrent_mgr_charge(struct torrent_task *tsk, int dir, int len);
+
+#ifdef __cplusplus
+extern "C" }
+#endif
+
+#endif
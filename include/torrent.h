@@ -6,6 +6,8 @@ extern "C" {
 #endif
 
 #include "btype.h"
+
+#define DOWNLOAD_DIR "./download/"
  
 struct offset {
     char *begin;
@@ -18,6 +20,8 @@ int torrent_file_parser(char *torfile, struct torrent_file *tor);
 
 int torrent_info_parser(struct torrent_file *tor);
 
+int torrent_info_free(struct torrent_file *tor);
+
 int parser_dict(struct offset *offsz, struct benc_type *bt);
 
 int destroy_dict(struct benc_type *bt);
@@ -30,12 +34,48 @@ int handle_int64_kv(struct benc_type *bt, const char *str, int64 *setme);
 
 int torrent_create_downfiles(struct torrent_task *tsk);
 
+int torrent_close_downfiles(struct torrent_task *tsk);
+
 int torrent_write_piece(struct torrent_task *tsk, int pieceid, const char *buffer, int buflen);
 
 int torrent_read_piece(struct torrent_task *tsk, int pieceid, char **buffer, int *buflen);
 
+int torrent_read_data(struct torrent_task *tsk, int64 offset, char *buffer, int buflen);
+
+int torrent_write_data(struct torrent_task *tsk, int64 offset, const char *buffer, int buflen);
+
+int torrent_data_fd_get(struct torrent_task *tsk, int64 offset, int *fidx,
+                                        int64 *fileoff, int64 *filelen);
+
+void torrent_data_fd_put(struct torrent_task *tsk, int fidx);
+
+struct stat;
+int torrent_stat_file(struct torrent_task *tsk, int fidx, struct stat *st);
+
 int torrent_check_downfiles_bitfield(struct torrent_task *tsk);
 
+struct disk_io *torrent_io_create(int epfd, int nthread);
+
+int torrent_io_destroy(struct disk_io *dio);
+
+int torrent_io_attach(struct disk_io *dio, int epfd);
+
+int torrent_io_submit(struct disk_io *dio, struct disk_job *job);
+
+int torrent_io_busy(struct disk_io *dio);
+
+struct disk_job *torrent_io_job_create(struct torrent_task *tsk, int type, int pieceidx,
+                            char *buffer, int buflen, disk_job_done_t done, void *ctx);
+
+int torrent_resume_load(struct torrent_task *tsk);
+
+int torrent_resume_save(struct torrent_task *tsk);
+
+/* snapshot on the caller, the files are written by a disk io thread */
+int torrent_resume_save_async(struct torrent_task *tsk);
+
+int torrent_resume_write(struct torrent_task *tsk, char *buf, int len);
+
 #ifdef __cplusplus
 extern "C" }
 #endif
@@ -7,8 +7,15 @@ extern "C" {
 
 struct tracker;
 struct torrent_task;
+struct torrent_mgr;
 
-int torrent_task_init(struct torrent_task *tsk, int epfd, char *torfile);
+int torrent_task_init(struct torrent_task *tsk, struct torrent_mgr *mgr, char *torfile);
+
+int torrent_task_stop(struct torrent_task *tsk);
+
+int torrent_task_uninit(struct torrent_task *tsk);
+
+int torrent_task_accept(struct torrent_task *tsk, int sock, int ip, uint16 port);
 
 int torrent_add_peer_addrinfo(struct torrent_task *tsk, char *peer);
 
@@ -15,6 +15,8 @@ int utils_set_rlimit_core(int msize);
 
 int64 utils_lseek(int fd, int64 offset, int whence);
 
+int64 utils_mtime(void);
+
 int utils_sha1_check(const char *buffer, int buflen, const char *sha1, int sha1len);
 
 int utils_sha1_gen(const char *buffer, int buflen, char *sha1, int sha1len);
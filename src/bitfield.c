@@ -1,16 +1,17 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <endian.h>
 #include "btype.h"
 #include "bitfield.h"
 #include "log.h"
 #include "mempool.h"
+#include "utils.h"
 
-static int bitfield_piece_insert_by_sort(struct pieces **list, struct pieces *node);
-static int bitfield_piece_remove(struct pieces **p, int idx);
-static int bitfield_piece_find(struct pieces *p, int idx);
-static int bitfield_build_slice_list(struct bitfield *bf, struct peer_rcv_msg *pm, int idx);
-static void bitfield_stoped_piece_remove(struct pieces **p, int idx);
+static void bitfield_down_piece_destroy(struct bitfield *local, struct down_piece *dp);
+static int bitfield_test(const char *bitmap, int idx);
+static void bitfield_avail_inc(struct bitfield *local, int idx);
+static void bitfield_avail_dec(struct bitfield *local, int idx);
 
 int
 bitfield_create(struct bitfield *bf, int pieces_num, int piece_sz, int64 totalsz)
@@ -22,17 +23,16 @@ bitfield_create(struct bitfield *bf, int pieces_num, int piece_sz, int64 totalsz
 
     bf->npieces = pieces_num;
     bf->nbyte = (pieces_num + 7) / 8;
+    bf->nword = (pieces_num + 63) / 64;
     bf->totalsz = totalsz;
     bf->piecesz = piece_sz;
-    
-    bf->down_list = NULL;
 
     bf->last_piecesz = totalsz % piece_sz;
     if(!bf->last_piecesz) {
         bf->last_piecesz = piece_sz;
     }
 
-    bf->bitmap = GCALLOC(1, bf->nbyte);
+    bf->bitmap = GCALLOC(bf->nword, sizeof(uint64));
     if(!bf->bitmap) {
         LOG_ERROR("out of memory!\n");
         return -1;
@@ -41,6 +41,39 @@ bitfield_create(struct bitfield *bf, int pieces_num, int piece_sz, int64 totalsz
     return 0;
 }
 
+/* the local bitfield after its disk jobs are done, no write is in flight */
+int
+bitfield_destroy(struct bitfield *bf)
+{
+    if(!bf) {
+        return -1;
+    }
+
+    while(bf->down_pieces) {
+        bitfield_down_piece_destroy(bf, bf->down_pieces);
+    }
+    GFREE(bf->down_index);
+    bf->down_index = NULL;
+
+    while(bf->buf_free) {
+        char *buf = bf->buf_free;
+        memcpy(&bf->buf_free, buf, sizeof(char *));
+        GFREE(buf);
+        bf->nbuf--;
+    }
+
+    GFREE(bf->avail);
+    GFREE(bf->order);
+    GFREE(bf->orderpos);
+    GFREE(bf->bucket);
+    bf->avail = bf->order = bf->orderpos = bf->bucket = NULL;
+
+    GFREE(bf->bitmap);
+    bf->bitmap = NULL;
+
+    return 0;
+}
+
 int
 bitfield_dup(struct bitfield *bf, char *bitmap, int nbyte)
 {
@@ -51,53 +84,219 @@ bitfield_dup(struct bitfield *bf, char *bitmap, int nbyte)
 
     memcpy(bf->bitmap, bitmap, nbyte);
 
+    /* spare bits of the last byte must be 0 */
+    if(bf->npieces & 7) {
+        bf->bitmap[nbyte-1] &= (char)(0xff << (8 - (bf->npieces & 7)));
+    }
+
     return 0;
 }
 
+/* bytes are msb first, a word loaded big endian keeps the piece order from its top bit */
+static uint64
+bitfield_word(const char *bitmap, int w)
+{
+    uint64 v;
+    memcpy(&v, bitmap + w * sizeof(v), sizeof(v));
+    return be64toh(v);
+}
+
+/* how many pieces the peer has that we miss */
 int
 bitfield_intrested(struct bitfield *local, struct bitfield *peer)
 {
     if(!local || !peer || !local->bitmap || !peer->bitmap
-                    || local->npieces != peer->npieces
-                    || local->nbyte != peer->nbyte) {
+                    || local->npieces != peer->npieces) {
         LOG_ERROR("invalid param!\n");
         return 0;
     }
 
-    peer->down_list = NULL;
-    struct pieces *tmp, **p = &peer->down_list;
-
-    int i, k, idx;
-    for(i = 0; i < local->nbyte; i++) {
-        unsigned char c1 = (unsigned char)local->bitmap[i];
-        unsigned char c2 = (unsigned char)peer->bitmap[i];
-        unsigned char c3  = (c1|c2) ^ c1;
-
-        for(k = 7; c3 && k >= 0; k--) {
-            if(c3 & (1<<k)) {
-                idx = (i*8)+(7-k);
-                if(!(tmp = GCALLOC(1, sizeof(*tmp)))) {
-                    goto MEM_FAILED;
-                }
-                tmp->idx = idx;
-                *p = tmp;
-                p = &(*p)->next;
-            }
-        }
+    int w, n = 0;
+    for(w = 0; w < local->nword; w++) {
+        n += __builtin_popcountll(bitfield_word(peer->bitmap, w) & ~bitfield_word(local->bitmap, w));
+    }
+
+    return n;
+}
+
+static int
+bitfield_test(const char *bitmap, int idx)
+{
+    return (unsigned char)bitmap[idx >> 3] & (1 << (7 - (idx & 7)));
+}
+
+/* every piece starts missing with no peer, in random order for tie-break */
+int
+bitfield_avail_create(struct bitfield *local)
+{
+    if(!local || local->npieces <= 0) {
+        LOG_ERROR("invalid param!\n");
+        return -1;
+    }
+
+    int n = local->npieces;
+    local->avail = GCALLOC(n, sizeof(int));
+    local->order = GMALLOC(n * sizeof(int));
+    local->orderpos = GMALLOC(n * sizeof(int));
+    local->bucket = GMALLOC(PICK_BUCKET_NUM * sizeof(int));
+    if(!local->avail || !local->order || !local->orderpos || !local->bucket) {
+        LOG_ERROR("out of memory!\n");
+        GFREE(local->avail);
+        GFREE(local->order);
+        GFREE(local->orderpos);
+        GFREE(local->bucket);
+        local->avail = local->order = local->orderpos = local->bucket = NULL;
+        return -1;
+    }
+
+    int i;
+    for(i = 0; i < n; i++) {
+        local->order[i] = i;
+    }
+    for(i = n - 1; i > 0; i--) {
+        int j = rand() % (i + 1);
+        int tmp = local->order[i];
+        local->order[i] = local->order[j];
+        local->order[j] = tmp;
+    }
+    for(i = 0; i < n; i++) {
+        local->orderpos[local->order[i]] = i;
+    }
+
+    local->bucket[0] = local->bucket[1] = 0;
+    for(i = 2; i < PICK_BUCKET_NUM; i++) {
+        local->bucket[i] = n;
+    }
+
+    return 0;
+}
+
+static void
+bitfield_order_swap(struct bitfield *local, int i, int j)
+{
+    int a = local->order[i], b = local->order[j];
+    local->order[i] = b;
+    local->orderpos[b] = i;
+    local->order[j] = a;
+    local->orderpos[a] = j;
+}
+
+/* the pick bucket 'idx' sits in */
+static int
+bitfield_order_bucket(struct bitfield *local, int idx)
+{
+    int pos = local->orderpos[idx];
+    return pos < local->bucket[1] ? 0 : local->avail[idx] + 1;
+}
+
+/* one bucket up: swap with the last of its bucket, the next bucket grows down */
+static void
+bitfield_order_up(struct bitfield *local, int idx, int k)
+{
+    int last = local->bucket[k+1] - 1;
+    bitfield_order_swap(local, local->orderpos[idx], last);
+    local->bucket[k+1]--;
+}
+
+/* one bucket down: swap with the first of its bucket, which shrinks from the front */
+static void
+bitfield_order_down(struct bitfield *local, int idx, int k)
+{
+    bitfield_order_swap(local, local->orderpos[idx], local->bucket[k]);
+    local->bucket[k]++;
+}
+
+static void
+bitfield_avail_inc(struct bitfield *local, int idx)
+{
+    if(!local->avail || local->avail[idx] >= MAX_PEER_NUM) {
+        return;
     }
 
-    return peer->down_list ? 1 : 0;
+    int k = bitfield_order_bucket(local, idx);
+    if(k) {
+        bitfield_order_up(local, idx, k);
+    }
+    local->avail[idx]++;
+}
+
+static void
+bitfield_avail_dec(struct bitfield *local, int idx)
+{
+    if(!local->avail || local->avail[idx] <= 0) {
+        return;
+    }
+
+    int k = bitfield_order_bucket(local, idx);
+    if(k) {
+        bitfield_order_down(local, idx, k);
+    }
+    local->avail[idx]--;
+}
+
+/* a piece we got or started to download leaves the pick buckets for bucket 0 */
+static void
+bitfield_order_retire(struct bitfield *local, int idx)
+{
+    if(!local->avail) {
+        return;
+    }
+
+    int k;
+    for(k = bitfield_order_bucket(local, idx); k > 0; k--) {
+        bitfield_order_down(local, idx, k);
+    }
+}
+
+/* a piece given up goes back from bucket 0 to the bucket of its availability */
+static void
+bitfield_order_restore(struct bitfield *local, int idx)
+{
+    if(!local->avail || bitfield_order_bucket(local, idx)) {
+        return;
+    }
+
+    int k;
+    for(k = 0; k <= local->avail[idx]; k++) {
+        bitfield_order_up(local, idx, k);
+    }
+}
+
+/* visit the pieces the peer has a word at a time, the highest bit is the lowest piece */
+static int
+bitfield_avail_update(struct bitfield *local, struct bitfield *peer,
+                        void (*update)(struct bitfield *, int))
+{
+    if(!local || !peer || !peer->bitmap || local->npieces != peer->npieces) {
+        return -1;
+    }
 
-MEM_FAILED:
-    LOG_ERROR("out of mmemory!\n");
-    while(peer->down_list) {
-        tmp = peer->down_list;
-        peer->down_list = tmp->next;
-        GFREE(tmp);
+    int w;
+    for(w = 0; w < peer->nword; w++) {
+        uint64 v = bitfield_word(peer->bitmap, w);
+        while(v) {
+            int b = __builtin_clzll(v);
+            v &= ~(1ULL << (63 - b));
+            update(local, w * 64 + b);
+        }
     }
+
     return 0;
 }
 
+int
+bitfield_avail_add_peer(struct bitfield *local, struct bitfield *peer)
+{
+    return bitfield_avail_update(local, peer, bitfield_avail_inc);
+}
+
+int
+bitfield_avail_del_peer(struct bitfield *local, struct bitfield *peer)
+{
+    return bitfield_avail_update(local, peer, bitfield_avail_dec);
+}
+
+/* a piece in download failed, it starts over from nothing */
 int
 bitfield_peer_giveup_piece(struct bitfield *local, int idx)
 {
@@ -105,7 +304,10 @@ bitfield_peer_giveup_piece(struct bitfield *local, int idx)
         return -1;
     }
 
-    bitfield_piece_remove(&local->down_list, idx);
+    struct down_piece *dp = bitfield_down_piece_find(local, idx);
+    if(dp) {
+        bitfield_down_piece_destroy(local, dp);
+    }
 
     return 0;
 }
@@ -117,19 +319,24 @@ bitfield_local_have(struct bitfield *local, int idx)
         return -1;
     }
 
-    bitfield_piece_remove(&local->down_list, idx);
-    bitfield_stoped_piece_remove(&local->stoped_list, idx);
-
     int pidx = idx >> 3; /* idx/8 */
     int bidx = idx & 7;  /* idx%8 */
     unsigned char *byte = (unsigned char *)&local->bitmap[pidx];
-    if((*byte) & (1 << (7-bidx))) {
+    int had = (*byte) & (1 << (7-bidx));
+    *byte |= (1 << (7-bidx));
+
+    /* set first, the piece leaves the download for good */
+    struct down_piece *dp = bitfield_down_piece_find(local, idx);
+    if(dp) {
+        bitfield_down_piece_destroy(local, dp);
+    }
+    bitfield_order_retire(local, idx);
+
+    if(had) {
         LOG_DEBUG("local alread have id[%d]\n", idx);
         return -1;
     }
 
-    *byte |= (1 << (7-bidx));
-
     return 0;
 }
 
@@ -154,218 +361,453 @@ bitfield_is_local_have(struct bitfield *local, int idx)
 int
 bitfield_peer_have(struct bitfield *local, struct bitfield *peer, int idx)
 {
-    if(idx < 0 || idx >= local->npieces) {
+    if(idx < 0 || idx >= local->npieces || !peer->bitmap) {
         return -1;
     }
+
+    if(!bitfield_test(peer->bitmap, idx)) {
+        peer->bitmap[idx >> 3] |= 1 << (7 - (idx & 7));
+        bitfield_avail_inc(local, idx);
+    }
     
-    if(!bitfield_is_local_have(local, idx)) {
+    /* 0 when it is a piece we miss */
+    return bitfield_test(local->bitmap, idx) ? -1 : 0;
+}
+
+int
+bitfield_piece_slices(struct bitfield *bf, int idx)
+{
+    int piecesz = idx == bf->npieces-1 ? bf->last_piecesz : bf->piecesz;
+    return (piecesz + (SLICE_SZ-1)) / SLICE_SZ;
+}
+
+int
+bitfield_down_create(struct bitfield *local)
+{
+    if(!local || local->npieces <= 0) {
+        LOG_ERROR("invalid param!\n");
         return -1;
     }
 
-    struct pieces *p = GCALLOC(1, sizeof(*p));
-    if(!p) {
+    local->down_index = GCALLOC(local->npieces, sizeof(struct down_piece *));
+    if(!local->down_index) {
         LOG_ERROR("out of memory!\n");
         return -1;
     }
-    p->idx = idx;
 
-    bitfield_piece_insert_by_sort(&peer->down_list, p);
+    local->down_pieces = NULL;
+    local->down_tail = &local->down_pieces;
+    local->ndown = local->nfree = 0;
+
+    local->buf_free = NULL;
+    local->nbuf = 0;
+    bitfield_piecebuf_budget(local, PIECE_BUF_BUDGET);
 
     return 0;
 }
 
-static int
-bitfield_piece_insert_by_sort(struct pieces **list, struct pieces *node)
+/* the memory piece buffers may take, free buffers above it are released */
+int
+bitfield_piecebuf_budget(struct bitfield *local, int64 budget)
 {
-    for(; *list && (*list)->idx < node->idx; list = &(*list)->next) {
-        /* nothing */ 
+    if(!local || budget < 0) {
+        return -1;
     }
-    node->next = *list;
-    *list = node;
+
+    int64 maxbuf = budget / local->piecesz;
+    local->maxbuf = maxbuf < PIECE_BUF_MIN ? PIECE_BUF_MIN : maxbuf;
+
+    while(local->nbuf > local->maxbuf && local->buf_free) {
+        char *buf = local->buf_free;
+        memcpy(&local->buf_free, buf, sizeof(char *));
+        GFREE(buf);
+        local->nbuf--;
+    }
+
     return 0;
 }
 
-static int
-bitfield_piece_remove(struct pieces **p, int idx)
-{
-    for(; *p; p = &(*p)->next) {
-        if((*p)->idx == idx) {
-            struct pieces *tmp = *p;
-            *p = tmp->next;
-            GFREE(tmp);
-            return 0;
+/* NULL when the budget is used up */
+char *
+bitfield_piecebuf_get(struct bitfield *local)
+{
+    char *buf = local->buf_free;
+    if(buf) {
+        memcpy(&local->buf_free, buf, sizeof(char *));
+        return buf;
+    }
+
+    if(local->nbuf >= local->maxbuf || !(buf = GMALLOC(local->piecesz))) {
+        return NULL;
+    }
+    local->nbuf++;
+
+    return buf;
+}
+
+void
+bitfield_piecebuf_put(struct bitfield *local, char *buf)
+{
+    if(!buf) {
+        return;
+    }
+
+    if(local->nbuf > local->maxbuf) {
+        GFREE(buf);
+        local->nbuf--;
+        return;
+    }
+
+    memcpy(buf, &local->buf_free, sizeof(char *));
+    local->buf_free = buf;
+}
+
+struct down_piece *
+bitfield_down_piece_find(struct bitfield *local, int idx)
+{
+    if(idx < 0 || idx >= local->npieces) {
+        return NULL;
+    }
+    return local->down_index[idx];
+}
+
+/* 
+ * a new piece in download goes last, the older ones are filled first.
+ * it owns 'piecebuf' from the pool, without one it is written through.
+ */
+struct down_piece *
+bitfield_down_piece_add(struct bitfield *local, int idx, char *piecebuf)
+{
+    if(idx < 0 || idx >= local->npieces || local->down_index[idx]) {
+        LOG_ERROR("invalid param!\n");
+        return NULL;
+    }
+
+    struct down_piece *dp = GCALLOC(1, sizeof(*dp));
+    if(!dp) {
+        LOG_ERROR("out of memory!\n");
+        return NULL;
+    }
+
+    dp->idx = idx;
+    dp->nblock = dp->nfree = bitfield_piece_slices(local, idx);
+    dp->blocks = GCALLOC(dp->nblock, sizeof(struct piece_block));
+    if(!dp->blocks) {
+        LOG_ERROR("out of memory!\n");
+        GFREE(dp);
+        return NULL;
+    }
+    dp->piecebuf = piecebuf;
+    dp->atime = utils_mtime();
+
+    dp->next = NULL;
+    dp->pprev = local->down_tail;
+    *local->down_tail = dp;
+    local->down_tail = &dp->next;
+
+    local->down_index[idx] = dp;
+    local->ndown++;
+    local->nfree += dp->nfree;
+    bitfield_order_retire(local, idx);
+
+    return dp;
+}
+
+static void
+bitfield_down_piece_destroy(struct bitfield *local, struct down_piece *dp)
+{
+    *dp->pprev = dp->next;
+    if(dp->next) {
+        dp->next->pprev = dp->pprev;
+    } else {
+        local->down_tail = dp->pprev;
+    }
+
+    local->down_index[dp->idx] = NULL;
+    local->ndown--;
+    local->nfree -= dp->nfree;
+    if(!bitfield_test(local->bitmap, dp->idx)) {
+        bitfield_order_restore(local, dp->idx);
+    }
+
+    bitfield_piecebuf_put(local, dp->piecebuf);
+    dp->piecebuf = NULL;
+
+    /* the block writes in flight still use it, the last one frees it */
+    if(dp->nwrite) {
+        dp->orphan = 1;
+        return;
+    }
+
+    bitfield_piecebuf_put(local, dp->flushbuf);
+    GFREE(dp->blocks);
+    GFREE(dp);
+}
+
+/* a block write of 'dp' is done, 1 when it was the last one of a piece still in download */
+int
+bitfield_down_piece_write_done(struct bitfield *local, struct down_piece *dp)
+{
+    if(--dp->nwrite) {
+        return 0;
+    }
+
+    bitfield_piecebuf_put(local, dp->flushbuf);
+    dp->flushbuf = NULL;
+
+    if(dp->orphan) {
+        GFREE(dp->blocks);
+        GFREE(dp);
+        return 0;
+    }
+
+    return 1;
+}
+
+/* the partial piece with a buffer nobody has touched for the longest, and no block requested */
+struct down_piece *
+bitfield_down_piece_lru(struct bitfield *local)
+{
+    struct down_piece *dp, *lru = NULL;
+    for(dp = local->down_pieces; dp; dp = dp->next) {
+        if(dp->piecebuf && dp->nrecv && !dp->verifying
+                    && dp->nfree + dp->nrecv == dp->nblock
+                    && (!lru || dp->atime < lru->atime)) {
+            lru = dp;
         }
     }
-    return -1;
+
+    return lru;
 }
 
-static int
-bitfield_piece_find(struct pieces *p, int idx)
+/*
+ * the lowest bucket first. the buckets hold only pickable pieces, a peer
+ * that has them all takes the first one it looks at. a peer goes on from
+ * where its last pick in the bucket was found, from a random place in a
+ * bucket new to it, so the pieces it lacks are not walked on every pick.
+ */
+int
+bitfield_pick_rarest(struct bitfield *local, struct bitfield *peer)
 {
-    for(; p; p = p->next) {
-        if(p->idx == idx) {
-            return 0;
+    if(!local->avail) {
+        return -1;
+    }
+
+    int k;
+    for(k = 2; k < PICK_BUCKET_NUM; k++) {
+        int start = local->bucket[k];
+        int end = k+1 < PICK_BUCKET_NUM ? local->bucket[k+1] : local->npieces;
+        if(start >= end) {
+            continue;
+        }
+
+        int i, pos = peer->pickpos;
+        if(pos < start || pos >= end) {
+            pos = start + rand() % (end - start);
+        }
+        for(i = start; i < end; i++) {
+            int idx = local->order[pos];
+            if(bitfield_test(peer->bitmap, idx)) {
+                peer->pickpos = pos;
+                return idx;
+            }
+
+            if(++pos == end) {
+                pos = start;
+            }
         }
     }
+
     return -1;
 }
 
-static int
-bitfield_build_slice_list(struct bitfield *bf, struct peer_rcv_msg *pm, int idx)
+/* 
+ * a free block for the peer to download from the oldest piece in
+ * download it has, the returned slice is the request. NULL when the
+ * caller has to add a new piece.
+ */
+struct slice *
+bitfield_get_request_block(struct bitfield *local, struct bitfield *peer)
 {
-    int nslice, last_piecesz = 0, last_slicesz = 0;
+    if(!local || !peer) {
+        LOG_ERROR("invalid param!\n");
+        return NULL;
+    }
 
-    nslice = (bf->piecesz + (SLICE_SZ-1)) /  SLICE_SZ;
-    last_piecesz = bf->totalsz % bf->piecesz;
+    if(!peer->bitmap) {
+        return NULL;
+    }
 
-    if(idx == bf->npieces-1 && last_piecesz != 0) {
-        nslice = (last_piecesz + (SLICE_SZ-1)) / SLICE_SZ;
-        last_slicesz = last_piecesz % SLICE_SZ;
+    struct down_piece *dp = NULL;
+    if(local->nfree) {
+        for(dp = local->down_pieces; dp; dp = dp->next) {
+            if(dp->nfree && bitfield_test(peer->bitmap, dp->idx)) {
+                break;
+            }
+        }
     }
 
-    pm->req_tail = &pm->req_list;
-    pm->req_list = NULL;
+    if(!dp) {
+        return NULL;
+    }
 
-    pm->base = pm->wait_list = GCALLOC(nslice, sizeof(struct slice)); 
-    if(!pm->wait_list) {
+    struct slice *sl = GCALLOC(1, sizeof(*sl));
+    if(!sl) {
         LOG_ERROR("out of memory!\n");
-        return -1;
+        return NULL;
     }
 
     int i;
-    for(i = 0; i < nslice; i++) {
-        pm->wait_list[i].idx = idx;
-        pm->wait_list[i].slicesz = SLICE_SZ;
-        pm->wait_list[i].offset = i * SLICE_SZ;
-        pm->wait_list[i].next = (i != nslice-1) ? pm->wait_list + i + 1 : NULL;
+    for(i = 0; dp->blocks[i].state != BLOCK_FREE; i++) {
+        /* nothing */
     }
 
-    if(last_slicesz) {
-        pm->wait_list[nslice-1].slicesz = last_slicesz;
-    }
+    int piecesz = dp->idx == local->npieces-1 ? local->last_piecesz : local->piecesz;
+    sl->idx = dp->idx;
+    sl->offset = i * SLICE_SZ;
+    sl->slicesz = piecesz - sl->offset < SLICE_SZ ? piecesz - sl->offset : SLICE_SZ;
 
-    return 0;
+    dp->blocks[i].state = BLOCK_REQUESTED;
+    dp->blocks[i].nreq = 1;
+    dp->nfree--;
+    local->nfree--;
+
+    return sl;
 }
 
+/* every missing piece is in download and none has a free block left */
 int
-bitfield_get_request_piece(struct bitfield *local, struct bitfield *peer, struct peer_rcv_msg *pm)
+bitfield_all_requested(struct bitfield *local, int nleft)
 {
-    if(!local || !peer || !pm) {
-        LOG_ERROR("invalid param!\n");
-        return -1;
+    return !local->nfree && local->ndown >= nleft;
+}
+
+/* 
+ * endgame: a block already requested from others, the one asked from
+ * the fewest peers, that is not in 'reqs' of this peer yet.
+ */
+struct slice *
+bitfield_get_endgame_block(struct bitfield *local, struct bitfield *peer,
+                                                const struct slice *reqs)
+{
+    if(!local || !peer || !peer->bitmap) {
+        return NULL;
     }
-     
-    int downidx = -1;
-    struct pieces *tmp, **p = &peer->down_list;
-    while(*p) {
-        int idx = (*p)->idx;
-        int pidx = idx >> 3; /* idx/8 */
-        int bidx = idx & 7;  /* idx%8 */
-        unsigned char byte = local->bitmap[pidx];
-
-        if(byte & (1 << (7-bidx))) { /* local alread have */
-            tmp = *p;
-            *p = (*p)->next; /* remove it */
-            GFREE(tmp);
-        } else if(!bitfield_piece_find(local->down_list, idx)) { /* skip downloading */
-            downidx = idx;
-            p = &(*p)->next; 
-        } else if(!bitfield_rm_stoped_piece(local, pm, idx)) { /* pick stoped down piece */
-            tmp = *p;
-            *p = (*p)->next; /* remove it */
-            GFREE(tmp);
-            return 0;
-        } else {
-            tmp = *p; 
-            *p = (*p)->next; /* move it to downloading list */
-            tmp->next = local->down_list;
-            local->down_list = tmp;
-            return bitfield_build_slice_list(local, pm, tmp->idx);
+
+    struct down_piece *dp, *best = NULL;
+    int i, bi = 0;
+    for(dp = local->down_pieces; dp; dp = dp->next) {
+        if(dp->verifying || !bitfield_test(peer->bitmap, dp->idx)) {
+            continue;
+        }
+
+        for(i = 0; i < dp->nblock; i++) {
+            if(dp->blocks[i].state != BLOCK_REQUESTED
+                        || (best && dp->blocks[i].nreq >= best->blocks[bi].nreq)) {
+                continue;
+            }
+
+            const struct slice *r;
+            for(r = reqs; r && (r->idx != dp->idx || r->offset != i * SLICE_SZ); r = r->next) {
+                /* nothing */
+            }
+
+            if(!r) {
+                best = dp;
+                bi = i;
+            }
         }
     }
 
-    /* ok, we pick a downloading piece */
-    if(downidx != -1) {
-        return bitfield_build_slice_list(local, pm, downidx);
+    if(!best) {
+        return NULL;
     }
 
-    return -1;
+    struct slice *sl = GCALLOC(1, sizeof(*sl));
+    if(!sl) {
+        LOG_ERROR("out of memory!\n");
+        return NULL;
+    }
+
+    int piecesz = best->idx == local->npieces-1 ? local->last_piecesz : local->piecesz;
+    sl->idx = best->idx;
+    sl->offset = bi * SLICE_SZ;
+    sl->slicesz = piecesz - sl->offset < SLICE_SZ ? piecesz - sl->offset : SLICE_SZ;
+
+    best->blocks[bi].nreq++;
+
+    return sl;
 }
 
+/* a request that will not be answered, the block is free if no one else has it */
 int
-bitfield_rm_stoped_piece(struct bitfield *bf, struct peer_rcv_msg *pm, int idx)
+bitfield_release_block(struct bitfield *local, struct slice *sl)
 {
-    struct pieces **iter = &bf->stoped_list;
-    for(; *iter && (*iter)->idx != idx; iter = &(*iter)->next) {
-        /* nothing */
-    }
-    
-    if(!(*iter)) {
+    struct down_piece *dp = bitfield_down_piece_find(local, sl->idx);
+    if(!dp) {
         return -1;
     }
 
-    struct pieces *tmp = *iter;
-    *iter = tmp->next;
-
-    GFREE(pm->piecebuf);
-    pm->piecebuf = tmp->piecebuf;
-    pm->base = tmp->base;
-    pm->wait_list = tmp->wait_list;
-    pm->req_list = NULL;
-    pm->req_tail = &pm->req_list;
+    struct piece_block *blk = &dp->blocks[sl->offset / SLICE_SZ];
+    if(blk->state == BLOCK_REQUESTED && !--blk->nreq) {
+        blk->state = BLOCK_FREE;
+        dp->nfree++;
+        local->nfree++;
+    }
 
-    tmp->wait_list = NULL;
-    tmp->base = NULL;
-    tmp->piecebuf = NULL;
-    tmp->next = bf->down_list;
-    bf->down_list = tmp;
+    /* nothing downloaded and nobody on it, not worth the memory */
+    if(dp->nfree == dp->nblock) {
+        bitfield_down_piece_destroy(local, dp);
+    }
 
     return 0;
 }
 
+/* return 1 when it was the last block missing */
 int
-bitfield_add_piece_to_stoped_list(struct bitfield *bf, int idx, char *piecebuf,
-                                            struct slice *base, struct slice *wait_list)
+bitfield_block_received(struct bitfield *local, struct down_piece *dp, int offset)
 {
-    if(!bitfield_is_local_have(bf, idx)) {
-        GFREE(base);
-        GFREE(piecebuf);
+    struct piece_block *blk = &dp->blocks[offset / SLICE_SZ];
+    if(blk->state == BLOCK_RECEIVED) {
         return 0;
     }
 
-    struct pieces *p;
-    p = GCALLOC(1, sizeof(*p));
-    if(!p) {
-        LOG_ERROR("out of memory!\n");
-        GFREE(base);
-        GFREE(piecebuf);
-        return -1;
+    if(blk->state == BLOCK_FREE) {
+        dp->nfree--;
+        local->nfree--;
     }
-    
-    p->piecebuf = piecebuf;
-    p->idx = idx;
-    p->base = base;
-    p->wait_list = wait_list;
-
-    p->next = bf->stoped_list;
-    bf->stoped_list = p;
+    blk->state = BLOCK_RECEIVED;
+    blk->nreq = 0;
+    dp->nrecv++;
+    dp->atime = utils_mtime();
 
-    return 0;
+    return dp->nrecv == dp->nblock;
 }
 
-static void 
-bitfield_stoped_piece_remove(struct pieces **p, int idx)
+/* a partial piece whose blocks in 'donemap' are on disk, the rest is written through */
+int
+bitfield_restore_down_piece(struct bitfield *bf, int idx, const char *donemap)
 {
-    while(*p) {
-        if((*p)->idx == idx) {
-            struct pieces *tmp = *p;
-            *p = tmp->next;
-            GFREE(tmp->base);
-            GFREE(tmp->piecebuf);
-            GFREE(tmp);
-        } else {
-            p = &(*p)->next;
+    if(idx < 0 || idx >= bf->npieces || !donemap || bf->down_index[idx]) {
+        return -1;
+    }
+
+    struct down_piece *dp = bitfield_down_piece_add(bf, idx, NULL);
+    if(!dp) {
+        return -1;
+    }
+
+    int i;
+    for(i = 0; i < dp->nblock; i++) {
+        if(donemap[i >> 3] & (1 << (7 - (i & 7)))) {
+            bitfield_block_received(bf, dp, i * SLICE_SZ);
         }
     }
-}
 
+    if(!dp->nrecv || dp->nrecv == dp->nblock) { /* complete but not verified, download it again */
+        bitfield_down_piece_destroy(bf, dp);
+        return -1;
+    }
+
+    return 0;
+}
@@ -2,6 +2,7 @@
 #include <sys/epoll.h>
 #include <sys/socket.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -12,11 +13,20 @@
 #include "socket.h"
 #include "event.h"
 #include "mempool.h"
+#include "bitfield.h"
+#include "tormgr.h"
 
 struct usr_cmd {
     int epfd, fd;
     uint16 port;
+    struct torrent_mgr *mgr;
+};
+
+/* a command for a task, parsed on the loop the task is pinned to */
+struct usr_task_cmd {
     struct torrent_task *tsk;
+    int bufsz;
+    char msgbuf[128];
 };
 
 #define CLI  "USAGE:\n" \
@@ -24,11 +34,15 @@ struct usr_cmd {
              "2)MEMDUMP SECOND SIZE\n" \
              "3)LOG LEVEL FMT\n" \
              "4)DUMP PIECE\n" \
-             "5)DUMP BITMAP\n"
+             "5)DUMP BITMAP\n" \
+             "6)REQDEPTH MAX\n" \
+             "7)LIMIT PEERS DOWN(KB/s) UP(KB/s)\n"
              
 static int cmd_event_handle(int event, void *evt_ctx);
 static int cmd_add_event(struct usr_cmd *uc, int event);
 static int cmd_msg_parser(struct usr_cmd *uc, char *msgbuf, int bufsz);
+static int cmd_task_msg_parser(struct torrent_task *tsk, char *msgbuf, int bufsz);
+static int cmd_task_msg_handle(int event, void *evt_ctx);
 
 static int
 cmd_add_event(struct usr_cmd *uc, int event)
@@ -48,7 +62,7 @@ cmd_add_event(struct usr_cmd *uc, int event)
 }
 
 int
-cmd_init(struct torrent_task *tsk, int epfd)
+cmd_init(struct torrent_mgr *mgr, int epfd)
 {
     struct usr_cmd *uc;
     if(!(uc = GCALLOC(1, sizeof(*uc)))) {
@@ -57,7 +71,7 @@ cmd_init(struct torrent_task *tsk, int epfd)
     }
 
     uc->epfd = epfd;
-    uc->tsk = tsk;
+    uc->mgr = mgr;
     uc->fd = socket_udp_create(); 
     if(uc->fd < 0) {
         LOG_ERROR("create udp sock failed:%s\n", strerror(errno));
@@ -145,39 +159,124 @@ cmd_msg_parser(struct usr_cmd *uc, char *msgbuf, int bufsz)
         set_log_level(level, fmt);
     }
 
+    if(!memcmp(msgbuf, "LIMIT", 5)) {
+        char *ptr, *s = msgbuf+5;
+        errno = 0;
+
+        int peers = strtol(s, &ptr, 10);
+        s = ptr;
+        int down = strtol(s, &ptr, 10);
+        s = ptr;
+        int up = strtol(s, &ptr, 10);
+        if(errno) {
+            LOG_ERROR("invalid limit setting!\n");
+            return -1;
+        }
+
+        return torrent_mgr_set_limit(uc->mgr, peers, down * 1024, up * 1024);
+    }
+
+    struct torrent_task *tsk;
+    for(tsk = uc->mgr->tsklist; tsk; tsk = tsk->next) {
+        struct usr_task_cmd *utc = GCALLOC(1, sizeof(*utc));
+        if(!utc) {
+            LOG_ERROR("out of memory!\n");
+            return -1;
+        }
+
+        utc->tsk = tsk;
+        utc->bufsz = bufsz < (int)sizeof(utc->msgbuf) ? bufsz : (int)sizeof(utc->msgbuf) - 1;
+        memcpy(utc->msgbuf, msgbuf, utc->bufsz);
+
+        if(event_call(tsk->epfd, cmd_task_msg_handle, utc)) {
+            GFREE(utc);
+        }
+    }
+
+    return 0;
+}
+
+static int
+cmd_task_msg_handle(int event, void *evt_ctx)
+{
+    struct usr_task_cmd *utc = (struct usr_task_cmd *)evt_ctx;
+
+    pthread_mutex_lock(&utc->tsk->lock);
+    cmd_task_msg_parser(utc->tsk, utc->msgbuf, utc->bufsz);
+    pthread_mutex_unlock(&utc->tsk->lock);
+    GFREE(utc);
+
+    return 0;
+}
+
+/* the commands for each task */
+static int
+cmd_task_msg_parser(struct torrent_task *tsk, char *msgbuf, int bufsz)
+{
     if(!memcmp(msgbuf, "DUMP PIECE", 10)) {
         int64 totalsz = 0;
 
-        fprintf(stderr, "\nDUMP PIECES:\n");
-        struct pieces *p;
-        for(p = uc->tsk->bf.stoped_list; p; p = p->next) {
-            totalsz += uc->tsk->bf.piecesz;
-            fprintf(stderr, "piece[%d,%d]\n", p->idx, p->wait_list->offset);
+        fprintf(stderr, "\nDUMP PIECES[%s]:\n", tsk->tor.pathname);
+        struct down_piece *dp;
+        for(dp = tsk->bf.down_pieces; dp; dp = dp->next) {
+            totalsz += dp->piecebuf ? tsk->bf.piecesz : 0;
+            fprintf(stderr, "piece[%d][recv=%d,free=%d,total=%d,write=%d]%s\n", dp->idx,
+                    dp->nrecv, dp->nfree, dp->nblock, dp->nwrite,
+                    dp->verifying ? "[hashing]" : (dp->piecebuf ? "" : "[disk]"));
         }
 
         fprintf(stderr, "\nDUMP PEER:\n");
         int i, used = 0, now = time(NULL);
         for(i = 0; i < MAX_PEER_NUM; i++) {
-            struct peer *pr = &uc->tsk->pr[i];
+            struct peer *pr = &tsk->pr[i];
             if(pr->isused && pr->state == PEER_STATE_CONNECTD) {
-                fprintf(stderr, "peer[%s][%.8s][%d][rcvbuf=%p,sndbuf=%p]\n",
+                fprintf(stderr, "peer[%s][%.8s][%d][%dB/s,%dms,%d/%d]\n",
                         pr->strfaddr, pr->peerid, now - pr->start_time,
-                        pr->pm.piecebuf, pr->psm.piecedata);
+                        pr->pm.rate, pr->pm.rtt, pr->pm.nreq, pr->pm.reqdepth);
                 used++;
-            } else if(pr->pm.piecebuf || pr->psm.piecedata) {
-                fprintf(stderr, "memory leek!!!!:[%s][rcvbuf=%p,sndbuf=%p]\n",
-                        pr->strfaddr, pr->pm.piecebuf, pr->psm.piecedata);
+            } else if(pr->pm.req_list) {
+                fprintf(stderr, "request leek!!!!:[%s][%d]\n",
+                        pr->strfaddr, pr->pm.nreq);
             }
         }
 
-        fprintf(stderr, "PIECE[%d] totalsz = %lld, peer[%d]\n\n",
-                uc->tsk->bf.piecesz, totalsz, used);
+        fprintf(stderr, "PIECE[%d] totalsz = %lld, peer[%d], endgame[%d] dupsz = %lld\n",
+                tsk->bf.piecesz, totalsz, used, tsk->endgame, tsk->dup_size);
+        fprintf(stderr, "BUFFER[%d/%d] flushed[%d] through[%d]\n\n", tsk->bf.nbuf,
+                tsk->bf.maxbuf, tsk->nflush, tsk->nthrough);
+    }
+
+    if(!memcmp(msgbuf, "REQDEPTH", 8)) {
+        char *ptr, *s = msgbuf+8;
+        errno = 0;
+
+        int depth = strtol(s, &ptr, 10);
+        if(errno || depth < PEER_REQ_DEPTH_MIN) {
+            LOG_ERROR("invalid request depth setting[%d]!\n", depth);
+            return -1;
+        }
+
+        tsk->max_reqdepth = depth;
+        return 0;
+    }
+
+    if(!memcmp(msgbuf, "PIECEMEM", 8)) {
+        char *ptr, *s = msgbuf+8;
+        errno = 0;
+
+        int mb = strtol(s, &ptr, 10);
+        if(errno || mb < 0) {
+            LOG_ERROR("invalid piece memory setting[%d]!\n", mb);
+            return -1;
+        }
+
+        return bitfield_piecebuf_budget(&tsk->bf, (int64)mb * 1024 * 1024);
     }
 
     if(!memcmp(msgbuf, "DUMP BITMAP", 11)) {
         int i;
-        for(i = 0; i < uc->tsk->bf.nbyte; i++) {
-            fprintf(stderr, "0x%02X ", (uint8)uc->tsk->bf.bitmap[i]);
+        for(i = 0; i < tsk->bf.nbyte; i++) {
+            fprintf(stderr, "0x%02X ", (uint8)tsk->bf.bitmap[i]);
         }
         fprintf(stderr, "\n");
     }
@@ -1,4 +1,8 @@
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -7,27 +11,188 @@
 #include "btype.h"
 #include "event.h"
 #include "fd_hash.h"
+#include "timer.h"
 #include "log.h"
 
+static volatile sig_atomic_t event_quit;
+
+/*
+ * epoll hands back the slot pointer, a handler may delete a slot whose event
+ * is in a batch not dispatched yet, of its own loop or another one. a deleted
+ * slot is marked with the generation and its events are dropped, it is freed
+ * once every running loop has started an epoll_wait after that generation.
+ */
+struct event_slot {
+    struct event_param ep;
+    int deleted;
+    unsigned int gen;
+    struct event_slot *next;
+};
+
+/* a handler queued by event_call, run on the loop after its wakeup */
+struct event_call {
+    event_handle_t hdl;
+    void *ctx;
+    struct event_call *next;
+};
+
+/* a loop per epfd, 'wakefd' breaks its epoll_wait from another thread */
+struct event_base {
+    int epfd, wakefd;
+    struct event_call *calls, **calls_tail;
+    int running, spawned;
+    unsigned int wait; /* generation its last epoll_wait started at */
+    pthread_t tid;
+};
+
+static struct event_base event_bases[EVENT_MAX_LOOPS];
+static int event_nbase;
+
+/* guards the bases, their calls, the generation and the zombies */
+static pthread_mutex_t event_mutex = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int event_gen;
+static struct event_slot *event_zombies;
+
+static struct event_base *
+event_base_find(int epfd)
+{
+    if(epfd < 0) {
+        return NULL;
+    }
+
+    int i;
+    for(i = 0; i < event_nbase; i++) {
+        if(event_bases[i].epfd == epfd) {
+            return &event_bases[i];
+        }
+    }
+    return NULL;
+}
+
+static int
+event_wake_handle(int event, void *evt_ctx)
+{
+    struct event_base *eb = (struct event_base *)evt_ctx;
+
+    uint64_t cnt;
+    if(read(eb->wakefd, &cnt, sizeof(cnt)) != sizeof(cnt) && errno != EAGAIN) {
+        LOG_ALARM("event wakefd read failed:%s\n", strerror(errno));
+    }
+
+    pthread_mutex_lock(&event_mutex);
+    struct event_call *ec = eb->calls;
+    eb->calls = NULL;
+    eb->calls_tail = &eb->calls;
+    pthread_mutex_unlock(&event_mutex);
+
+    while(ec) {
+        struct event_call *tmp = ec;
+        ec = ec->next;
+        tmp->hdl(0, tmp->ctx);
+        GFREE(tmp);
+    }
+
+    return 0;
+}
+
 int
 event_create(void)
 {
-    int epfd = epoll_create(32);
-    if(epfd < 0) {
+    pthread_mutex_lock(&event_mutex);
+
+    if(event_nbase == EVENT_MAX_LOOPS) {
+        LOG_ERROR("too many event loops!\n");
+        goto FAILED;
+    }
+
+    struct event_base *eb = &event_bases[event_nbase];
+    memset(eb, 0, sizeof(*eb));
+    eb->calls_tail = &eb->calls;
+
+    eb->epfd = epoll_create(32);
+    if(eb->epfd < 0) {
         LOG_ERROR("epoll_create failed:%s\n", strerror(errno));
+        goto FAILED;
+    }
+
+    eb->wakefd = eventfd(0, EFD_NONBLOCK);
+    if(eb->wakefd < 0) {
+        LOG_ERROR("eventfd failed:%s\n", strerror(errno));
+        close(eb->epfd);
+        goto FAILED;
+    }
+
+    struct event_param ep;
+    ep.fd = eb->wakefd;
+    ep.event = EPOLLIN;
+    ep.evt_hdl = event_wake_handle;
+    ep.evt_ctx = eb;
+
+    /* the base is found by event_add */
+    event_nbase++;
+    if(event_add(eb->epfd, &ep)) {
+        event_nbase--;
+        close(eb->wakefd);
+        close(eb->epfd);
+        goto FAILED;
+    }
+
+    pthread_mutex_unlock(&event_mutex);
+
+    return eb->epfd;
+
+FAILED:
+    pthread_mutex_unlock(&event_mutex);
+    return -1;
+}
+
+int
+event_wakeup(int epfd)
+{
+    struct event_base *eb = event_base_find(epfd);
+    if(!eb) {
+        return -1;
+    }
+
+    uint64_t cnt = 1;
+    if(write(eb->wakefd, &cnt, sizeof(cnt)) != sizeof(cnt) && errno != EAGAIN) {
+        LOG_ALARM("event wakefd write failed:%s\n", strerror(errno));
         return -1;
     }
-    return epfd;
+
+    return 0;
 }
 
-static int
-check_event_param(int epfd, struct event_param *ep)
+int
+event_call(int epfd, event_handle_t hdl, void *ctx)
 {
-    if(epfd < 0 || !ep || ep->fd < 0) {
+    struct event_base *eb = event_base_find(epfd);
+    if(!eb || !hdl) {
+        return -1;
+    }
+
+    struct event_call *ec = GMALLOC(sizeof(*ec));
+    if(!ec) {
+        LOG_ERROR("out of memory!\n");
         return -1;
     }
 
-    if( !(ep->event & (EPOLLIN|EPOLLOUT)) ) {
+    ec->hdl = hdl;
+    ec->ctx = ctx;
+    ec->next = NULL;
+
+    pthread_mutex_lock(&event_mutex);
+    *eb->calls_tail = ec;
+    eb->calls_tail = &ec->next;
+    pthread_mutex_unlock(&event_mutex);
+
+    return event_wakeup(epfd);
+}
+
+static int
+check_event_param(int epfd, struct event_param *ep)
+{
+    if(epfd < 0 || !ep || ep->fd < 0) {
         return -1;
     }
 
@@ -41,33 +206,33 @@ check_event_param(int epfd, struct event_param *ep)
 int
 event_add(int epfd, struct event_param *ep)
 {
-    if(check_event_param(epfd, ep)) {
+    if(check_event_param(epfd, ep) || !(ep->event & (EPOLLIN|EPOLLOUT))) {
         LOG_ERROR("invalid event param!\n");
         return -1;
     }   
 
-    struct event_param *eparam;
-    eparam = GMALLOC(sizeof(*eparam));
-    if(!eparam) {
+    struct event_slot *es;
+    es = GCALLOC(1, sizeof(*es));
+    if(!es) {
         LOG_ERROR("out of memory!\n");
         return -1;
     }
-    *eparam = *ep;
+    es->ep = *ep;
 
-    if(fd_hash_add(ep->fd, eparam)) {
-        GFREE(eparam);
+    if(fd_hash_add(ep->fd, es)) {
+        GFREE(es);
         return -1;
     }
 
     struct epoll_event evt;
     memset(&evt, 0, sizeof(evt));
     evt.events = ep->event;
-    evt.data.fd = ep->fd;
+    evt.data.ptr = es;
 
     if(epoll_ctl(epfd, EPOLL_CTL_ADD, ep->fd, &evt)) {
         LOG_ERROR("epoll_add failed:%s\n", strerror(errno));
         fd_hash_del(ep->fd);
-        GFREE(eparam);
+        GFREE(es);
         return -1;
     }
 
@@ -81,18 +246,18 @@ event_mod(int epfd, struct event_param *ep)
         return -1;
     }
 
-    struct event_param *eparam;
-    eparam = (struct event_param *)fd_hash_find(ep->fd);
-    if(!eparam) {
+    struct event_slot *es;
+    es = (struct event_slot *)fd_hash_find(ep->fd);
+    if(!es) {
         fprintf(stderr, "no found fd:%d in fd hash!\n", ep->fd);
         return -1;
     }
-    *eparam = *ep;
+    es->ep = *ep;
 
     struct epoll_event evt;
     memset(&evt, 0, sizeof(evt));
     evt.events = ep->event;
-    evt.data.fd = ep->fd;
+    evt.data.ptr = es;
 
     if(epoll_ctl(epfd, EPOLL_CTL_MOD, ep->fd, &evt)) {
         fprintf(stderr, "event mod failed:%s\n", strerror(errno));
@@ -109,28 +274,34 @@ event_del(int epfd, struct event_param *ep)
         return -1;
     }
 
-    struct event_param *eparam;
-    eparam = (struct event_param *)fd_hash_find(ep->fd);
-    if(!eparam) {
+    struct event_slot *es;
+    es = (struct event_slot *)fd_hash_find(ep->fd);
+    if(!es) {
         LOG_ERROR("no found fd:%d in fd hash!\n", ep->fd);
         return -1;
     }
 
     fd_hash_del(ep->fd);
 
-    GFREE(eparam);
-
     struct epoll_event evt;
     memset(&evt, 0, sizeof(evt));
     evt.events = ep->event;
-    evt.data.fd = ep->fd;
 
+    int ret = 0;
     if(epoll_ctl(epfd, EPOLL_CTL_DEL, ep->fd, &evt)) {
         LOG_ERROR("event del failed:%s\n", strerror(errno));
-        return -1;
+        ret = -1;
     }
 
-    return 0;
+    /* after the del, a wait that starts later can not return it */
+    pthread_mutex_lock(&event_mutex);
+    es->deleted = 1;
+    es->gen = event_gen;
+    es->next = event_zombies;
+    event_zombies = es;
+    pthread_mutex_unlock(&event_mutex);
+
+    return ret;
 }
 
 static void
@@ -145,14 +316,10 @@ dump_event(int event)
 }
 
 static int
-event_dispatch(int epfd, int event, int fd)
+event_dispatch(int epfd, int event, struct event_slot *es)
 {
-    struct event_param *ep;
-
-    ep = fd_hash_find(fd);
-    if(!ep || !ep->evt_hdl) {
-        LOG_ERROR("dispatch: no found fd:%d in fd hash!\n", fd);
-        epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+    /* deleted by a handler earlier in this batch */
+    if(es->deleted) {
         return -1;
     }
 
@@ -160,32 +327,192 @@ event_dispatch(int epfd, int event, int fd)
     dump_event(event);
 #endif
 
-    (*ep->evt_hdl)(event, ep->evt_ctx);
+    (*es->ep.evt_hdl)(event, es->ep.evt_ctx);
 
     return 0;
 }
 
+/*
+ * a new generation for the epoll_wait 'eb' is about to start, the slots
+ * deleted before the oldest wait of all running loops are freed.
+ */
+static void
+event_wait_begin(struct event_base *eb)
+{
+    pthread_mutex_lock(&event_mutex);
+
+    eb->wait = ++event_gen;
+    eb->running = 1;
+
+    unsigned int oldest = eb->wait;
+    int i;
+    for(i = 0; i < event_nbase; i++) {
+        struct event_base *b = &event_bases[i];
+        if(b->running && (int)(b->wait - oldest) < 0) {
+            oldest = b->wait;
+        }
+    }
+
+    struct event_slot *es, **pes = &event_zombies;
+    while((es = *pes)) {
+        if((int)(oldest - es->gen) > 0) {
+            *pes = es->next;
+            GFREE(es);
+        } else {
+            pes = &es->next;
+        }
+    }
+
+    pthread_mutex_unlock(&event_mutex);
+}
+
+static void
+event_wait_end(struct event_base *eb)
+{
+    pthread_mutex_lock(&event_mutex);
+    eb->running = 0;
+    pthread_mutex_unlock(&event_mutex);
+}
+
 int
 event_loop(int epfd)
 {
+    struct event_base *eb = event_base_find(epfd);
+    if(!eb) {
+        LOG_ERROR("epfd %d is not from event_create!\n", epfd);
+        return -1;
+    }
+
     struct epoll_event evts[1024];
+    int ret = 0;
+
+    while(!event_quit) {
+        int timeout = timer_expire(epfd);
+
+        event_wait_begin(eb);
+
+        int nevt = epoll_wait(epfd, evts, sizeof(evts)/sizeof(evts[0]), timeout);
 
-    while(1) {
-        int nevt = epoll_wait(epfd, evts, sizeof(evts)/sizeof(evts[0]), -1);
         if(nevt < 0) {
             if(errno == EINTR) {
                 continue;
             }
             LOG_FATAL("epoll_wait failed:%s\n", strerror(errno));
-            return -1;
+            ret = -1;
+            break;
         }
 
         int i;
         for(i = 0; i < nevt; i++) {
-            event_dispatch(epfd, evts[i].events, evts[i].data.fd);
+            event_dispatch(epfd, evts[i].events, evts[i].data.ptr);
+        }
+    }
+
+    event_wait_end(eb);
+
+    return ret;
+}
+
+static void *
+event_loop_thread_func(void *arg)
+{
+    struct event_base *eb = (struct event_base *)arg;
+    event_loop(eb->epfd);
+    return NULL;
+}
+
+/* signals stay with the main thread, its loop sees the quit flag first */
+int
+event_loop_spawn(int epfd)
+{
+    struct event_base *eb = event_base_find(epfd);
+    if(!eb || eb->spawned) {
+        return -1;
+    }
+
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    int err = pthread_create(&eb->tid, NULL, event_loop_thread_func, eb);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if(err) {
+        LOG_ERROR("create event loop thread failed:%s\n", strerror(err));
+        return -1;
+    }
+
+    eb->spawned = 1;
+
+    return 0;
+}
+
+/* after event_loop_quit, the spawned loops are woken up and joined */
+int
+event_loop_join(void)
+{
+    event_quit = 1;
+
+    int i;
+    for(i = 0; i < event_nbase; i++) {
+        struct event_base *eb = &event_bases[i];
+        if(!eb->spawned) {
+            continue;
         }
+        event_wakeup(eb->epfd);
+        pthread_join(eb->tid, NULL);
+        eb->spawned = 0;
+    }
+
+    return 0;
+}
+
+int
+event_destroy(int epfd)
+{
+    struct event_base *eb = event_base_find(epfd);
+    if(!eb || eb->spawned || eb->running) {
+        return -1;
+    }
+
+    struct event_param ep;
+    memset(&ep, 0, sizeof(ep));
+    ep.fd = eb->wakefd;
+    event_del(epfd, &ep);
+    close(eb->wakefd);
+
+    pthread_mutex_lock(&event_mutex);
+
+    close(eb->epfd);
+    eb->epfd = -1;
+
+    /* calls that came after the loop quit are dropped, their ctx is the caller's */
+    while(eb->calls) {
+        struct event_call *ec = eb->calls;
+        eb->calls = ec->next;
+        GFREE(ec);
+    }
+    eb->calls_tail = &eb->calls;
+
+    int i, live = 0;
+    for(i = 0; i < event_nbase; i++) {
+        live += event_bases[i].epfd >= 0;
+    }
+
+    /* the last loop is gone, no wait can return a zombie */
+    while(!live && event_zombies) {
+        struct event_slot *es = event_zombies;
+        event_zombies = es->next;
+        GFREE(es);
     }
 
+    pthread_mutex_unlock(&event_mutex);
+
     return 0;
 }
 
+/* safe to call from a signal handler */
+void
+event_loop_quit(void)
+{
+    event_quit = 1;
+}
@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 #include "fd_hash.h"
 #include "mempool.h"
 #include "log.h"
@@ -19,6 +20,9 @@ struct _fd_hash {
 
 static struct _fd_hash fd_hash;
 
+/* fds of all event loops are in the one hash */
+static pthread_mutex_t fd_hash_lock = PTHREAD_MUTEX_INITIALIZER;
+
 int
 fd_hash_add(int fd, void *usrctx)
 {
@@ -36,9 +40,11 @@ fd_hash_add(int fd, void *usrctx)
     hs->fd = fd;
     hs->usrctx = usrctx;
 
+    pthread_mutex_lock(&fd_hash_lock);
     hs->next = fd_hash.slots[fd % BUKET_NUM];
     fd_hash.slots[fd % BUKET_NUM] = hs;
     fd_hash.used++;
+    pthread_mutex_unlock(&fd_hash_lock);
 
     return 0;
 }
@@ -50,38 +56,51 @@ fd_hash_find(int fd)
         return NULL;
     }
 
+    void *usrctx = NULL;
     struct hash_slot *hs;
+
+    pthread_mutex_lock(&fd_hash_lock);
     hs = fd_hash.slots[fd % BUKET_NUM];
     while(hs) {
         if(hs->fd == fd) {
-           return hs->usrctx; 
+           usrctx = hs->usrctx; 
+           break;
         }
         hs = hs->next;
     }
+    pthread_mutex_unlock(&fd_hash_lock);
 
-    return NULL;
+    return usrctx;
 }
 
 int
 fd_hash_del(int fd)
 {
-    if(fd < 0 || fd_hash.used <= 0) {
+    if(fd < 0) {
         return -1;
     }
 
-    struct hash_slot *del, **hs;
+    struct hash_slot *del = NULL, **hs;
+
+    pthread_mutex_lock(&fd_hash_lock);
     hs = &fd_hash.slots[fd % BUKET_NUM];
     while(*hs) {
         if((*hs)->fd == fd) {
             del = (*hs);
             *hs = (*hs)->next;
-            GFREE(del);
             fd_hash.used--;
-            return 0; 
+            break;
         }
         hs = &(*hs)->next;
     }
+    pthread_mutex_unlock(&fd_hash_lock);
 
-    return -1;
+    if(!del) {
+        return -1;
+    }
+
+    GFREE(del);
+
+    return 0;
 }
 
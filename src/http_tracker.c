@@ -32,18 +32,16 @@ static int
 tracker_timeout_handle(int event, void *evt_ctx)
 {
     struct tracker *tr = (struct tracker *) evt_ctx;
+    struct torrent_task *tsk = tr->tsk;
 
     LOG_INFO("handle (%s:%s) timeout\n", tr->tp.host, tr->tp.port);
 
-    long long tmrbuf;
-    if(read(tr->tmrfd, &tmrbuf, sizeof(tmrbuf)) != sizeof(tmrbuf)) {
-        LOG_ALARM("read timer fd failed\n");
-    }
-
+    pthread_mutex_lock(&tsk->lock);
     tracker_destroy_timer(tr);
     tracker_del_event(tr);
 	tracker_reset_members(tr);
-	torrent_tracker_recycle(tr->tsk, tr, 0);
+	torrent_tracker_recycle(tsk, tr, 0);
+    pthread_mutex_unlock(&tsk->lock);
 
     return 0;
 }
@@ -269,11 +267,8 @@ FREE:
 }
 
 static int
-tracker_event_handle(int event, void *evt)
+tracker_event_state(int event, struct tracker *tr)
 {
-    struct tracker *tr;
-
-    tr = (struct tracker *)evt;
     switch(tr->state) {
         case TRACKER_STATE_CONNECTING:
             return tracker_event_handle_connecting(event, tr);
@@ -288,6 +283,19 @@ tracker_event_handle(int event, void *evt)
     return -1;
 }
 
+static int
+tracker_event_handle(int event, void *evt)
+{
+    struct tracker *tr = (struct tracker *)evt;
+    struct torrent_task *tsk = tr->tsk;
+
+    pthread_mutex_lock(&tsk->lock);
+    int ret = tracker_event_state(event, tr);
+    pthread_mutex_unlock(&tsk->lock);
+
+    return ret;
+}
+
 int
 tracker_http_announce(struct tracker *tr)
 {
@@ -1,3 +1,4 @@
+#include <unistd.h>
 #include <time.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -12,9 +13,11 @@
 #include "bitfield.h"
 #include "utils.h"
 #include "tortask.h"
+#include "tormgr.h"
 #include "mempool.h"
+#include "sha1_accel.h"
 
-extern int cmd_init(struct torrent_task *tsk, int epfd);
+extern int cmd_init(struct torrent_mgr *mgr, int epfd);
 
 #define BT_VERSION "-WS0001-"
 char peer_id[PEER_ID_LEN + 1];
@@ -36,22 +39,56 @@ build_peer_id(void)
     LOG_DEBUG("our peer id: %s\n", peer_id);
 }
 
+static void
+quit_handle(int signo)
+{
+    event_loop_quit();
+}
+
 static int
 usage(void)
 {
-    LOG_ERROR("Usage:./bittorrent torfile\n");
+    LOG_ERROR("Usage:./bittorrent [-l loops] [-c peers] [-d down KB/s] [-u up KB/s] torfile...\n");
     return -1;
 }
 
 int
 main(int argc, char *argv[])
 {
-    if(argc != 2) {
+    int opt, nloop = EVENT_LOOP_THREADS, max_peer = MGR_MAX_PEERS, down = 0, up = 0;
+    while((opt = getopt(argc, argv, "l:c:d:u:")) != -1) {
+        switch(opt) {
+            case 'l':
+                nloop = atoi(optarg);
+                break;
+            case 'c':
+                max_peer = atoi(optarg);
+                break;
+            case 'd':
+                down = atoi(optarg) * 1024;
+                break;
+            case 'u':
+                up = atoi(optarg) * 1024;
+                break;
+            default:
+                return usage();
+        }
+    }
+
+    if(optind >= argc) {
         return usage();
     }
 
     signal(SIGPIPE, SIG_IGN);
 
+    /* no SA_RESTART, epoll_wait returns EINTR and the loop sees the flag */
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = quit_handle;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
     set_log_level(LOG_LEVEL_DEBUG, LOG_TIME_FMT_SHORT);
 
     build_peer_id();
@@ -70,28 +107,60 @@ main(int argc, char *argv[])
         LOG_ERROR("set timezone failed:%s!\n", strerror(errno));
     }
     
+    sha1_accel_init();
+
     int epfd = event_create();
     if(epfd < 0) {
         LOG_ERROR("event_create failed!\n");           
         return -1;
     }
 
-	struct torrent_task tsk;
-    if(torrent_task_init(&tsk, epfd, argv[1])) {
-        LOG_ERROR("torrent task init failed!\n");
+    struct torrent_mgr mgr;
+    if(torrent_mgr_init(&mgr, epfd, nloop)) {
+        LOG_ERROR("torrent manager init failed!\n");
+        return -1;
+    }
+
+    if(torrent_mgr_set_limit(&mgr, max_peer, down, up)) {
+        return usage();
+    }
+
+    int i;
+    for(i = optind; i < argc; i++) {
+        if(torrent_mgr_add_task(&mgr, argv[i])) {
+            LOG_ERROR("torrent task %s init failed!\n", argv[i]);
+        }
+    }
+
+    if(!mgr.ntask) {
+        LOG_ERROR("no torrent task!\n");
         return -1;
     }
 
-    if(cmd_init(&tsk, epfd)) {
+    if(cmd_init(&mgr, epfd)) {
         LOG_ALARM("cmd init failed!\n");
     }
 
+    /* a task pinned to a loop that can't run would never move */
+    if(torrent_mgr_start_loops(&mgr)) {
+        LOG_ERROR("event loops start failed!\n");
+        event_loop_quit();
+    }
+
     LOG_INFO("main thread enter event loop...\n");
 
-    if(event_loop(tsk.epfd)) {
+    if(event_loop(mgr.epfd)) {
         LOG_INFO("event loop quit!\n");
     }
 
+    event_loop_join();
+
+    torrent_mgr_uninit(&mgr);
+
+    event_destroy(epfd);
+
+    LOG_INFO("bye!\n");
+
     return 0;
 }
 
@@ -1,5 +1,7 @@
+#include <sys/mman.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <time.h>
 #include <error.h>
@@ -10,13 +12,22 @@
 #ifdef USED_MEMPOOL
 
 #define MAGIC (0xdeadbeaf)
+#define FREE_MAGIC (0xfeeefeee)
 #define HUGE_SIZE (0x7fffffff)
 
+/* free units are chained through their buffer */
+#define MEM_UNIT_NEXT(mu) (*(struct mem_unit **)((mu) + 1))
+
+#define MEM_SLAB_HDRSZ ((sizeof(struct mem_slab) + 15) & ~15)
+#define MEM_SLAB_OF(mu) ((struct mem_slab *)((uintptr_t)(mu) & ~(uintptr_t)(MEM_SLAB_SIZE-1)))
+#define MEM_IS_SLAB(mpu) ((mpu)->unitsz <= MEM_SLAB_MAX_UNITSZ)
+
 static int mempool_do_init(struct mempool *mp);
 static int mempool_do_uninit(struct mempool *mp);
 static int mem_get_pool_type(struct mempool *mp, int size);
 static void *mem_do_alloc(struct mempool_unit *mpu, int size, const char *file, int line);
 static int mem_do_free(struct mempool_unit *mpu, struct mem_unit *mu, const char *file, int line);
+static struct mem_unit *mem_get_unit(void *addr, const char *file, int line);
 
 static int mem_config[MEM_POOL_TYPE_NUM] =
        {16, 64, 256, 512, 1024, 2048, 4096, 16*1024, 512*1024, HUGE_SIZE};
@@ -30,9 +41,17 @@ mempool_do_init(struct mempool *mp)
     for(i = 0; i < MEM_POOL_TYPE_NUM; i++) {
         mp->pool[i].pool[MEM_POOL_FREE] = NULL;
         mp->pool[i].pool[MEM_POOL_USED] = NULL;
+        mp->pool[i].type = i;
         mp->pool[i].unitsz = mem_config[i];
         mp->pool[i].nused = 0;
         mp->pool[i].ntotals = 0;
+        mp->pool[i].nused_max = 0;
+        mp->pool[i].nslab = 0;
+        mp->pool[i].nslab_max = 0;
+        mp->pool[i].usedsz = 0;
+        mp->pool[i].slabs = NULL;
+        mp->pool[i].full_slabs = NULL;
+        pthread_mutex_init(&mp->pool[i].lock, NULL);
     }
 
     mp->magic = MAGIC;
@@ -43,16 +62,37 @@ mempool_do_init(struct mempool *mp)
 static int
 mempool_do_uninit(struct mempool *mp)
 {
-    int i, k;
+    int i;
     for(i = 0; i < MEM_POOL_TYPE_NUM; i++) {
-        struct mem_unit *tmp, *mu;
-        for(k = 0; k < MEM_POOL_NUM; k++) {
-            for(mu = mp->pool[i].pool[k]; mu; ) {
-                tmp = mu;
-                mu = mu->next;
-                free(tmp);
+        struct mempool_unit *mpu = &mp->pool[i];
+        if(MEM_IS_SLAB(mpu)) {
+            struct mem_slab *slab, *next;
+            for(slab = mpu->slabs; slab; slab = next) {
+                next = slab->next;
+                munmap(slab, MEM_SLAB_SIZE);
+            }
+            for(slab = mpu->full_slabs; slab; slab = next) {
+                next = slab->next;
+                munmap(slab, MEM_SLAB_SIZE);
             }
+            pthread_mutex_destroy(&mpu->lock);
+            continue;
         }
+
+        struct mem_unit *tmp, *mu;
+        for(mu = mpu->pool[MEM_POOL_FREE]; mu; ) {
+            tmp = mu;
+            mu = MEM_UNIT_NEXT(mu);
+            free(tmp);
+        }
+#ifdef MEMPOOL_DEBUG
+        for(mu = mpu->pool[MEM_POOL_USED]; mu; ) {
+            tmp = mu;
+            mu = mu->next;
+            free(tmp);
+        }
+#endif
+        pthread_mutex_destroy(&mpu->lock);
     }
 
     mp->magic = 0;
@@ -109,65 +149,239 @@ mem_get_pool_type(struct mempool *mp, int size)
     return i;
 }
 
+static void
+mem_slab_unlink(struct mem_slab **head, struct mem_slab *slab)
+{
+    if(slab->prev) {
+        slab->prev->next = slab->next;
+    } else {
+        *head = slab->next;
+    }
+    if(slab->next) {
+        slab->next->prev = slab->prev;
+    }
+    slab->prev = slab->next = NULL;
+}
+
+static void
+mem_slab_push(struct mem_slab **head, struct mem_slab *slab)
+{
+    slab->prev = NULL;
+    slab->next = *head;
+    if(*head) {
+        (*head)->prev = slab;
+    }
+    *head = slab;
+}
+
+/* mmap twice the size and trim, the slab of a unit is found by masking */
+static struct mem_slab*
+mem_slab_create(struct mempool_unit *mpu)
+{
+    char *p = mmap(NULL, MEM_SLAB_SIZE * 2, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if(p == MAP_FAILED) {
+        return NULL;
+    }
+
+    char *start = (char *)(((uintptr_t)p + MEM_SLAB_SIZE - 1) & ~(uintptr_t)(MEM_SLAB_SIZE-1));
+    if(start != p) {
+        munmap(p, start - p);
+    }
+    munmap(start + MEM_SLAB_SIZE, p + MEM_SLAB_SIZE * 2 - (start + MEM_SLAB_SIZE));
+
+    struct mem_slab *slab = (struct mem_slab *)start;
+    slab->free = NULL;
+    slab->nused = slab->ncarved = slab->full = 0;
+    slab->nunits = (MEM_SLAB_SIZE - MEM_SLAB_HDRSZ) / (sizeof(struct mem_unit) + mpu->unitsz);
+
+    mem_slab_push(&mpu->slabs, slab);
+
+    mpu->ntotals += slab->nunits;
+    if(++mpu->nslab > mpu->nslab_max) {
+        mpu->nslab_max = mpu->nslab;
+    }
+
+    return slab;
+}
+
+static void
+mem_slab_destroy(struct mempool_unit *mpu, struct mem_slab *slab)
+{
+    mem_slab_unlink(&mpu->slabs, slab);
+    mpu->ntotals -= slab->nunits;
+    mpu->nslab--;
+    munmap(slab, MEM_SLAB_SIZE);
+}
+
+/* a whole slab of units is carved lazily, a page is touched when first used */
+static struct mem_unit*
+mem_slab_alloc(struct mempool_unit *mpu)
+{
+    struct mem_slab *slab = mpu->slabs;
+    if(!slab && !(slab = mem_slab_create(mpu))) {
+        return NULL;
+    }
+
+    struct mem_unit *mu;
+    if(slab->free) {
+        mu = slab->free;
+        slab->free = MEM_UNIT_NEXT(mu);
+    } else {
+        mu = (struct mem_unit *)((char *)slab + MEM_SLAB_HDRSZ
+                    + slab->ncarved * (sizeof(struct mem_unit) + mpu->unitsz));
+        slab->ncarved++;
+    }
+
+    if(++slab->nused == slab->nunits) {
+        mem_slab_unlink(&mpu->slabs, slab);
+        mem_slab_push(&mpu->full_slabs, slab);
+        slab->full = 1;
+    }
+
+    return mu;
+}
+
+static void
+mem_slab_free(struct mempool_unit *mpu, struct mem_unit *mu)
+{
+    struct mem_slab *slab = MEM_SLAB_OF(mu);
+
+    MEM_UNIT_NEXT(mu) = slab->free;
+    slab->free = mu;
+    slab->nused--;
+
+    if(slab->full) {
+        mem_slab_unlink(&mpu->full_slabs, slab);
+        mem_slab_push(&mpu->slabs, slab);
+        slab->full = 0;
+    }
+
+    /* give an empty slab back to the os, unless it is the last one with room */
+    if(!slab->nused && (slab->prev || slab->next)) {
+        mem_slab_destroy(mpu, slab);
+    }
+}
+
 static void* 
-mem_do_alloc(struct mempool_unit *mpu, int size, const char *file, int line)
+mem_unit_alloc(struct mempool_unit *mpu, int size, const char *file, int line)
 {
     struct mem_unit *mu = NULL;
+    int mallocsz = mpu->unitsz == HUGE_SIZE ? size : mpu->unitsz;
 
-    mpu->ntotals++;
-    if(mpu->pool[MEM_POOL_FREE]) {
+    if(MEM_IS_SLAB(mpu)) {
+        mu = mem_slab_alloc(mpu);
+    } else if(mpu->pool[MEM_POOL_FREE]) {
         mu = mpu->pool[MEM_POOL_FREE];
-        mpu->pool[MEM_POOL_FREE] = mu->next;
-        mpu->ntotals--;
+        mpu->pool[MEM_POOL_FREE] = MEM_UNIT_NEXT(mu);
+    } else if((mu = malloc(sizeof(*mu) + mallocsz))) {
+        mpu->ntotals++;
     }
 
-    int mallocsz = mpu->unitsz == HUGE_SIZE ? size : mpu->unitsz;
-
-    if(!mu && !(mu = malloc(sizeof(*mu) + mallocsz))) {
+    if(!mu) {
         LOG_ERROR("out of memory[%d,%d,%s]!\n", mallocsz, line, file);
-        mpu->ntotals--;
         return NULL;
     }
 
     mu->magic = MAGIC;
-    mu->buffer = (char*)(mu + 1);
+    mu->type = mpu->type;
     mu->size = size;
+
+#ifdef MEMPOOL_DEBUG
     mu->file = file;
     mu->line = line;
     mu->time = time(NULL);
 
+    mu->prev = NULL;
     mu->next = mpu->pool[MEM_POOL_USED];
+    if(mu->next) {
+        mu->next->prev = mu;
+    }
     mpu->pool[MEM_POOL_USED] = mu;
-    mpu->nused++;
+#endif
 
-    return mu->buffer;
+    if(++mpu->nused > mpu->nused_max) {
+        mpu->nused_max = mpu->nused;
+    }
+    mpu->usedsz += mallocsz;
+
+    return mu + 1;
 }
 
 static int
-mem_do_free(struct mempool_unit *mpu, struct mem_unit *mu, const char *file, int line)
+mem_unit_free(struct mempool_unit *mpu, struct mem_unit *mu, const char *file, int line)
 {
-    struct mem_unit **iter;
+#ifdef MEMPOOL_DEBUG
+    if(mu->prev) {
+        mu->prev->next = mu->next;
+    } else {
+        mpu->pool[MEM_POOL_USED] = mu->next;
+    }
+    if(mu->next) {
+        mu->next->prev = mu->prev;
+    }
+#endif
 
-    for(iter = &mpu->pool[MEM_POOL_USED]; *iter && mu != *iter; iter = &(*iter)->next) {
-        /* nothing */
+    mpu->nused--;
+
+    if(mpu->unitsz == HUGE_SIZE) {
+        mpu->usedsz -= mu->size;
+        mpu->ntotals--;
+        mu->magic = FREE_MAGIC;
+        free(mu);
+        return 0;
     }
 
-    if(*iter) {
-        *iter = (*iter)->next;
-        if(mpu->unitsz == HUGE_SIZE) {
-            free(mu);
-            mpu->ntotals--;
-        } else {
-            mu->next = mpu->pool[MEM_POOL_FREE];
-            mpu->pool[MEM_POOL_FREE] = mu;
-        }
-        mpu->nused--;
+    mpu->usedsz -= mpu->unitsz;
+
+    mu->magic = FREE_MAGIC;
+    if(MEM_IS_SLAB(mpu)) {
+        mem_slab_free(mpu, mu);
         return 0;
     }
 
-    LOG_ERROR("mem free failed: can't find mu[%X][%d,%s]!\n", mu, line, file);
+    MEM_UNIT_NEXT(mu) = mpu->pool[MEM_POOL_FREE];
+    mpu->pool[MEM_POOL_FREE] = mu;
+
+    return 0;
+}
+
+static void*
+mem_do_alloc(struct mempool_unit *mpu, int size, const char *file, int line)
+{
+    pthread_mutex_lock(&mpu->lock);
+    void *buf = mem_unit_alloc(mpu, size, file, line);
+    pthread_mutex_unlock(&mpu->lock);
+
+    return buf;
+}
+
+static int
+mem_do_free(struct mempool_unit *mpu, struct mem_unit *mu, const char *file, int line)
+{
+    pthread_mutex_lock(&mpu->lock);
+    int ret = mem_unit_free(mpu, mu, file, line);
+    pthread_mutex_unlock(&mpu->lock);
+
+    return ret;
+}
+
+static struct mem_unit*
+mem_get_unit(void *addr, const char *file, int line)
+{
+    struct mem_unit *mu;
+    mu = (struct mem_unit *)((char *)addr - sizeof(*mu));
+
+    if(mu->magic == FREE_MAGIC) {
+        LOG_ERROR("double free[%p][%d,%s]!\n", addr, line, file);
+        return NULL;
+    }
+
+    if(mu->magic != MAGIC || mu->type < 0 || mu->type >= MEM_POOL_TYPE_NUM) {
+        LOG_ERROR("invalid mem unit[%p][%d,%s]!\n", addr, line, file);
+        return NULL;
+    }
 
-    return -1;
+    return mu;
 }
 
 void*
@@ -219,20 +433,20 @@ mem_realloc(struct mempool *mp, void *addr, int size, const char *file, int line
         return mem_malloc(mp, size, file, line);
     }
 
-    struct mem_unit *mu;
-    mu = (struct mem_unit *)((char *)addr - sizeof(*mu));
-    if(mu->magic != MAGIC) {
-        LOG_ERROR("mem realloc failed[%d,%s]!\n", line, file);
+    struct mem_unit *mu = mem_get_unit(addr, file, line);
+    if(!mu) {
         return NULL;
     }
 
-    int idx = mem_get_pool_type(mp, mu->size);
+    int idx = mu->type;
     if(mp->pool[idx].unitsz != HUGE_SIZE && mp->pool[idx].unitsz >= size) {
         mu->size = size;
+#ifdef MEMPOOL_DEBUG
         mu->file = file;
         mu->line = line;
         mu->time = time(NULL);
-        return mu->buffer;
+#endif
+        return mu + 1;
     }
 
     int new_idx = mem_get_pool_type(mp, size);
@@ -241,7 +455,7 @@ mem_realloc(struct mempool *mp, void *addr, int size, const char *file, int line
         return NULL;
     }
     
-    memcpy(newbuf, mu->buffer, mu->size);
+    memcpy(newbuf, addr, mu->size < size ? mu->size : size);
 
     mem_do_free(&mp->pool[idx], mu, file, line);
 
@@ -260,16 +474,12 @@ mem_free(struct mempool *mp, void *addr, const char *file, int line)
         return 0;
     }
 
-    struct mem_unit *mu;
-    mu = (struct mem_unit *)((char *)addr - sizeof(*mu));
-    if(mu->magic != MAGIC) {
-        LOG_ERROR("mem free failed[%d,%s]!\n", line, file);
+    struct mem_unit *mu = mem_get_unit(addr, file, line);
+    if(!mu) {
         return -1;
     }
 
-    int idx = mem_get_pool_type(mp, mu->size);
-
-    return mem_do_free(&mp->pool[idx], mu, file, line);
+    return mem_do_free(&mp->pool[mu->type], mu, file, line);
 }
 
 char*
@@ -294,19 +504,19 @@ mem_strdup(struct mempool *mp, const char *s, const char *file, int line)
 static void
 mem_state_dump(struct mempool *mp)
 {
-    fprintf(stderr, "nused    ntotal    size\n");
+    fprintf(stderr, "nused    ntotal    hiwater  slabs  hislabs    size\n");
 
     int64 i, totalsz = 0;
     for(i = 0; i < MEM_POOL_TYPE_NUM; i++) {
         struct mempool_unit *mpu = &mp->pool[i];
-        fprintf(stderr, "%06d %06d %09d\n", mpu->nused, mpu->ntotals, mpu->unitsz);
-        if(i != MEM_POOL_TYPE_HUGE) {
-            totalsz += mpu->ntotals * mpu->unitsz;
+        fprintf(stderr, "%06d %06d %06d %04d %04d %09d\n", mpu->nused, mpu->ntotals,
+                    mpu->nused_max, mpu->nslab, mpu->nslab_max, mpu->unitsz);
+        if(MEM_IS_SLAB(mpu)) {
+            totalsz += (int64)mpu->nslab * MEM_SLAB_SIZE;
+        } else if(i != MEM_POOL_TYPE_HUGE) {
+            totalsz += (int64)mpu->ntotals * mpu->unitsz;
         } else {
-            struct mem_unit *mu = mpu->pool[MEM_POOL_USED];
-            for(; mu; mu = mu->next) {
-                totalsz += mu->size;
-            }
+            totalsz += mpu->usedsz;
         }
     }
 
@@ -327,6 +537,7 @@ mem_dump(struct mempool *mp, int second, int size)
         return; 
     }
 
+#ifdef MEMPOOL_DEBUG
     int i, now = time(NULL);
 
     fprintf(stderr, "size   second    line    file\n");
@@ -347,6 +558,9 @@ mem_dump(struct mempool *mp, int second, int size)
                 strrchr(mu->file, '/') ? strrchr(mu->file, '/')+1 : mu->file);
         }
     }
+#else
+    fprintf(stderr, "build with MEMPOOL_DEBUG for the allocation list\n");
+#endif
 }
 
 #endif
@@ -1,6 +1,8 @@
 #include <sys/epoll.h>
+#include <sys/socket.h>
 #include <sys/uio.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -15,10 +17,11 @@
 #include "bitfield.h"
 #include "torrent.h"
 #include "tortask.h"
+#include "tormgr.h"
 #include "utils.h"
 #include "mempool.h"
 
-#define MAX_BUFFER_LEN (1024*8)
+#define MAX_BUFFER_LEN (1024*16)
 
 extern char peer_id[];
 
@@ -26,7 +29,7 @@ static int peer_reset_member(struct peer *pr);
 
 static int peer_socket_init(struct peer *pr);
 
-static int peer_check_piece_sha1(struct peer *pr, int idx);
+static int peer_check_piece_sha1(struct peer *pr, struct down_piece *dp);
 static int peer_down_complete_slice(struct peer *pr);
 static int peer_check_download_slice(struct peer *pr, int idx, int offset, int slicesz);
 
@@ -45,8 +48,6 @@ static int peer_stop_timer(struct peer *pr);
 static int peer_destroy_timer(struct peer *pr);
 static int peer_start_timer(struct peer *pr);
 
-static int peer_send_data(struct peer *pr, char *data, int len);
-static int peer_recv_data(struct peer *pr, char *rcvbuf, int buflen);
 
 static int peer_send_handshake_msg(struct peer *pr);
 static int peer_recv_handshake_msg(struct peer *pr);
@@ -64,7 +65,8 @@ static int peer_send_notintrested_msg(struct peer *pr);
 static int peer_send_have_msg(struct peer *pr);
 static int peer_send_request_msg(struct peer *pr, struct peer_rcv_msg *pm);
 static int peer_send_cancel_msg(struct peer *pr, int idx, int offset, int sz);
-static int peer_send_normal_msg(struct peer *pr);
+static int peer_send_normal_msg(struct peer *pr, int maxlen, int flags);
+static int peer_add_send_msg(struct peer *pr, char *buffer, int bufsz);
 
 static int peer_recv_choked_msg(struct peer *pr);
 static int peer_recv_unchoked_msg(struct peer *pr);
@@ -75,6 +77,9 @@ static int peer_recv_request_msg(struct peer *pr);
 static int peer_recv_cancel_msg(struct peer *pr);
 static int peer_recv_keepalive_msg(struct peer *pr);
 static int peer_recv_piece_msg(struct peer *pr);
+static void peer_cancel_duplicates(struct peer *pr, struct slice *sl);
+static int peer_write_block(struct torrent_task *tsk, struct down_piece *dp, int offset,
+                                                            char *buffer, int len);
 
 static int peer_parser_msg(struct peer *pr, struct peer_rcv_msg *pm);
 
@@ -85,6 +90,29 @@ static int peer_event_connecting(struct peer *pr, int event);
 static int peer_event_handshake(struct peer *pr, int event);
 static int peer_event_connected(struct peer *pr, int event);
 
+/* requests not answered yet go back to the pieces, a half read block too */
+static void
+peer_release_requests(struct peer *pr)
+{
+    struct peer_rcv_msg *pm = &pr->pm;
+
+    struct slice *sl;
+    while(pm->req_list) {
+        sl = pm->req_list;
+        pm->req_list = sl->next;
+        bitfield_release_block(&pr->tsk->bf, sl);
+        GFREE(sl);
+    }
+
+    pm->req_list = NULL;
+    pm->req_tail = &pm->req_list;
+    pm->nreq = 0;
+    pm->dp = NULL;
+    pm->data_transfering = 0;
+    pm->discard = 0;
+    pm->through = 0;
+}
+
 static int 
 peer_reset_member(struct peer *pr)
 {
@@ -92,26 +120,19 @@ peer_reset_member(struct peer *pr)
     peer_del_event(pr);
 
     /* bitmap */
+    bitfield_avail_del_peer(&pr->tsk->bf, &pr->bf);
     GFREE(pr->bf.bitmap);
     pr->bf.bitmap = NULL;
 
-    /* peer bitmap piece list */
-    if(pr->bf.down_list) {
-        struct pieces *p;
-        while(pr->bf.down_list) {
-            p = pr->bf.down_list;
-            pr->bf.down_list = p->next;
-            GFREE(p);
-        }
-        pr->bf.down_list = NULL;
-    }
-
     pr->pm.data_transfering = 0;
     pr->pm.rcvlen = 0;
+    pr->pm.rcvpos = 0;
     if(pr->pm.rcvbuf) {
         GFREE(pr->pm.rcvbuf);
         pr->pm.rcvbuf = NULL;
     }
+    GFREE(pr->pm.blockbuf);
+    pr->pm.blockbuf = NULL;
 
     /* notify list */
     if(pr->having_pieces) {
@@ -124,42 +145,10 @@ peer_reset_member(struct peer *pr)
         pr->having_pieces = NULL;
     }
 
-#if 1
     /* data downloading list */
-    if(pr->pm.req_list || pr->pm.wait_list) {
-        if(pr->pm.req_list) {
-            pr->pm.req_list->downsz = 0;
-            *pr->pm.req_tail = pr->pm.wait_list;
-            pr->pm.wait_list = pr->pm.req_list;
-        }
-
-        int idx = pr->pm.wait_list->idx;
-        bitfield_peer_giveup_piece(&pr->tsk->bf, idx);
-
-        if(pr->pm.wait_list->offset >= 32*1024) {
-            bitfield_add_piece_to_stoped_list(&pr->tsk->bf,
-                        idx, pr->pm.piecebuf, pr->pm.base, pr->pm.wait_list);
-            pr->pm.piecebuf = NULL;
-            pr->pm.base = NULL;
-        }
-    }
-#endif
-
-    GFREE(pr->pm.base);
-    pr->pm.base = NULL;
-    pr->pm.wait_list = NULL;
-
-    pr->pm.req_list = NULL;
-    pr->pm.req_tail = &pr->pm.req_list;
-
-    GFREE(pr->pm.piecebuf);
-    pr->pm.piecebuf = NULL;
-    pr->pm.piecelen = 0;
+    peer_release_requests(pr);
 
     /* data uploading list */
-    GFREE(pr->psm.piecedata);
-    pr->psm.piecedata = NULL;
-
     struct slice *tmp, *sl;
     if(pr->psm.req_list) {
        for(sl = pr->psm.req_list; sl;) {
@@ -171,15 +160,13 @@ peer_reset_member(struct peer *pr)
 
     pr->psm.req_list = NULL;
     pr->psm.req_tail = &pr->psm.req_list;
+    pr->psm.reqsz = 0;
 
-    /* normal peer msg list */
-    struct peer_simple_msg *msg;
-    while(pr->psm.msg_list) {
-        msg = pr->psm.msg_list;
-        pr->psm.msg_list = msg->next;
-        GFREE(msg);
-    }
-    pr->psm.msg_list = NULL;
+    /* normal peer msg ring */
+    GFREE(pr->psm.outbuf);
+    pr->psm.outbuf = NULL;
+    pr->psm.outsz = pr->psm.outhead = pr->psm.outlen = 0;
+    pr->psm.outhdr = 0;
 
     return 0;
 }
@@ -212,63 +199,349 @@ peer_socket_init(struct peer *pr)
     return 0;
 }
 
+/*
+ * request depth is the bandwidth-delay product in blocks, every window
+ * the rate and the smallest block rtt seen set it again. the min rtt
+ * leaves out the time the blocks queued at the uploader, half again on
+ * top lets the depth grow while the link is not full yet.
+ */
+static void
+peer_update_reqdepth(struct peer *pr, struct slice *sl)
+{
+    struct peer_rcv_msg *pm = &pr->pm;
+    int64 now = utils_mtime();
+
+    int rtt = now - sl->reqtime;
+    if(!pm->win_rtt || rtt < pm->win_rtt) {
+        pm->win_rtt = rtt > 0 ? rtt : 1;
+    }
+    pm->win_bytes += sl->slicesz;
+
+    if(now - pm->win_start < 1000) {
+        return;
+    }
+
+    int rate = (int64)pm->win_bytes * 1000 / (now - pm->win_start);
+    pm->rate = pm->rate ? (pm->rate * 3 + rate) / 4 : rate;
+    pm->rtt = pm->win_rtt;
+
+    int64 bdp = (int64)pm->rate * pm->rtt * 3 / 2 / 1000;
+    int depth = bdp / SLICE_SZ + 2;
+    int maxdepth = pr->tsk->max_reqdepth;
+
+    depth = depth < maxdepth ? depth : maxdepth;
+    pm->reqdepth = depth > PEER_REQ_DEPTH_MIN ? depth : PEER_REQ_DEPTH_MIN;
+    LOG_DEBUG("peer[%s] rate %d B/s, rtt %d ms, request depth %d\n",
+               pr->strfaddr, pm->rate, pm->rtt, pm->reqdepth);
+
+    pm->win_bytes = 0;
+    pm->win_rtt = 0;
+    pm->win_start = now;
+}
+
 static int
 peer_down_complete_slice(struct peer *pr)
 {
     struct peer_rcv_msg *pm = &pr->pm;
+    struct slice *sl = pm->req_list;
+
+    peer_update_reqdepth(pr, sl);
 
     /* remove complete slice */
-    int idx = pm->req_list->idx;
-    pm->req_list = pm->req_list->next; 
+    pm->req_list = sl->next; 
+    pm->nreq--;
     if(!pm->req_list) {
         pm->req_tail = &pm->req_list;
     }
 
-    if(!pm->wait_list && !pm->req_list) {
-        peer_check_piece_sha1(pr, idx);
-        GFREE(pm->base);
-        pm->base = NULL;
+    struct down_piece *dp = pm->dp;
+    pm->dp = NULL;
+
+    /* the block buffer belongs to the write job now */
+    if(pm->through) {
+        pm->through = 0;
+        if(peer_write_block(pr->tsk, dp, sl->offset, pm->blockbuf, sl->slicesz)) {
+            LOG_ERROR("peer[%s] write block[%d,%d] failed!\n", pr->strfaddr, sl->idx, sl->offset);
+            bitfield_release_block(&pr->tsk->bf, sl);
+            GFREE(sl);
+            return -1;
+        }
+        pm->blockbuf = NULL;
+    }
+
+    /* the others have to stop before the piece goes to the hash job */
+    int dup = dp->blocks[sl->offset / SLICE_SZ].nreq > 1;
+    int done = bitfield_block_received(&pr->tsk->bf, dp, sl->offset);
+    if(dup) {
+        peer_cancel_duplicates(pr, sl);
+    }
+    GFREE(sl);
+
+    if(done) {
+        peer_check_piece_sha1(pr, dp);
     }
 
     return 0;
 }
 
+/* the piece is verified and on disk */
 static int
-peer_check_piece_sha1(struct peer *pr, int idx)
+peer_piece_have(struct torrent_task *tsk, int idx)
 {
-    struct peer_rcv_msg *pm = &pr->pm;
+    if(bitfield_local_have(&tsk->bf, idx)) {
+        return -1;
+    }
 
-    char *buffer = pm->piecebuf; 
-    int bufsz = pm->piecelen;
+    torrent_add_having_piece(tsk, idx);
 
-    if(utils_sha1_check(buffer, bufsz, &pr->tsk->tor.pieces[idx * 20], 20)) {
-        LOG_ERROR("peer[%s] piece[%d,%d] sha1 check failed!\n", pr->strfaddr, idx, bufsz);
-        bitfield_peer_giveup_piece(&pr->tsk->bf, idx);
-        goto FAILED;
+    tsk->down_size += tsk->bf.piecesz;
+    tsk->leftpieces--;
+    LOG_DEBUG("piece[%d] complete!\n", idx);
+
+    if(!tsk->leftpieces) {
+        LOG_INFO("download complete, %lld duplicate bytes in endgame, %d pieces flushed, "
+                 "%d written through\n", tsk->dup_size, tsk->nflush, tsk->nthrough);
     }
 
-    if(torrent_write_piece(pr->tsk, idx, buffer, bufsz)) {
-        LOG_ERROR("peer[%s] write piece[%d]failed!\n", pr->strfaddr, idx);
-        goto FAILED;
+    return 0;
+}
+
+static int
+peer_write_piece_done(struct disk_job *job)
+{
+    struct torrent_task *tsk = job->tsk;
+    int idx = job->pieceidx;
+
+    bitfield_piecebuf_put(&tsk->bf, job->buffer);
+
+    if(job->result) {
+        LOG_ERROR("write piece[%d]failed!\n", idx);
+        bitfield_peer_giveup_piece(&tsk->bf, idx);
+        return -1;
     }
 
-    if(bitfield_local_have(&pr->tsk->bf, idx)) {
-        goto FAILED;
+    return peer_piece_have(tsk, idx);
+}
+
+/* runs on the loop thread once a disk thread has hashed the piece */
+static int
+peer_hash_piece_done(struct disk_job *job)
+{
+    struct torrent_task *tsk = job->tsk;
+    int idx = job->pieceidx;
+
+    if(job->result) {
+        LOG_ERROR("piece[%d,%d] sha1 check failed!\n", idx, job->buflen);
+        bitfield_peer_giveup_piece(&tsk->bf, idx);
+        bitfield_piecebuf_put(&tsk->bf, job->buffer);
+        return -1;
     }
 
-    torrent_add_having_piece(pr->tsk, idx);
+    /* hand the piece buffer on to the write job */
+    struct disk_job *wjob = torrent_io_job_create(tsk, DISK_JOB_WRITE, idx,
+                            job->buffer, job->buflen, peer_write_piece_done, NULL);
+    if(!wjob || torrent_io_submit(tsk->dio, wjob)) {
+        LOG_ERROR("write piece[%d]failed!\n", idx);
+        bitfield_peer_giveup_piece(&tsk->bf, idx);
+        GFREE(wjob);
+        bitfield_piecebuf_put(&tsk->bf, job->buffer);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* a written through piece read back and hashed */
+static int
+peer_verify_piece_done(struct disk_job *job)
+{
+    struct torrent_task *tsk = job->tsk;
+    int idx = job->pieceidx;
+
+    GFREE(job->buffer);
+
+    if(job->result) {
+        LOG_ERROR("piece[%d,%d] sha1 check on disk failed!\n", idx, job->buflen);
+        bitfield_peer_giveup_piece(&tsk->bf, idx);
+        return -1;
+    }
+
+    return peer_piece_have(tsk, idx);
+}
 
-    pr->tsk->down_size += pr->tsk->bf.piecesz;
-    pr->tsk->leftpieces--;
-    LOG_DEBUG("peer[%s] piece[%d] complete!\n", pr->strfaddr, idx);
+/* the blocks are all on disk, the read buffer is only held for the job */
+static int
+peer_verify_piece(struct torrent_task *tsk, struct down_piece *dp)
+{
+    int idx = dp->idx;
+    int bufsz = idx == tsk->bf.npieces-1 ? tsk->bf.last_piecesz : tsk->bf.piecesz;
+
+    dp->verifying = 1;
+
+    char *buffer = GMALLOC(bufsz);
+    struct disk_job *job = buffer ? torrent_io_job_create(tsk, DISK_JOB_CHECK, idx,
+                                    buffer, bufsz, peer_verify_piece_done, NULL) : NULL;
+    if(!job || torrent_io_submit(tsk->dio, job)) {
+        LOG_ERROR("verify piece[%d] failed!\n", idx);
+        bitfield_peer_giveup_piece(&tsk->bf, idx);
+        GFREE(job);
+        GFREE(buffer);
+        return -1;
+    }
 
     return 0;
+}
 
-FAILED:
-    GFREE(buffer);
-    pm->piecebuf = NULL;
-    pm->piecelen = 0;
-    return -1;
+/* a written through block, or a run of blocks of a flushed piece */
+static int
+peer_write_block_done(struct disk_job *job)
+{
+    struct torrent_task *tsk = job->tsk;
+    struct down_piece *dp = (struct down_piece *)job->ctx;
+
+    /* a run sits in the flushed buffer, which lives until the last write */
+    if(!dp->flushbuf || job->buffer != dp->flushbuf + job->offset) {
+        GFREE(job->buffer);
+    }
+
+    if(job->result) {
+        LOG_ERROR("write piece[%d] at %d failed!\n", job->pieceidx, job->offset);
+    }
+
+    if(!bitfield_down_piece_write_done(&tsk->bf, dp)) {
+        return 0;
+    }
+
+    /* a failed write shows up as a bad hash */
+    if(dp->nrecv == dp->nblock && !dp->verifying) {
+        return peer_verify_piece(tsk, dp);
+    }
+
+    return 0;
+}
+
+static int
+peer_write_block(struct torrent_task *tsk, struct down_piece *dp, int offset,
+                                                            char *buffer, int len)
+{
+    /* the piece goes with the job, it outlives a give up until the write is done */
+    struct disk_job *job = torrent_io_job_create(tsk, DISK_JOB_WRITE, dp->idx,
+                                    buffer, len, peer_write_block_done, dp);
+    if(!job) {
+        return -1;
+    }
+    job->offset = offset;
+
+    if(torrent_io_submit(tsk->dio, job)) {
+        GFREE(job);
+        return -1;
+    }
+    dp->nwrite++;
+
+    return 0;
+}
+
+/* 
+ * the buffer budget is used up, the partial piece idle the longest
+ * has its received blocks written to disk, its buffer goes back to
+ * the pool once they are done. new blocks of it are written through.
+ */
+static int
+peer_flush_lru_piece(struct torrent_task *tsk)
+{
+    struct down_piece *dp = bitfield_down_piece_lru(&tsk->bf);
+    if(!dp) {
+        return -1;
+    }
+
+    int piecesz = dp->idx == tsk->bf.npieces-1 ? tsk->bf.last_piecesz : tsk->bf.piecesz;
+
+    dp->flushbuf = dp->piecebuf;
+    dp->piecebuf = NULL;
+
+    int i = 0, j;
+    while(i < dp->nblock) {
+        if(dp->blocks[i].state != BLOCK_RECEIVED) {
+            i++;
+            continue;
+        }
+
+        for(j = i; j < dp->nblock && dp->blocks[j].state == BLOCK_RECEIVED; j++) {
+            /* nothing */
+        }
+
+        int offset = i * SLICE_SZ;
+        int len = (j * SLICE_SZ < piecesz ? j * SLICE_SZ : piecesz) - offset;
+        if(peer_write_block(tsk, dp, offset, dp->flushbuf + offset, len)) {
+            LOG_ERROR("flush piece[%d] at %d failed!\n", dp->idx, offset);
+        }
+        i = j;
+    }
+
+    if(!dp->nwrite) {
+        bitfield_piecebuf_put(&tsk->bf, dp->flushbuf);
+        dp->flushbuf = NULL;
+    }
+
+    tsk->nflush++;
+    LOG_DEBUG("piece[%d] flushed with %d blocks\n", dp->idx, dp->nrecv);
+
+    return 0;
+}
+
+/* a new rarest piece the peer has, with a buffer while the budget allows */
+static int
+peer_add_down_piece(struct peer *pr)
+{
+    struct torrent_task *tsk = pr->tsk;
+
+    int idx = bitfield_pick_rarest(&tsk->bf, &pr->bf);
+    if(idx < 0) {
+        return -1;
+    }
+
+    char *buf = bitfield_piecebuf_get(&tsk->bf);
+    if(!buf) {
+        /* room for the next one, this one is written through */
+        peer_flush_lru_piece(tsk);
+        tsk->nthrough++;
+    }
+
+    if(!bitfield_down_piece_add(&tsk->bf, idx, buf)) {
+        bitfield_piecebuf_put(&tsk->bf, buf);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int
+peer_check_piece_sha1(struct peer *pr, struct down_piece *dp)
+{
+    int idx = dp->idx;
+    char *buffer = dp->piecebuf; 
+    int bufsz = idx == pr->tsk->bf.npieces-1 ? pr->tsk->bf.last_piecesz : pr->tsk->bf.piecesz;
+
+    /* written through, hashed from disk once the writes are done */
+    if(!buffer) {
+        return dp->nwrite ? 0 : peer_verify_piece(pr->tsk, dp);
+    }
+
+    /* the piece buffer belongs to the hash job from now on */
+    dp->piecebuf = NULL;
+    dp->verifying = 1;
+
+    struct disk_job *job = torrent_io_job_create(pr->tsk, DISK_JOB_HASH, idx,
+                                        buffer, bufsz, peer_hash_piece_done, NULL);
+    if(!job || torrent_io_submit(pr->tsk->dio, job)) {
+        LOG_ERROR("peer[%s] check piece[%d] failed!\n", pr->strfaddr, idx);
+        bitfield_peer_giveup_piece(&pr->tsk->bf, idx);
+        GFREE(job);
+        bitfield_piecebuf_put(&pr->tsk->bf, buffer);
+        return -1;
+    }
+
+    return 0;
 }
 
 static int
@@ -335,7 +608,7 @@ peer_start(struct peer *pr)
             goto FAILED;
         }
 
-        if(peer_add_event(pr, EPOLLIN)) {
+        if(peer_add_event(pr, EPOLLIN | EPOLLOUT)) {
             LOG_ERROR("peer[%s] add event failed!\n", pr->strfaddr);
             goto FAILED;
         }
@@ -373,19 +646,8 @@ FAILED:
 }
 
 static int
-peer_timeout_handle(int event, void *evt_ctx)
+peer_timeout_state(struct peer *pr)
 {
-    struct peer *pr;
-    pr = (struct peer *)evt_ctx;
-
-    long long tmrbuf;
-    if(read(pr->tmrfd, &tmrbuf, sizeof(tmrbuf)) != sizeof(tmrbuf)) {
-        LOG_ALARM("peer[%s] timer read failed:%s\n", pr->strfaddr, strerror(errno));
-        if(errno == EAGAIN || errno == EWOULDBLOCK) {
-            return 0;
-        }
-    }
-
     peer_stop_timer(pr);
     
     switch(pr->state) {
@@ -417,6 +679,20 @@ peer_timeout_handle(int event, void *evt_ctx)
     return -1;
 }
 
+static int
+peer_timeout_handle(int event, void *evt_ctx)
+{
+    struct peer *pr = (struct peer *)evt_ctx;
+    struct torrent_task *tsk = pr->tsk;
+
+    /* the task loop may have dropped a peer it just set up while we waited */
+    pthread_mutex_lock(&tsk->lock);
+    int ret = pr->isused ? peer_timeout_state(pr) : -1;
+    pthread_mutex_unlock(&tsk->lock);
+
+    return ret;
+}
+
 static int
 peer_compute_time(struct peer *pr)
 {
@@ -450,7 +726,7 @@ peer_destroy_timer(struct peer *pr)
 
     struct timer_param tp;
     memset(&tp, 0, sizeof(tp));
-    tp.epfd = pr->tsk->epfd;
+    tp.epfd = pr->epfd;
     tp.tmrfd = pr->tmrfd;
     
     if(timer_destroy(&tp)) {
@@ -458,7 +734,6 @@ peer_destroy_timer(struct peer *pr)
         return -1;
     }
 
-    close(pr->tmrfd);
     pr->tmrfd = -1;
 
     return 0;
@@ -513,7 +788,7 @@ peer_create_timer(struct peer *pr)
 
     struct timer_param tp;
     memset(&tp, 0, sizeof(tp));
-    tp.epfd = pr->tsk->epfd;
+    tp.epfd = pr->epfd;
     tp.tmr_hdl = peer_timeout_handle;
     tp.tmr_ctx = pr;
 
@@ -558,10 +833,11 @@ peer_add_event(struct peer *pr, int event)
     ep.evt_hdl = peer_event_handle;
     ep.evt_ctx = pr;
 
-    if(event_add(pr->tsk->epfd, &ep)) {
+    if(event_add(pr->epfd, &ep)) {
         LOG_ERROR("peer add event failed!\n");
         return -1;
     }
+    pr->event = event;
 
     return 0;
 }
@@ -569,20 +845,58 @@ peer_add_event(struct peer *pr, int event)
 static int
 peer_mod_event(struct peer *pr, int event)
 {
+    if(pr->event == event) {
+        return 0;
+    }
+
     struct event_param ep;
     ep.event = event;
     ep.fd = pr->sockid;
     ep.evt_hdl = peer_event_handle;
     ep.evt_ctx = pr;
 
-    if(event_mod(pr->tsk->epfd, &ep)) {
+    if(event_mod(pr->epfd, &ep)) {
         LOG_ERROR("peer mod event failed!\n");
         return -1;
     }
+    pr->event = event;
 
     return 0;
 }
 
+/*
+ * EPOLLOUT while anything is queued, EPOLLIN while the queued bytes are
+ * under budget: a peer that requests faster than it reads waits for us.
+ */
+static int
+peer_update_event(struct peer *pr)
+{
+    /* not in epoll yet, a connected one may be parked with no events */
+    if(!pr->event && pr->state != PEER_STATE_CONNECTD) {
+        return 0;
+    }
+
+    int event = 0;
+    if(pr->psm.outlen + pr->psm.reqsz <= PEER_OUTQ_BUDGET) {
+        event |= EPOLLIN;
+    }
+    if(pr->psm.outlen || pr->psm.req_list) {
+        event |= EPOLLOUT;
+    }
+
+    /* out of rate tokens, the manager tick gives them back */
+    event &= ~pr->throttled;
+
+    return peer_mod_event(pr, event);
+}
+
+int
+peer_unthrottle(struct peer *pr)
+{
+    pr->throttled = 0;
+    return peer_update_event(pr);
+}
+
 static int
 peer_del_event(struct peer *pr)
 {
@@ -594,10 +908,11 @@ peer_del_event(struct peer *pr)
     memset(&ep, 0, sizeof(ep));
     ep.fd = pr->sockid;
 
-    if(event_del(pr->tsk->epfd, &ep)) {
+    if(event_del(pr->epfd, &ep)) {
         LOG_ERROR("peer del event failed!\n");
         return -1;
     }
+    pr->event = 0;
 
     /* we should recv all the data when close sock, or a reset will send to peer */
     char buffer[1024];
@@ -610,6 +925,23 @@ peer_del_event(struct peer *pr)
     return 0;
 }
 
+/* the unparsed bytes start at rcvpos, a msg is consumed by moving it */
+static char *
+peer_rcv_head(struct peer_rcv_msg *pm)
+{
+    return pm->rcvbuf + pm->rcvpos;
+}
+
+static void
+peer_rcv_consume(struct peer_rcv_msg *pm, int len)
+{
+    pm->rcvpos += len;
+    pm->rcvlen -= len;
+    if(!pm->rcvlen) {
+        pm->rcvpos = 0;
+    }
+}
+
 /* return value:
  * 0--> msg ok;
  * -1--> error msg format, should close sockid;
@@ -623,7 +955,7 @@ peer_parser_msg(struct peer *pr, struct peer_rcv_msg *pm)
     }
 
     int len_pre;
-    memcpy(&len_pre, pm->rcvbuf, 4);
+    memcpy(&len_pre, peer_rcv_head(pm), 4);
     len_pre = socket_ntohl(len_pre);
 
     if(!len_pre) {
@@ -634,7 +966,7 @@ peer_parser_msg(struct peer *pr, struct peer_rcv_msg *pm)
         return -2;
     }
 
-    switch(pm->rcvbuf[4]) {
+    switch(peer_rcv_head(pm)[4]) {
         case PEER_MSG_ID_CHOCKED:
             if(len_pre == 1) {
                 return peer_recv_choked_msg(pr);
@@ -692,39 +1024,23 @@ peer_parser_msg(struct peer *pr, struct peer_rcv_msg *pm)
             break;
         case PEER_MSG_ID_PORT:
             if(len_pre == 3 && pm->rcvlen >= 7) {
-                pm->rcvlen -= 7;
-                if(pm->rcvlen) {
-                    memmove(pm->rcvbuf, pm->rcvbuf+7, pm->rcvlen);
-                }
+                peer_rcv_consume(pm, 7);
                 return 0;
             } else if(len_pre == 3 && pm->rcvlen < 7) {
                 return -2;
             }
             break;
         default:
-            LOG_ERROR("peer[%s] recv unexpected msgtype[%d]\n", pr->strfaddr, pm->rcvbuf[4]);
+            LOG_ERROR("peer[%s] recv unexpected msgtype[%d]\n", pr->strfaddr, peer_rcv_head(pm)[4]);
     }
 
     return -1;
 }
 
-static int
-peer_send_data(struct peer *pr, char *data, int len)
-{
-    pr->heartbeat = time(NULL) + 60;
-    return socket_tcp_send_all(pr->sockid, data, len);
-}
-
-static int
-peer_recv_data(struct peer *pr, char *rcvbuf, int buflen)
-{
-    return socket_tcp_recv(pr->sockid, rcvbuf, buflen, 0);
-}
-
 static int
 peer_send_slice_header(struct peer *pr, struct slice *sl)
 {
-    char msg[13] = {0, 0, 0, 0, PEER_MSG_ID_PIECE, };
+    char msg[PIECE_HDR_SZ] = {0, 0, 0, 0, PEER_MSG_ID_PIECE, };
 
     int len_pre = socket_htonl(9+sl->slicesz);
     memcpy(msg, &len_pre, 4);
@@ -735,16 +1051,26 @@ peer_send_slice_header(struct peer *pr, struct slice *sl)
     int offset = socket_htonl(sl->offset);
     memcpy(msg+9, &offset, 4);
 
-    if(peer_send_data(pr, msg, sizeof(msg))) {
-        LOG_ERROR("peer[%s] send piece msg hdr failed\n", pr->strfaddr);
+    if(peer_add_send_msg(pr, msg, sizeof(msg))) {
         return -1;
     }
+    pr->psm.outhdr = sizeof(msg);
+    pr->psm.reqsz -= sizeof(msg);
+    sl->sendsz = sizeof(msg);
 
     LOG_DEBUG("peer[%s] send piece msg hdr[%d,%d] \n", pr->strfaddr, sl->idx, sl->offset);
 
-    return 0;
+    /* MSG_MORE, the header leaves in the same segment as the block */
+    return peer_send_normal_msg(pr, pr->psm.outhdr, MSG_MORE);
 }
 
+/* 
+ * sendsz counts the 13 bytes header first, it is queued on the msg ring
+ * when the ring is empty. once it is out the block goes from the cached
+ * file fd to the socket with sendfile, piece by piece of the files it
+ * spans. a full socket just waits for the next EPOLLOUT. the sendfile
+ * runs without the task lock, only this peer's loop uses its block list.
+ */
 static int
 peer_send_slice_data(struct peer *pr)
 {
@@ -753,79 +1079,120 @@ peer_send_slice_data(struct peer *pr)
     }
 
     struct slice *sl = pr->psm.req_list;
+    struct torrent_task *tsk = pr->tsk;
 
-    if(!pr->psm.piecedata || pr->psm.pieceidx != sl->idx) {
-        GFREE(pr->psm.piecedata);
-        pr->psm.piecedata = NULL;
-        if(torrent_read_piece(pr->tsk, sl->idx, &pr->psm.piecedata, &pr->psm.piecesz)) {
-            LOG_ERROR("peer[%s] torrent read piece[%d] failed\n", pr->strfaddr, sl->idx);
-            return -1;
-        }
-        pr->psm.pieceidx = sl->idx;
-    }
-
-    if(sl->offset + sl->slicesz > pr->psm.piecesz) {
+    int piecesz = sl->idx == tsk->bf.npieces-1 ? tsk->bf.last_piecesz : tsk->bf.piecesz;
+    if(sl->slicesz <= 0 || sl->offset + sl->slicesz > piecesz) {
         LOG_ERROR("peer[%s] invalid slice[%d,%d,%d]\n", pr->strfaddr,
-                                        sl->offset, sl->slicesz, pr->psm.piecesz);
+                                        sl->offset, sl->slicesz, piecesz);
         return -1;
     }
 
-    if(!sl->sendsz && peer_send_slice_header(pr, sl)) {
+    if(!sl->sendsz) {
+        if(pr->psm.outlen) { /* msgs queued before still go first */
+            return 0;
+        }
+        if(peer_send_slice_header(pr, sl)) {
+            return -1;
+        }
+    } else if(pr->psm.outhdr
+                && peer_send_normal_msg(pr, pr->psm.outhdr, MSG_MORE)) {
         return -1;
     }
 
-    int leftsz = sl->slicesz - sl->sendsz;
-    int offset = sl->offset+sl->sendsz;
-    int size = leftsz < MTU_SZ ? leftsz : MTU_SZ; 
-    sl->sendsz += size;
-
-    if(peer_send_data(pr, pr->psm.piecedata+offset, size)) {
-        LOG_DEBUG("peer[%s] send data[%d,%d,%d] failed\n",
-                                    pr->strfaddr, sl->idx, offset, size);
-        return -1;
+    if(pr->psm.outhdr) { /* socket is full */
+        return 0;
     }
 
-#if 0
-    LOG_DEBUG("peer[%s] send data[%d,%d,%d]\n", pr->strfaddr, sl->idx, offset, size);
-#endif
+    while(sl->sendsz < PIECE_HDR_SZ + sl->slicesz) {
+        int sent = sl->sendsz - PIECE_HDR_SZ;
+        int64 offset = (int64)tsk->tor.piece_len * sl->idx + sl->offset + sent;
 
-    if(sl->sendsz < sl->slicesz) {
-        return 0;
+        int fidx;
+        int64 fileoff, filelen;
+        int fd = torrent_data_fd_get(tsk, offset, &fidx, &fileoff, &filelen);
+        if(fd < 0) {
+            LOG_ERROR("peer[%s] no file for data[%d,%d]\n", pr->strfaddr, sl->idx, sl->offset);
+            return -1;
+        }
+
+        int size = sl->slicesz - sent;
+        size = filelen < size ? filelen : size;
+        size = torrent_mgr_quota(tsk, RATE_UP, size);
+        if(!size) {
+            torrent_data_fd_put(tsk, fidx);
+            pr->throttled |= EPOLLOUT;
+            return 0;
+        }
+
+        pthread_mutex_unlock(&tsk->lock);
+        int wlen = socket_tcp_sendfile(pr->sockid, fd, &fileoff, size);
+        pthread_mutex_lock(&tsk->lock);
+        torrent_data_fd_put(tsk, fidx);
+
+        if(wlen < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        } else if(wlen <= 0) {
+            LOG_DEBUG("peer[%s] send data[%d,%d,%d] failed:%s\n",
+                        pr->strfaddr, sl->idx, sl->offset + sent, size, strerror(errno));
+            return -1;
+        }
+
+        torrent_mgr_charge(tsk, RATE_UP, wlen);
+        sl->sendsz += wlen;
+        pr->psm.reqsz -= wlen;
+        pr->heartbeat = time(NULL) + 60;
     }
 
     pr->psm.req_list = sl->next;
     if(!pr->psm.req_list) {
         pr->psm.req_tail = &pr->psm.req_list;
     }
-    GFREE(sl);
 
-    pr->tsk->upload_size += SLICE_SZ;
+    tsk->upload_size += sl->slicesz;
+    GFREE(sl);
 
     return 0;
 }
 
+/* append a msg to the output ring, it grows to fit */
 static int
-peer_add_send_msg_list(struct peer *pr, int msgtype, char *buffer, int bufsz)
+peer_add_send_msg(struct peer *pr, char *buffer, int bufsz)
 {
-    struct peer_simple_msg *smsg;
-    if(!(smsg = GCALLOC(1, sizeof(*smsg)))) {
-        LOG_ERROR("out of memory!\n");
-        return -1;
-    }
+    struct peer_send_msg *psm = &pr->psm;
+
+    if(psm->outlen + bufsz > psm->outsz) {
+        int newsz = psm->outsz ? psm->outsz : PEER_OUTBUF_MIN_SZ;
+        while(newsz < psm->outlen + bufsz) {
+            newsz *= 2;
+        }
+
+        char *newbuf = GMALLOC(newsz);
+        if(!newbuf) {
+            LOG_ERROR("out of memory!\n");
+            return -1;
+        }
 
-    smsg->msgtype = msgtype;
-    smsg->bufsz = bufsz;
+        int first = psm->outsz - psm->outhead;
+        first = first < psm->outlen ? first : psm->outlen;
+        if(psm->outlen) {
+            memcpy(newbuf, psm->outbuf + psm->outhead, first);
+            memcpy(newbuf + first, psm->outbuf, psm->outlen - first);
+        }
 
-    smsg->buffer = buffer;
-    if(bufsz <= 32) { /* normal bt msg */
-        smsg->buffer = smsg->smallbuf;
-        memcpy(smsg->buffer, buffer, bufsz);
+        GFREE(psm->outbuf);
+        psm->outbuf = newbuf;
+        psm->outsz = newsz;
+        psm->outhead = 0;
     }
 
-    smsg->next = pr->psm.msg_list;
-    pr->psm.msg_list = smsg;
+    int tail = (psm->outhead + psm->outlen) % psm->outsz;
+    int first = psm->outsz - tail < bufsz ? psm->outsz - tail : bufsz;
+    memcpy(psm->outbuf + tail, buffer, first);
+    memcpy(psm->outbuf, buffer + first, bufsz - first);
+    psm->outlen += bufsz;
 
-    if(peer_mod_event(pr, EPOLLIN | EPOLLOUT)) {
+    if(peer_update_event(pr)) {
         LOG_ERROR("peer[%s] modify event failed\n", pr->strfaddr);
         return -1;
     }
@@ -842,7 +1209,7 @@ peer_send_chocked_msg(struct peer *pr)
 
     char msg[5] = {0, 0, 0, 1, PEER_MSG_ID_CHOCKED};
 
-    return peer_add_send_msg_list(pr, PEER_MSG_ID_CHOCKED, msg, sizeof(msg));
+    return peer_add_send_msg(pr, msg, sizeof(msg));
 }
 
 static int
@@ -852,7 +1219,7 @@ peer_send_unchocked_msg(struct peer *pr)
 
     char msg[5] = {0, 0, 0, 1, PEER_MSG_ID_UNCHOCKED};
 
-    return peer_add_send_msg_list(pr, PEER_MSG_ID_UNCHOCKED, msg, sizeof(msg));
+    return peer_add_send_msg(pr, msg, sizeof(msg));
 }
 
 static int
@@ -863,7 +1230,7 @@ peer_send_intrested_msg(struct peer *pr)
     pr->am_interested = 1;
     char msg[5] = {0, 0, 0, 1, PEER_MSG_ID_INSTRESTED};
 
-    return peer_add_send_msg_list(pr, PEER_MSG_ID_INSTRESTED, msg, sizeof(msg));
+    return peer_add_send_msg(pr, msg, sizeof(msg));
 }
 
 static int
@@ -874,7 +1241,7 @@ peer_send_notintrested_msg(struct peer *pr)
     pr->am_interested = 0;
     char msg[5] = {0, 0, 0, 1, PEER_MSG_ID_NOTINSTRESTED};
 
-    return peer_add_send_msg_list(pr, PEER_MSG_ID_NOTINSTRESTED, msg, sizeof(msg));
+    return peer_add_send_msg(pr, msg, sizeof(msg));
 }
 
 static int
@@ -890,7 +1257,7 @@ peer_send_have_msg(struct peer *pr)
         int idx = socket_htonl((*p)->idx);
         memcpy(msg+5, &idx, 4);
 
-        peer_add_send_msg_list(pr, PEER_MSG_ID_HAVE, msg, sizeof(msg));
+        peer_add_send_msg(pr, msg, sizeof(msg));
 
         tmp = *p;
         *p = tmp->next;
@@ -901,55 +1268,125 @@ peer_send_have_msg(struct peer *pr)
 }
 
 static int
-peer_send_request_msg(struct peer *pr, struct peer_rcv_msg *pm)
+peer_in_endgame(struct torrent_task *tsk)
 {
-    if(!pm->req_list && !pm->wait_list) {
-       if(bitfield_get_request_piece(&pr->tsk->bf, &pr->bf, pm)) {
-            LOG_DEBUG("peer[%s] have no piece for us!\n", pr->strfaddr);
-            return -1;
-        }
+    if(!tsk->endgame && bitfield_all_requested(&tsk->bf, tsk->leftpieces)) {
+        LOG_INFO("all %d pieces left are in download, endgame!\n", tsk->leftpieces);
+        tsk->endgame = 1;
     }
 
-    int curreq = 0, maxreq = 4;
-    struct slice *tmp = pm->req_list;
-    for(; tmp; tmp = tmp->next) {
-        curreq++;
+    return tsk->endgame;
+}
+
+static int
+peer_send_request_msg(struct peer *pr, struct peer_rcv_msg *pm)
+{
+    /* local pieces are not known until the startup check ends */
+    if(pr->tsk->chk.checking) {
+        return -1;
     }
 
-    struct slice **sl;
-    for(sl = &pm->wait_list; *sl && curreq < maxreq; curreq++) {
+    int64 now = utils_mtime();
+    struct slice *sl;
+    while(pm->nreq < pm->reqdepth) {
+        sl = bitfield_get_request_block(&pr->tsk->bf, &pr->bf);
+        if(!sl && !peer_add_down_piece(pr)) {
+            sl = bitfield_get_request_block(&pr->tsk->bf, &pr->bf);
+        }
+
+        if(!sl && peer_in_endgame(pr->tsk)) {
+            sl = bitfield_get_endgame_block(&pr->tsk->bf, &pr->bf, pm->req_list);
+        }
+
+        if(!sl) {
+            break;
+        }
 
         LOG_DEBUG("peer[%s] send request msg[%d,%d,%d]\n",
-                  pr->strfaddr, (*sl)->idx, (*sl)->offset, (*sl)->slicesz);
+                  pr->strfaddr, sl->idx, sl->offset, sl->slicesz);
 
         char msg[17] = {0, 0, 0, 13, PEER_MSG_ID_REQUEST};
 
-        int idx = socket_htonl((*sl)->idx);
+        int idx = socket_htonl(sl->idx);
         memcpy(msg+5, &idx, 4);
 
-        int offset = socket_htonl((*sl)->offset);
+        int offset = socket_htonl(sl->offset);
         memcpy(msg+9, &offset, 4);
 
-        int sz = socket_htonl((*sl)->slicesz);
+        int sz = socket_htonl(sl->slicesz);
         memcpy(msg+13, &sz, 4);
 
-        if(peer_add_send_msg_list(pr, PEER_MSG_ID_REQUEST, msg, sizeof(msg))) {
+        sl->reqtime = now;
+        *pm->req_tail = sl;
+        pm->req_tail = &sl->next;
+        pm->nreq++;
+
+        if(peer_add_send_msg(pr, msg, sizeof(msg))) {
             LOG_ERROR("peer[%s] add request msg[%d,%d,%d] failed\n",
-                  pr->strfaddr, (*sl)->idx, (*sl)->offset, (*sl)->slicesz);
+                  pr->strfaddr, sl->idx, sl->offset, sl->slicesz);
             return -1;
         }
+    }
 
-        tmp = *sl;
-        *sl = (*sl)->next;
-
-        *pm->req_tail = tmp;
-        pm->req_tail = &tmp->next;
-        *pm->req_tail = NULL;
+    if(!pm->req_list) {
+        LOG_DEBUG("peer[%s] have no piece for us!\n", pr->strfaddr);
+        return -1;
     }
 
     return 0;
 }
 
+/* 
+ * endgame: the block is here, the other peers asked for it get a cancel.
+ * one in the middle of sending it can not stop, the rest is dropped.
+ */
+static void
+peer_cancel_duplicates(struct peer *pr, struct slice *sl)
+{
+    struct torrent_task *tsk = pr->tsk;
+
+    int i;
+    for(i = 0; i < MAX_PEER_NUM; i++) {
+        struct peer *other = &tsk->pr[i];
+        if(other == pr || !other->isused || other->state != PEER_STATE_CONNECTD) {
+            continue;
+        }
+
+        struct peer_rcv_msg *pm = &other->pm;
+        struct slice *tmp, **iter;
+        for(iter = &pm->req_list; *iter; iter = &(*iter)->next) {
+            if((*iter)->idx == sl->idx && (*iter)->offset == sl->offset) {
+                break;
+            }
+        }
+
+        if(!(tmp = *iter)) {
+            continue;
+        }
+
+        if(tmp == pm->req_list && pm->data_transfering) {
+            pm->discard = tmp->slicesz - tmp->downsz;
+            pm->data_transfering = 0;
+            pm->through = 0;
+            pm->dp = NULL;
+            tsk->dup_size += tmp->downsz;
+        } else {
+            peer_send_cancel_msg(other, tmp->idx, tmp->offset, tmp->slicesz);
+        }
+
+        *iter = tmp->next;
+        if(pm->req_tail == &tmp->next) {
+            pm->req_tail = iter;
+        }
+        pm->nreq--;
+        GFREE(tmp);
+
+        LOG_DEBUG("peer[%s] cancel request msg[%d,%d]\n", other->strfaddr, sl->idx, sl->offset);
+
+        peer_send_request_msg(other, pm);
+    }
+}
+
 static int
 peer_send_cancel_msg(struct peer *pr, int idx, int offset, int sz)
 {
@@ -964,7 +1401,7 @@ peer_send_cancel_msg(struct peer *pr, int idx, int offset, int sz)
     sz = socket_htonl(sz);
     memcpy(msg+13, &sz, 4);
 
-    if(peer_add_send_msg_list(pr, PEER_MSG_ID_CANCEL, msg, sizeof(msg))) {
+    if(peer_add_send_msg(pr, msg, sizeof(msg))) {
         return -1;
     }
 
@@ -977,7 +1414,7 @@ peer_send_keepalive_msg(struct peer *pr)
     char msg[4];
     memset(msg, 0, sizeof(msg));
 
-    if(peer_add_send_msg_list(pr, PEER_MSG_ID_KEEPALIVE, msg, sizeof(msg))) {
+    if(peer_add_send_msg(pr, msg, sizeof(msg))) {
         return -1;
     }
 
@@ -1001,8 +1438,8 @@ peer_send_handshake_msg(struct peer *pr)
     s += SHA1_LEN;
     memcpy(s, peer_id, PEER_ID_LEN);
 
-    if(peer_send_data(pr, handshake, sizeof(handshake))) {
-        LOG_ERROR("peer[%s] send handshake msg: %s\n", pr->strfaddr, strerror(errno));
+    if(peer_add_send_msg(pr, handshake, sizeof(handshake))) {
+        LOG_ERROR("peer[%s] queue handshake msg failed!\n", pr->strfaddr);
         return -1;
     }
 
@@ -1050,29 +1487,13 @@ peer_send_bitfiled_msg(struct peer *pr)
     int msglen = socket_htonl(1+bf->nbyte);
     memcpy(msghdr, &msglen, 4);
 
-    struct iovec iovs[2];
-    iovs[0].iov_base = msghdr;
-    iovs[0].iov_len = 5;
-    iovs[1].iov_base = bf->bitmap; 
-    iovs[1].iov_len = bf->nbyte; 
-
-    int wlen = socket_tcp_send_iovs(pr->sockid, iovs, 2);
-    if(wlen < 0) {
-        LOG_ERROR("peer[%s] send bitfield failed:%s\n", pr->strfaddr, strerror(errno));
+    if(peer_add_send_msg(pr, msghdr, sizeof(msghdr))
+                || peer_add_send_msg(pr, bf->bitmap, bf->nbyte)) {
+        LOG_ERROR("peer[%s] queue bitfield failed!\n", pr->strfaddr);
         return -1;
-    } else if(wlen != 5+bf->nbyte) {
-        if(wlen < 5) {
-            if(peer_send_data(pr, msghdr+wlen, 5-wlen)) {
-                return -1;
-            }
-            wlen = 5;
-        }
-        if(peer_send_data(pr, bf->bitmap, bf->nbyte+5 - wlen)) {
-            return -1;
-        }
     }
 
-    LOG_INFO("peer[%s] send bitfield ok!\n", pr->strfaddr);
+    LOG_INFO("peer[%s] queue bitfield ok!\n", pr->strfaddr);
 
     return 0;
 }
@@ -1086,8 +1507,7 @@ peer_recv_bitfield_msg(struct peer *pr)
         return -1;
     }
 
-    int rcvlen = pr->pm.rcvlen;
-    char *rcvbuf = pr->pm.rcvbuf;
+    char *rcvbuf = peer_rcv_head(&pr->pm);
 
     int len_pre;
     memcpy(&len_pre, rcvbuf, 4);
@@ -1107,6 +1527,7 @@ peer_recv_bitfield_msg(struct peer *pr)
         LOG_ERROR("peer[%s] bitfield dup failed!\n", pr->strfaddr);
         return -1;
     }
+    bitfield_avail_add_peer(&pr->tsk->bf, &pr->bf);
 
     LOG_DUMP(pr->bf.bitmap, pr->bf.nbyte, "peer[%s]bitfield[%d]:",
             pr->strfaddr, pr->bf.nbyte);
@@ -1118,10 +1539,7 @@ peer_recv_bitfield_msg(struct peer *pr)
         }
     }
 
-    pr->pm.rcvlen = rcvlen-4-len_pre;
-    if(pr->pm.rcvlen) {
-        memmove(rcvbuf, rcvbuf+4+len_pre, pr->pm.rcvlen);
-    }
+    peer_rcv_consume(&pr->pm, 4+len_pre);
 
     return 0;
 }
@@ -1135,18 +1553,9 @@ peer_recv_choked_msg(struct peer *pr)
     peer_send_intrested_msg(pr);
 
     struct peer_rcv_msg *pm = &pr->pm;
-    if(pm->req_list) {
-        pm->req_list->downsz = 0;
-        *pm->req_tail = pm->wait_list;
-        pm->wait_list = pm->req_list;
-        pm->req_list = NULL;
-        pm->req_tail = &pm->req_list;
-    }
+    peer_release_requests(pr);
 
-    pm->rcvlen -= 5;
-    if(pm->rcvlen) {
-        memmove(pm->rcvbuf, pm->rcvbuf+5, pm->rcvlen);
-    }
+    peer_rcv_consume(pm, 5);
 
     return 0;
 }
@@ -1160,10 +1569,7 @@ peer_recv_unchoked_msg(struct peer *pr)
 
     peer_send_request_msg(pr, &pr->pm);
 
-    pr->pm.rcvlen -= 5;
-    if(pr->pm.rcvlen) {
-        memmove(pr->pm.rcvbuf, pr->pm.rcvbuf+5, pr->pm.rcvlen);
-    }
+    peer_rcv_consume(&pr->pm, 5);
  
     return 0;
 }
@@ -1179,10 +1585,7 @@ peer_recv_intrested_msg(struct peer *pr)
 
     struct peer_rcv_msg *pm;
     pm = &pr->pm;
-    pm->rcvlen -= 5;
-    if(pm->rcvlen) {
-        memmove(pm->rcvbuf, pm->rcvbuf+5, pm->rcvlen);
-    }
+    peer_rcv_consume(pm, 5);
 
     /* peer not have any piece, and not sending bitfield to us */
     if(!pr->bf.bitmap) {
@@ -1206,10 +1609,7 @@ peer_recv_notintrested_msg(struct peer *pr)
 
     struct peer_rcv_msg *pm;
     pm = &pr->pm;
-    pm->rcvlen -= 5;
-    if(pm->rcvlen) {
-        memmove(pm->rcvbuf, pm->rcvbuf+5, pm->rcvlen);
-    }
+    peer_rcv_consume(pm, 5);
 
     return 0;
 }
@@ -1222,16 +1622,20 @@ peer_recv_have_msg(struct peer *pr)
     pm = &pr->pm;
 
     int idx;
-    memcpy(&idx, pm->rcvbuf+5, 4);
+    memcpy(&idx, peer_rcv_head(pm)+5, 4);
     idx = socket_ntohl(idx);
 
-    pm->rcvlen -= 9;
-    if(pm->rcvlen) {
-        memmove(pm->rcvbuf, pm->rcvbuf+9, pm->rcvlen);
-    }
+    peer_rcv_consume(pm, 9);
 
     LOG_INFO("peer[%s] recv have msg[%d]!\n", pr->strfaddr, idx);
 
+    /* a peer with nothing may skip the bitfield msg */
+    if(!pr->bf.bitmap && bitfield_create(&pr->bf, pr->tsk->bf.npieces,
+                                pr->tsk->bf.piecesz, pr->tsk->bf.totalsz)) {
+        LOG_ERROR("peer[%s] bitfield create failed!\n", pr->strfaddr);
+        return -1;
+    }
+
     if(!bitfield_peer_have(&pr->tsk->bf, &pr->bf, idx) && !pr->am_interested) {
         peer_send_intrested_msg(pr);
     }
@@ -1248,19 +1652,16 @@ peer_recv_request_msg(struct peer *pr)
 
     int idx, offset, size;
 
-    memcpy(&idx, pm->rcvbuf+5, 4);
+    memcpy(&idx, peer_rcv_head(pm)+5, 4);
     idx = socket_ntohl(idx);
 
-    memcpy(&offset, pm->rcvbuf+9, 4);
+    memcpy(&offset, peer_rcv_head(pm)+9, 4);
     offset = socket_ntohl(offset);
 
-    memcpy(&size, pm->rcvbuf+13, 4);
+    memcpy(&size, peer_rcv_head(pm)+13, 4);
     size = socket_ntohl(size);
 
-    pm->rcvlen -= 17;
-    if(pm->rcvlen) {
-        memmove(pm->rcvbuf, pm->rcvbuf+17, pm->rcvlen);
-    }
+    peer_rcv_consume(pm, 17);
 
     LOG_INFO("peer[%s] recv request msg[%d,%d,%d]!\n", pr->strfaddr, idx, offset, size);
 
@@ -1279,11 +1680,6 @@ peer_recv_request_msg(struct peer *pr)
         return -1;
     }
 
-    if(!pr->psm.req_list) {
-        /* peer_modify_timer_time(pr, 10); */
-        peer_mod_event(pr, EPOLLIN | EPOLLOUT);
-    }
-
     struct slice *req;
     if(!(req = GCALLOC(1, sizeof(*req)))) {
         LOG_ERROR("out of memory!\n");
@@ -1296,8 +1692,9 @@ peer_recv_request_msg(struct peer *pr)
 
     *pr->psm.req_tail = req;
     pr->psm.req_tail = &req->next;
+    pr->psm.reqsz += PIECE_HDR_SZ + size;
 
-    return 0;
+    return peer_update_event(pr);
 }
 
 /* len_pre+id+idx+offset+size */
@@ -1309,19 +1706,16 @@ peer_recv_cancel_msg(struct peer *pr)
 
     int idx, offset, size;
 
-    memcpy(&idx, pm->rcvbuf+5, 4);
+    memcpy(&idx, peer_rcv_head(pm)+5, 4);
     idx = socket_ntohl(idx);
 
-    memcpy(&offset, pm->rcvbuf+9, 4);
+    memcpy(&offset, peer_rcv_head(pm)+9, 4);
     offset = socket_ntohl(offset);
 
-    memcpy(&size, pm->rcvbuf+13, 4);
+    memcpy(&size, peer_rcv_head(pm)+13, 4);
     size = socket_ntohl(size);
 
-    pm->rcvlen -= 17;
-    if(pm->rcvlen) {
-        memmove(pm->rcvbuf, pm->rcvbuf+17, pm->rcvlen);
-    }
+    peer_rcv_consume(pm, 17);
 
     LOG_INFO("peer[%s] recv cancel msg[%d,%d,%d]!\n", pr->strfaddr, idx, offset, size);
 
@@ -1332,9 +1726,11 @@ peer_recv_cancel_msg(struct peer *pr)
         }
     }
 
-    if(*sl) {
+    /* a block already on the wire has to be finished */
+    if(*sl && !(*sl)->sendsz) {
         struct slice *tmp = *sl;
         *sl = (*sl)->next;
+        pr->psm.reqsz -= PIECE_HDR_SZ + tmp->slicesz;
         GFREE(tmp);
         if(!pr->psm.req_list) {
             pr->psm.req_tail = &pr->psm.req_list;
@@ -1352,39 +1748,21 @@ peer_recv_keepalive_msg(struct peer *pr)
 
     struct peer_rcv_msg *pm;
     pm = &pr->pm;
-    pm->rcvlen -= 4;
-    if(pm->rcvlen) {
-        memmove(pm->rcvbuf, pm->rcvbuf+4, pm->rcvlen);
-    }
+    peer_rcv_consume(pm, 4);
 
     return 0;
 }
 
+/* 'len' more bytes of the block were read into piecebuf in place */
 static int
-peer_recv_left_piece_msg(struct peer *pr)
+peer_recv_left_piece_msg(struct peer *pr, int len)
 {
     struct peer_rcv_msg *pm = &pr->pm;
-    if(!pm->req_list || !pm->piecebuf) {
-        LOG_ERROR("peer[%s] download error!\n", pr->strfaddr);
-        return -1;
-    }
-
-    int totalsz = pm->req_list->downsz + pm->rcvlen;
-    int offset = pm->req_list->offset + pm->req_list->downsz;
 
-    pr->ipaddr->downsz += pm->rcvlen;
-
-    if(totalsz >= pm->req_list->slicesz) {
-        int len = totalsz - pm->req_list->slicesz;
-        memcpy(pm->piecebuf+offset, pm->rcvbuf, pm->rcvlen - len);
-
-        if(len) {
-            memmove(pr->pm.rcvbuf, pr->pm.rcvbuf+pr->pm.rcvlen-len, len);
-            pr->pm.rcvlen = len;
-        } else {
-            pr->pm.rcvlen = 0;
-        }
+    pm->req_list->downsz += len;
+    pr->ipaddr->downsz += len;
 
+    if(pm->req_list->downsz >= pm->req_list->slicesz) {
         pm->data_transfering = 0;
 
 #if 1
@@ -1396,11 +1774,6 @@ peer_recv_left_piece_msg(struct peer *pr)
         }
 
         peer_send_request_msg(pr, pm);
-
-    } else {
-        memcpy(pm->piecebuf+offset, pm->rcvbuf, pm->rcvlen);
-        pm->req_list->downsz += pm->rcvlen;
-        pr->pm.rcvlen = 0;
     }
 
     return 0;
@@ -1420,7 +1793,7 @@ peer_check_download_slice(struct peer *pr, int idx, int offset, int slicesz)
     }
 
     if(!(*iter)) {
-        LOG_ERROR("peer[%s] recv not correct piece msg[%d,%d]!\n", pr->strfaddr, idx, offset);
+        LOG_DEBUG("peer[%s] recv not requested piece msg[%d,%d]!\n", pr->strfaddr, idx, offset);
         return -1;
     }
 
@@ -1439,6 +1812,50 @@ peer_check_download_slice(struct peer *pr, int idx, int offset, int slicesz)
     return 0;
 }
 
+/* a block we cancelled or got from another peer meanwhile, drop its data */
+static int
+peer_discard_piece_msg(struct peer *pr, int blocksz)
+{
+    struct peer_rcv_msg *pm = &pr->pm;
+
+    if(blocksz > SLICE_SZ) {
+        LOG_ERROR("peer[%s] recv unexpected piece msg[%d]!\n", pr->strfaddr, blocksz);
+        return -1;
+    }
+
+    int datasz = pm->rcvlen - 13;
+    if(datasz < blocksz) {
+        pm->discard = blocksz - datasz;
+        peer_rcv_consume(pm, pm->rcvlen);
+    } else {
+        datasz = blocksz;
+        peer_rcv_consume(pm, 13+blocksz);
+    }
+
+    pr->tsk->dup_size += datasz;
+
+    return 0;
+}
+
+/* the place of the block in its piece, or blockbuf when it is written through */
+static char *
+peer_block_buffer(struct peer *pr)
+{
+    struct peer_rcv_msg *pm = &pr->pm;
+
+    pm->through = !pm->dp->piecebuf;
+    if(!pm->through) {
+        return pm->dp->piecebuf + pm->req_list->offset;
+    }
+
+    if(!pm->blockbuf && !(pm->blockbuf = GMALLOC(SLICE_SZ))) {
+        LOG_ERROR("out of memory!\n");
+        return NULL;
+    }
+
+    return pm->blockbuf;
+}
+
 /* piece msg : len_pre+id+idx+offset+data */
 static int
 peer_recv_piece_msg(struct peer *pr)
@@ -1447,45 +1864,46 @@ peer_recv_piece_msg(struct peer *pr)
     pm = &pr->pm;
 
     int idx, offset;
-    memcpy(&idx, pm->rcvbuf+5, 4);
+    memcpy(&idx, peer_rcv_head(pm)+5, 4);
     idx = socket_ntohl(idx);
 
-    memcpy(&offset, pm->rcvbuf+9, 4);
+    memcpy(&offset, peer_rcv_head(pm)+9, 4);
     offset = socket_ntohl(offset);
 
-    char *data = pm->rcvbuf + 13;
+    char *data = peer_rcv_head(pm) + 13;
     int datasz = pm->rcvlen - 13;
 
     int len_pre;
-    memcpy(&len_pre, pm->rcvbuf, 4);
+    memcpy(&len_pre, peer_rcv_head(pm), 4);
     len_pre = socket_ntohl(len_pre);
 
     if(peer_check_download_slice(pr, idx, offset, len_pre-9)) {
-        return -1;
+        return peer_discard_piece_msg(pr, len_pre-9);
     }
 
-    pr->ipaddr->downsz += datasz;
-
-    if(!pm->piecebuf && !(pm->piecebuf = GMALLOC(pr->tsk->bf.piecesz))) {
-        LOG_ERROR("out of memory[%d]\n", pr->tsk->bf.piecesz);
+    if(!(pm->dp = bitfield_down_piece_find(&pr->tsk->bf, idx)) || pm->dp->verifying) {
+        LOG_ERROR("peer[%s] piece[%d] not in download!\n", pr->strfaddr, idx);
         return -1;
     }
 
-    pm->piecelen = idx == pr->tsk->bf.npieces-1 ?
-                   pr->tsk->bf.last_piecesz : pr->tsk->bf.piecesz;
+    char *dst = peer_block_buffer(pr);
+    if(!dst) {
+        return -1;
+    }
 
     if(datasz < pm->req_list->slicesz) { /* part of slice */
-        memcpy(pm->piecebuf+pm->req_list->offset, data, datasz);
+        memcpy(dst, data, datasz);
         pm->req_list->downsz = datasz;
         pm->data_transfering = 1;
-        pm->rcvlen = 0;
+        pr->ipaddr->downsz += datasz;
+        peer_rcv_consume(pm, pm->rcvlen);
     } else { /* a small slice data */
-        memcpy(pm->piecebuf+pm->req_list->offset, data, pm->req_list->slicesz);
-        pm->rcvlen = datasz - pm->req_list->slicesz;
-        if(pm->rcvlen) {
-            memmove(pm->rcvbuf, pm->rcvbuf+13+pm->req_list->slicesz, pm->rcvlen);     
+        memcpy(dst, data, pm->req_list->slicesz);
+        pr->ipaddr->downsz += pm->req_list->slicesz;
+        peer_rcv_consume(pm, 13+pm->req_list->slicesz);
+        if(peer_down_complete_slice(pr)) {
+            return -1;
         }
-        peer_down_complete_slice(pr);
         peer_send_request_msg(pr, pm);
     }
 
@@ -1521,11 +1939,6 @@ peer_event_connecting(struct peer *pr, int event)
             goto FAILED;
         }
 
-        if(peer_mod_event(pr, EPOLLIN)) {
-            LOG_ERROR("peer[%s] mod event failed!\n", pr->strfaddr);
-            goto FAILED;
-        }
-
         if(peer_start_timer(pr)) {
             LOG_ERROR("peer[%s] start timer failed!\n", pr->strfaddr);
             goto FAILED;
@@ -1548,18 +1961,15 @@ static int
 peer_event_handshake(struct peer *pr, int event)
 {
     if(event & EPOLLOUT) {
-        LOG_ALARM("write event occur in handshake state!\n");
+        if(peer_send_normal_msg(pr, pr->psm.outlen, 0) || peer_update_event(pr)) {
+            goto FAILED;
+        }
     }
 
-    peer_stop_timer(pr);
-
     if(event & EPOLLIN) {
-        if(peer_recv_handshake_msg(pr)) {
-            goto FAILED;
-        }
+        peer_stop_timer(pr);
 
-        if(peer_mod_event(pr, EPOLLIN)) {
-            LOG_ERROR("peer[%s] mod event failed!\n", pr->strfaddr);
+        if(peer_recv_handshake_msg(pr)) {
             goto FAILED;
         }
 
@@ -1578,6 +1988,10 @@ peer_event_handshake(struct peer *pr, int event)
         return 0;
     }
 
+    if(event & EPOLLOUT) {
+        return 0;
+    }
+
 FAILED:
     peer_reset_member(pr);
     torrent_peer_recycle(pr->tsk, pr, PEER_TYPE_ACTIVE_NONE);
@@ -1587,23 +2001,94 @@ FAILED:
 static int
 peer_event_connected_recv(struct peer *pr)
 {
-    int rcvlen = peer_recv_data(pr, pr->pm.rcvbuf+pr->pm.rcvlen,
-                                    MAX_BUFFER_LEN - pr->pm.rcvlen);
+    struct peer_rcv_msg *pm = &pr->pm;
+
+    /* only a partial msg is left at rcvpos, move it when the tail runs short */
+    if(pm->rcvpos && pm->rcvpos + pm->rcvlen > MAX_BUFFER_LEN/2) {
+        memmove(pm->rcvbuf, peer_rcv_head(pm), pm->rcvlen);
+        pm->rcvpos = 0;
+    }
+
+    /*
+     * the rest of a block in flight is read straight into its place in
+     * piecebuf, only a little of what follows it goes to rcvbuf so the
+     * next block has its data copied once at most for a mtu.
+     */
+    struct iovec iovs[2];
+    int niov = 0, left = 0, drop = 0;
+    int room = MAX_BUFFER_LEN - pm->rcvpos - pm->rcvlen;
+
+    if(pm->discard) {
+        /* nothing else is buffered, the dropped bytes just pass rcvbuf */
+        if(pm->rcvlen) {
+            LOG_ERROR("peer[%s] download error!\n", pr->strfaddr);
+            return -1;
+        }
+        room = drop = room < pm->discard ? room : pm->discard;
+    } else if(pm->data_transfering) {
+        if(!pm->req_list || !pm->dp || pm->rcvlen || (!pm->through && !pm->dp->piecebuf)) {
+            LOG_ERROR("peer[%s] download error!\n", pr->strfaddr);
+            return -1;
+        }
+
+        left = pm->req_list->slicesz - pm->req_list->downsz;
+        iovs[niov].iov_base = (pm->through ? pm->blockbuf : pm->dp->piecebuf + pm->req_list->offset)
+                                    + pm->req_list->downsz;
+        iovs[niov++].iov_len = left;
+        room = room < MTU_SZ ? room : MTU_SZ;
+    }
+
+    iovs[niov].iov_base = peer_rcv_head(pm) + pm->rcvlen;
+    iovs[niov++].iov_len = room;
+
+    int quota = torrent_mgr_quota(pr->tsk, RATE_DOWN, left + room);
+    if(left + room > 0 && !quota) {
+        pr->throttled |= EPOLLIN;
+        return peer_update_event(pr);
+    } else if(quota < left) {
+        iovs[0].iov_len = quota;
+        niov = 1;
+    } else {
+        iovs[niov-1].iov_len = quota - left;
+    }
+
+    /*
+     * only a block in flight lands in memory other loops see, a piece
+     * buffer the hash job may take or a block an endgame cancel drops.
+     * the msgs and the bytes dropped go to rcvbuf, without the lock.
+     */
+    int rcvlen;
+    if(!left) {
+        pthread_mutex_unlock(&pr->tsk->lock);
+        rcvlen = socket_tcp_recv_iovs(pr->sockid, iovs, niov);
+        pthread_mutex_lock(&pr->tsk->lock);
+    } else {
+        rcvlen = socket_tcp_recv_iovs(pr->sockid, iovs, niov);
+    }
+
     if(rcvlen <= 0) {
         LOG_ERROR("peer[%s] recv[%d] error:%s\n", pr->strfaddr, rcvlen, strerror(errno));
         return -1;
     }
+    torrent_mgr_charge(pr->tsk, RATE_DOWN, rcvlen);
 
-    pr->pm.rcvlen += rcvlen;
-
-    while(pr->pm.rcvlen > 0) {
+    if(drop) {
+        pm->discard -= rcvlen;
+        pr->tsk->dup_size += rcvlen;
+        return 0;
+    }
 
-        if(pr->pm.data_transfering) {
-            if(peer_recv_left_piece_msg(pr)) {
-                return -1;
-            }
-            continue;
+    if(left) {
+        int len = rcvlen < left ? rcvlen : left;
+        if(peer_recv_left_piece_msg(pr, len)) {
+            return -1;
         }
+        rcvlen -= len;
+    }
+
+    pm->rcvlen += rcvlen;
+
+    while(pm->rcvlen > 0) {
 
         int res = peer_parser_msg(pr, &pr->pm);
 
@@ -1619,19 +2104,43 @@ peer_event_connected_recv(struct peer *pr)
     return 0;
 }
 
+/*
+ * up to 'maxlen' bytes of the ring in one writev, what the socket does
+ * not take stays queued.
+ */
 static int
-peer_send_normal_msg(struct peer *pr)
+peer_send_normal_msg(struct peer *pr, int maxlen, int flags)
 {
-    struct peer_simple_msg *msg, **iter = &pr->psm.msg_list;
-    while(*iter) {
-        msg = *iter; 
-        if(socket_tcp_send(pr->sockid, msg->buffer, msg->bufsz, 0) != msg->bufsz) {
-            LOG_ERROR("peer[%s] send failed:%s\n", pr->strfaddr, strerror(errno));
-            return -1;
-        }
-        *iter = msg->next;
-        GFREE(msg);
+    struct peer_send_msg *psm = &pr->psm;
+    int len = maxlen < psm->outlen ? maxlen : psm->outlen;
+    if(len <= 0) {
+        return 0;
+    }
+
+    struct iovec iovs[2];
+    int first = psm->outsz - psm->outhead;
+    first = first < len ? first : len;
+
+    iovs[0].iov_base = psm->outbuf + psm->outhead;
+    iovs[0].iov_len = first;
+    iovs[1].iov_base = psm->outbuf;
+    iovs[1].iov_len = len - first;
+
+    int wlen = socket_tcp_send_iovs(pr->sockid, iovs, iovs[1].iov_len ? 2 : 1, flags);
+    if(wlen < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return 0;
+    } else if(wlen < 0) {
+        LOG_ERROR("peer[%s] send failed:%s\n", pr->strfaddr, strerror(errno));
+        return -1;
+    }
+
+    psm->outhead = (psm->outhead + wlen) % psm->outsz;
+    psm->outlen -= wlen;
+    if(!psm->outlen) {
+        psm->outhead = 0;
     }
+    psm->outhdr -= psm->outhdr < wlen ? psm->outhdr : wlen;
+    pr->heartbeat = time(NULL) + 60;
 
     return 0;
 }
@@ -1639,9 +2148,9 @@ peer_send_normal_msg(struct peer *pr)
 static int
 peer_event_connected_send(struct peer *pr)
 {
-    /* normal bt msg */
+    /* normal bt msg, never in the middle of a block */
     if(!pr->psm.req_list || !pr->psm.req_list->sendsz) {
-        if(peer_send_normal_msg(pr)) {
+        if(peer_send_normal_msg(pr, pr->psm.outlen, 0)) {
             return -1;
         }
     }
@@ -1651,11 +2160,7 @@ peer_event_connected_send(struct peer *pr)
         return -1;
     }
 
-    if(!pr->psm.req_list) {
-        peer_mod_event(pr, EPOLLIN);
-    }
-
-    return 0;
+    return peer_update_event(pr);
 }
 
 static int
@@ -1682,11 +2187,8 @@ FAILED:
 }
 
 static int
-peer_event_handle(int event, void *evt_ctx)
+peer_event_state(struct peer *pr, int event)
 {
-    struct peer *pr;
-    pr = (struct peer *)evt_ctx;
-
     switch(pr->state) {
         case PEER_STATE_CONNECTING:
             return peer_event_connecting(pr, event);
@@ -1704,6 +2206,19 @@ peer_event_handle(int event, void *evt_ctx)
     return -1;
 }
 
+static int
+peer_event_handle(int event, void *evt_ctx)
+{
+    struct peer *pr = (struct peer *)evt_ctx;
+    struct torrent_task *tsk = pr->tsk;
+
+    pthread_mutex_lock(&tsk->lock);
+    int ret = pr->isused ? peer_event_state(pr, event) : -1;
+    pthread_mutex_unlock(&tsk->lock);
+
+    return ret;
+}
+
 int
 peer_init(struct peer *pr)
 {
@@ -1712,20 +2227,32 @@ peer_init(struct peer *pr)
         pr->state = PEER_STATE_SEND_HANDSHAKE;
     }
 
+    pr->event = 0;
+    pr->throttled = 0;
     pr->start_time = time(NULL);
     pr->heartbeat = pr->start_time;
     pr->am_unchoking = 1;
     pr->peer_unchoking =  1;
     pr->having_pieces = NULL;
 
-    pr->psm.piecedata = NULL;
-    pr->psm.piecesz = 0;
     pr->psm.req_list = NULL;
     pr->psm.req_tail = &pr->psm.req_list;
 
-    pr->pm.piecebuf = NULL;
+    pr->pm.req_list = NULL;
+    pr->pm.req_tail = &pr->pm.req_list;
+    pr->pm.dp = NULL;
+    pr->pm.discard = 0;
+    pr->pm.through = 0;
+    pr->pm.blockbuf = NULL;
     pr->pm.data_transfering = 0;
     pr->pm.rcvlen = 0;
+    pr->pm.rcvpos = 0;
+
+    pr->pm.nreq = 0;
+    pr->pm.reqdepth = PEER_REQ_DEPTH_MIN;
+    pr->pm.rate = pr->pm.rtt = 0;
+    pr->pm.win_bytes = pr->pm.win_rtt = 0;
+    pr->pm.win_start = utils_mtime();
 
     pr->pm.rcvbuf = GMALLOC(MAX_BUFFER_LEN);
     if(!pr->pm.rcvbuf) {
@@ -1753,3 +2280,9 @@ FAILED:
     return -1;
 }
 
+/* drop the connection, the blocks it received stay with their pieces in download */
+int
+peer_uninit(struct peer *pr)
+{
+    return peer_reset_member(pr);
+}
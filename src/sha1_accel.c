@@ -0,0 +1,540 @@
+#include <pthread.h>
+#include <string.h>
+#include "type.h"
+#include "sha1.h"
+#include "sha1_accel.h"
+#include "log.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SHA1_ACCEL_X86
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+/*
+ * sha1 backends behind utils_sha1_gen/check. a backend gives a block
+ * compress function, padding is done here once for all of them. the
+ * multi-buffer one runs the common full blocks of up to 8 buffers in
+ * the lanes of a vector, the tails are finished one by one.
+ */
+
+typedef void (*sha1_compress_t)(uint32 state[5], const unsigned char *data, size_t nblocks);
+typedef void (*sha1_compress_mb_t)(uint32 state[5][SHA1_MB_LANES],
+                    const unsigned char **data, size_t nblocks);
+
+static const uint32 sha1_iv[5] = {
+    0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0
+};
+
+static const char *sha1_backend_names[SHA1_BACKEND_NUM] = {
+    "auto", "ref", "scalar", "sha-ni", "avx2-mb"
+};
+
+static struct {
+    int backend;
+    sha1_compress_t compress;
+    sha1_compress_mb_t compress_mb;
+} sha1_sel;
+
+static int sha1_cpu_shani, sha1_cpu_avx2;
+static pthread_once_t sha1_once = PTHREAD_ONCE_INIT;
+
+#define ROL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+static inline uint32
+sha1_load_be32(const unsigned char *p)
+{
+    return (uint32)p[0] << 24 | (uint32)p[1] << 16 | (uint32)p[2] << 8 | p[3];
+}
+
+static inline void
+sha1_store_be32(unsigned char *p, uint32 v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+/* fully unrolled, 16 words message schedule kept in a ring */
+static void
+sha1_scalar_compress(uint32 state[5], const unsigned char *data, size_t nblocks)
+{
+    uint32 a, b, c, d, e, w[16];
+
+#define W(i) (w[(i) & 15] = ROL(w[((i) + 13) & 15] ^ w[((i) + 8) & 15] \
+                ^ w[((i) + 2) & 15] ^ w[(i) & 15], 1))
+#define R0(a, b, c, d, e, i) \
+    e += (d ^ (b & (c ^ d))) + (w[i] = sha1_load_be32(data + 4 * (i))) + 0x5A827999 + ROL(a, 5); \
+    b = ROL(b, 30);
+#define R1(a, b, c, d, e, i) \
+    e += (d ^ (b & (c ^ d))) + W(i) + 0x5A827999 + ROL(a, 5); b = ROL(b, 30);
+#define R2(a, b, c, d, e, i) \
+    e += (b ^ c ^ d) + W(i) + 0x6ED9EBA1 + ROL(a, 5); b = ROL(b, 30);
+#define R3(a, b, c, d, e, i) \
+    e += ((b & c) | (d & (b | c))) + W(i) + 0x8F1BBCDC + ROL(a, 5); b = ROL(b, 30);
+#define R4(a, b, c, d, e, i) \
+    e += (b ^ c ^ d) + W(i) + 0xCA62C1D6 + ROL(a, 5); b = ROL(b, 30);
+#define ROUND5(R, i) \
+    R(a, b, c, d, e, i) R(e, a, b, c, d, i + 1) R(d, e, a, b, c, i + 2) \
+    R(c, d, e, a, b, i + 3) R(b, c, d, e, a, i + 4)
+
+    while(nblocks--) {
+        a = state[0];
+        b = state[1];
+        c = state[2];
+        d = state[3];
+        e = state[4];
+
+        ROUND5(R0, 0) ROUND5(R0, 5) ROUND5(R0, 10)
+        R0(a, b, c, d, e, 15) R1(e, a, b, c, d, 16) R1(d, e, a, b, c, 17)
+        R1(c, d, e, a, b, 18) R1(b, c, d, e, a, 19)
+        ROUND5(R2, 20) ROUND5(R2, 25) ROUND5(R2, 30) ROUND5(R2, 35)
+        ROUND5(R3, 40) ROUND5(R3, 45) ROUND5(R3, 50) ROUND5(R3, 55)
+        ROUND5(R4, 60) ROUND5(R4, 65) ROUND5(R4, 70) ROUND5(R4, 75)
+
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+
+        data += 64;
+    }
+
+#undef W
+#undef R0
+#undef R1
+#undef R2
+#undef R3
+#undef R4
+#undef ROUND5
+}
+
+#ifdef SHA1_ACCEL_X86
+
+/* 4 rounds per sha1rnds4, the message schedule runs 3 groups ahead */
+#define SHANI_ROUNDS4(f, Ein, Eout, Mc, Mn, Mx, Mp) \
+    Ein = _mm_sha1nexte_epu32(Ein, Mc); \
+    Eout = abcd; \
+    Mn = _mm_sha1msg2_epu32(Mn, Mc); \
+    abcd = _mm_sha1rnds4_epu32(abcd, Ein, f); \
+    Mp = _mm_sha1msg1_epu32(Mp, Mc); \
+    Mx = _mm_xor_si128(Mx, Mc);
+
+__attribute__((target("sha,sse4.1,ssse3")))
+static void
+sha1_shani_compress(uint32 state[5], const unsigned char *data, size_t nblocks)
+{
+    const __m128i mask = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+    __m128i abcd, abcd_save, e0, e0_save, e1;
+    __m128i m0, m1, m2, m3;
+
+    abcd = _mm_loadu_si128((const __m128i *)state);
+    abcd = _mm_shuffle_epi32(abcd, 0x1B);
+    e0 = _mm_set_epi32(state[4], 0, 0, 0);
+
+    while(nblocks--) {
+        abcd_save = abcd;
+        e0_save = e0;
+
+        m0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 0)), mask);
+        e0 = _mm_add_epi32(e0, m0);
+        e1 = abcd;
+        abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+
+        m1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 16)), mask);
+        e1 = _mm_sha1nexte_epu32(e1, m1);
+        e0 = abcd;
+        abcd = _mm_sha1rnds4_epu32(abcd, e1, 0);
+        m0 = _mm_sha1msg1_epu32(m0, m1);
+
+        m2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 32)), mask);
+        e0 = _mm_sha1nexte_epu32(e0, m2);
+        e1 = abcd;
+        abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+        m1 = _mm_sha1msg1_epu32(m1, m2);
+        m0 = _mm_xor_si128(m0, m2);
+
+        m3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 48)), mask);
+        e1 = _mm_sha1nexte_epu32(e1, m3);
+        e0 = abcd;
+        m0 = _mm_sha1msg2_epu32(m0, m3);
+        abcd = _mm_sha1rnds4_epu32(abcd, e1, 0);
+        m2 = _mm_sha1msg1_epu32(m2, m3);
+        m1 = _mm_xor_si128(m1, m3);
+
+        SHANI_ROUNDS4(0, e0, e1, m0, m1, m2, m3)    /* 16-19 */
+        SHANI_ROUNDS4(1, e1, e0, m1, m2, m3, m0)
+        SHANI_ROUNDS4(1, e0, e1, m2, m3, m0, m1)
+        SHANI_ROUNDS4(1, e1, e0, m3, m0, m1, m2)
+        SHANI_ROUNDS4(1, e0, e1, m0, m1, m2, m3)
+        SHANI_ROUNDS4(1, e1, e0, m1, m2, m3, m0)    /* 36-39 */
+        SHANI_ROUNDS4(2, e0, e1, m2, m3, m0, m1)
+        SHANI_ROUNDS4(2, e1, e0, m3, m0, m1, m2)
+        SHANI_ROUNDS4(2, e0, e1, m0, m1, m2, m3)
+        SHANI_ROUNDS4(2, e1, e0, m1, m2, m3, m0)
+        SHANI_ROUNDS4(2, e0, e1, m2, m3, m0, m1)    /* 56-59 */
+        SHANI_ROUNDS4(3, e1, e0, m3, m0, m1, m2)
+        SHANI_ROUNDS4(3, e0, e1, m0, m1, m2, m3)
+        SHANI_ROUNDS4(3, e1, e0, m1, m2, m3, m0)
+        SHANI_ROUNDS4(3, e0, e1, m2, m3, m0, m1)
+        SHANI_ROUNDS4(3, e1, e0, m3, m0, m1, m2)    /* 76-79 */
+
+        e0 = _mm_sha1nexte_epu32(e0, e0_save);
+        abcd = _mm_add_epi32(abcd, abcd_save);
+
+        data += 64;
+    }
+
+    abcd = _mm_shuffle_epi32(abcd, 0x1B);
+    _mm_storeu_si128((__m128i *)state, abcd);
+    state[4] = _mm_extract_epi32(e0, 3);
+}
+
+#undef SHANI_ROUNDS4
+
+/* 8 independent buffers, a 32 bits lane for each */
+__attribute__((target("avx2")))
+static void
+sha1_avx2_compress_mb(uint32 state[5][SHA1_MB_LANES], const unsigned char **data, size_t nblocks)
+{
+    const __m256i bswap = _mm256_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3,
+                                          12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+    __m256i a, b, c, d, e, w[16];
+    size_t off = 0;
+
+#define VROL(x, n) _mm256_or_si256(_mm256_slli_epi32(x, n), _mm256_srli_epi32(x, 32 - (n)))
+#define VADD(x, y) _mm256_add_epi32(x, y)
+#define VXOR(x, y) _mm256_xor_si256(x, y)
+#define VAND(x, y) _mm256_and_si256(x, y)
+#define VOR(x, y) _mm256_or_si256(x, y)
+#define F1(b, c, d) VXOR(d, VAND(b, VXOR(c, d)))
+#define F2(b, c, d) VXOR(VXOR(b, c), d)
+#define F3(b, c, d) VOR(VAND(b, c), VAND(d, VOR(b, c)))
+#define W(i) (w[(i) & 15] = VROL(VXOR(VXOR(w[((i) + 13) & 15], w[((i) + 8) & 15]), \
+                    VXOR(w[((i) + 2) & 15], w[(i) & 15])), 1))
+#define VR(F, k, a, b, c, d, e, wi) \
+    e = VADD(VADD(e, F(b, c, d)), VADD(VADD(wi, _mm256_set1_epi32(k)), VROL(a, 5))); \
+    b = VROL(b, 30);
+#define R0(a, b, c, d, e, i) VR(F1, 0x5A827999, a, b, c, d, e, w[i])
+#define R1(a, b, c, d, e, i) VR(F1, 0x5A827999, a, b, c, d, e, W(i))
+#define R2(a, b, c, d, e, i) VR(F2, 0x6ED9EBA1, a, b, c, d, e, W(i))
+#define R3(a, b, c, d, e, i) VR(F3, 0x8F1BBCDC, a, b, c, d, e, W(i))
+#define R4(a, b, c, d, e, i) VR(F2, 0xCA62C1D6, a, b, c, d, e, W(i))
+#define ROUND5(R, i) \
+    R(a, b, c, d, e, i) R(e, a, b, c, d, i + 1) R(d, e, a, b, c, i + 2) \
+    R(c, d, e, a, b, i + 3) R(b, c, d, e, a, i + 4)
+
+    a = _mm256_loadu_si256((const __m256i *)state[0]);
+    b = _mm256_loadu_si256((const __m256i *)state[1]);
+    c = _mm256_loadu_si256((const __m256i *)state[2]);
+    d = _mm256_loadu_si256((const __m256i *)state[3]);
+    e = _mm256_loadu_si256((const __m256i *)state[4]);
+
+    while(nblocks--) {
+        __m256i sa = a, sb = b, sc = c, sd = d, se = e;
+
+        /* 8x8 transpose, w[i] gets word i of every lane */
+        int k;
+        for(k = 0; k < 2; k++) {
+            __m256i r[8], t[8], u[8];
+            int i;
+            for(i = 0; i < 8; i++) {
+                r[i] = _mm256_loadu_si256((const __m256i *)(data[i] + off + k * 32));
+            }
+            for(i = 0; i < 8; i += 2) {
+                t[i] = _mm256_unpacklo_epi32(r[i], r[i + 1]);
+                t[i + 1] = _mm256_unpackhi_epi32(r[i], r[i + 1]);
+            }
+            for(i = 0; i < 8; i += 4) {
+                u[i] = _mm256_unpacklo_epi64(t[i], t[i + 2]);
+                u[i + 1] = _mm256_unpackhi_epi64(t[i], t[i + 2]);
+                u[i + 2] = _mm256_unpacklo_epi64(t[i + 1], t[i + 3]);
+                u[i + 3] = _mm256_unpackhi_epi64(t[i + 1], t[i + 3]);
+            }
+            for(i = 0; i < 4; i++) {
+                w[k * 8 + i] = _mm256_shuffle_epi8(_mm256_permute2x128_si256(u[i], u[i + 4], 0x20), bswap);
+                w[k * 8 + i + 4] = _mm256_shuffle_epi8(_mm256_permute2x128_si256(u[i], u[i + 4], 0x31), bswap);
+            }
+        }
+
+        ROUND5(R0, 0) ROUND5(R0, 5) ROUND5(R0, 10)
+        R0(a, b, c, d, e, 15) R1(e, a, b, c, d, 16) R1(d, e, a, b, c, 17)
+        R1(c, d, e, a, b, 18) R1(b, c, d, e, a, 19)
+        ROUND5(R2, 20) ROUND5(R2, 25) ROUND5(R2, 30) ROUND5(R2, 35)
+        ROUND5(R3, 40) ROUND5(R3, 45) ROUND5(R3, 50) ROUND5(R3, 55)
+        ROUND5(R4, 60) ROUND5(R4, 65) ROUND5(R4, 70) ROUND5(R4, 75)
+
+        a = VADD(a, sa);
+        b = VADD(b, sb);
+        c = VADD(c, sc);
+        d = VADD(d, sd);
+        e = VADD(e, se);
+
+        off += 64;
+    }
+
+    _mm256_storeu_si256((__m256i *)state[0], a);
+    _mm256_storeu_si256((__m256i *)state[1], b);
+    _mm256_storeu_si256((__m256i *)state[2], c);
+    _mm256_storeu_si256((__m256i *)state[3], d);
+    _mm256_storeu_si256((__m256i *)state[4], e);
+
+#undef VROL
+#undef VADD
+#undef VXOR
+#undef VAND
+#undef VOR
+#undef F1
+#undef F2
+#undef F3
+#undef W
+#undef VR
+#undef R0
+#undef R1
+#undef R2
+#undef R3
+#undef R4
+#undef ROUND5
+}
+
+static void
+sha1_accel_cpuid(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+    if(!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+        return;
+    }
+
+    int ssse3 = ecx & bit_SSSE3, sse41 = ecx & bit_SSE4_1;
+    int avx = (ecx & bit_AVX) && (ecx & bit_OSXSAVE);
+
+    if(__get_cpuid_max(0, NULL) < 7) {
+        return;
+    }
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+
+    sha1_cpu_shani = (ebx & bit_SHA) && ssse3 && sse41;
+
+    /* the os must save the ymm registers too */
+    if(avx && (ebx & bit_AVX2)) {
+        unsigned int lo, hi;
+        __asm__ volatile("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+        sha1_cpu_avx2 = (lo & 6) == 6;
+    }
+}
+
+#endif /* SHA1_ACCEL_X86 */
+
+static int sha1_accel_set(int backend);
+
+static void
+sha1_accel_once(void)
+{
+#ifdef SHA1_ACCEL_X86
+    sha1_accel_cpuid();
+#endif
+    sha1_accel_set(SHA1_BACKEND_AUTO);
+}
+
+int
+sha1_accel_supported(int backend)
+{
+    switch(backend) {
+        case SHA1_BACKEND_AUTO:
+        case SHA1_BACKEND_REF:
+        case SHA1_BACKEND_SCALAR:
+            return 1;
+        case SHA1_BACKEND_SHANI:
+            return sha1_cpu_shani;
+        case SHA1_BACKEND_AVX2:
+            return sha1_cpu_avx2;
+        default:
+            break;
+    }
+
+    return 0;
+}
+
+/* auto takes the fastest single buffer path and the multi-buffer one */
+static int
+sha1_accel_set(int backend)
+{
+    if(!sha1_accel_supported(backend)) {
+        return -1;
+    }
+
+    sha1_sel.backend = backend;
+    sha1_sel.compress = sha1_scalar_compress;
+    sha1_sel.compress_mb = NULL;
+
+#ifdef SHA1_ACCEL_X86
+    if(backend == SHA1_BACKEND_SHANI || (backend == SHA1_BACKEND_AUTO && sha1_cpu_shani)) {
+        sha1_sel.compress = sha1_shani_compress;
+    }
+    if(backend == SHA1_BACKEND_AVX2 || (backend == SHA1_BACKEND_AUTO && sha1_cpu_avx2)) {
+        sha1_sel.compress_mb = sha1_avx2_compress_mb;
+    }
+#endif
+
+    return 0;
+}
+
+/* not thread safe, pick the backend before the disk threads run */
+int
+sha1_accel_select(int backend)
+{
+    pthread_once(&sha1_once, sha1_accel_once);
+    return sha1_accel_set(backend);
+}
+
+int
+sha1_accel_init(void)
+{
+    pthread_once(&sha1_once, sha1_accel_once);
+
+    LOG_INFO("sha1 backend: %s, single buffer %s, multi-buffer %s\n",
+                sha1_backend_names[sha1_sel.backend],
+                sha1_sel.compress == sha1_scalar_compress ? "scalar" : "sha-ni",
+                sha1_sel.compress_mb ? "avx2" : "none");
+
+    return sha1_sel.backend;
+}
+
+int
+sha1_accel_backend(void)
+{
+    pthread_once(&sha1_once, sha1_accel_once);
+    return sha1_sel.backend;
+}
+
+const char*
+sha1_accel_name(int backend)
+{
+    if(backend < 0 || backend >= SHA1_BACKEND_NUM) {
+        return "unknown";
+    }
+    return sha1_backend_names[backend];
+}
+
+int
+sha1_accel_lanes(void)
+{
+    pthread_once(&sha1_once, sha1_accel_once);
+    return sha1_sel.compress_mb ? SHA1_MB_LANES : 1;
+}
+
+static void
+sha1_ref_digest(const unsigned char *data, size_t len, unsigned char *digest)
+{
+    SHA1Context ctx;
+
+    SHA1Reset(&ctx);
+    while(len) {
+        unsigned n = len > (1U << 30) ? (1U << 30) : len;
+        SHA1Input(&ctx, data, n);
+        data += n;
+        len -= n;
+    }
+    SHA1Result(&ctx);
+
+    int i;
+    for(i = 0; i < 5; i++) {
+        sha1_store_be32(digest + i * 4, ctx.Message_Digest[i]);
+    }
+}
+
+/* hash the rest of a message whose first 'total - len' bytes are in 'state' */
+static void
+sha1_accel_final(uint32 state[5], const unsigned char *data, size_t len,
+                                    uint64 total, unsigned char *digest)
+{
+    size_t nblocks = len / 64;
+    if(nblocks) {
+        sha1_sel.compress(state, data, nblocks);
+        data += nblocks * 64;
+        len -= nblocks * 64;
+    }
+
+    unsigned char tail[128];
+    memcpy(tail, data, len);
+    tail[len++] = 0x80;
+
+    size_t padlen = len <= 56 ? 64 : 128;
+    memset(tail + len, 0, padlen - len);
+    sha1_store_be32(tail + padlen - 8, (uint32)(total >> 29));
+    sha1_store_be32(tail + padlen - 4, (uint32)(total << 3));
+    sha1_sel.compress(state, tail, padlen / 64);
+
+    int i;
+    for(i = 0; i < 5; i++) {
+        sha1_store_be32(digest + i * 4, state[i]);
+    }
+}
+
+void
+sha1_accel_digest(const unsigned char *data, size_t len, unsigned char *digest)
+{
+    pthread_once(&sha1_once, sha1_accel_once);
+
+    if(sha1_sel.backend == SHA1_BACKEND_REF) {
+        sha1_ref_digest(data, len, digest);
+        return;
+    }
+
+    uint32 state[5];
+    memcpy(state, sha1_iv, sizeof(state));
+    sha1_accel_final(state, data, len, len, digest);
+}
+
+/* 'digest' holds n digests of 20 bytes */
+void
+sha1_accel_digest_multi(const unsigned char **data, const size_t *len,
+                                        int n, unsigned char *digest)
+{
+    pthread_once(&sha1_once, sha1_accel_once);
+
+    int i, j;
+    if(!sha1_sel.compress_mb || n < 2) {
+        for(i = 0; i < n; i++) {
+            sha1_accel_digest(data[i], len[i], digest + i * 20);
+        }
+        return;
+    }
+
+    for(i = 0; i < n; i += SHA1_MB_LANES) {
+        int lanes = n - i < SHA1_MB_LANES ? n - i : SHA1_MB_LANES;
+
+        /* the full blocks all the lanes have, idle lanes redo lane 0 */
+        size_t nblocks = len[i] / 64;
+        const unsigned char *ptr[SHA1_MB_LANES];
+        for(j = 0; j < SHA1_MB_LANES; j++) {
+            ptr[j] = data[i + (j < lanes ? j : 0)];
+            if(j < lanes && len[i + j] / 64 < nblocks) {
+                nblocks = len[i + j] / 64;
+            }
+        }
+
+        uint32 mbstate[5][SHA1_MB_LANES];
+        int k;
+        for(k = 0; k < 5; k++) {
+            for(j = 0; j < SHA1_MB_LANES; j++) {
+                mbstate[k][j] = sha1_iv[k];
+            }
+        }
+
+        if(nblocks) {
+            sha1_sel.compress_mb(mbstate, ptr, nblocks);
+        }
+
+        for(j = 0; j < lanes; j++) {
+            uint32 state[5];
+            for(k = 0; k < 5; k++) {
+                state[k] = mbstate[k][j];
+            }
+            sha1_accel_final(state, data[i + j] + nblocks * 64, len[i + j] - nblocks * 64,
+                                        len[i + j], digest + (i + j) * 20);
+        }
+    }
+}
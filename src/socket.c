@@ -1,5 +1,7 @@
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
 #include <arpa/inet.h> // inet_pton, inet_ntop
 #include <netdb.h>
 #include <fcntl.h>
@@ -344,35 +346,42 @@ socket_tcp_send_until_block(int fd, char *sndbuf, int buflen)
 }
 
 int
-socket_tcp_send_all(int fd, char *sndbuf, int buflen)
+socket_tcp_recv_iovs(int fd, const struct iovec *iov, int iovcnt)
 {
-    if(fd < 0 || !sndbuf || buflen <= 0) {
+    if(fd < 0 || !iov || iovcnt <= 0) {
         return -1;
     }
+    return readv(fd, iov, iovcnt);
+}
 
-    char *s = sndbuf;
-    while(buflen > 0) {
-        int wlen = socket_tcp_send(fd, s, buflen, 0);
-        if(wlen > 0) {
-            buflen -= wlen;
-            s += wlen;
-        } else if(wlen < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
-            continue;
-        } else {
-            LOG_ERROR("socket send:%s\n", strerror(errno));
-            return -1;
-        }
+int
+socket_tcp_sendfile(int sfd, int fd, int64 *offset, int len)
+{
+    if(sfd < 0 || fd < 0 || !offset || len <= 0) {
+        return -1;
     }
 
-    return 0;
+    off_t off = *offset;
+    ssize_t n = sendfile(sfd, fd, &off, len);
+    if(n > 0) {
+        *offset = off;
+    }
+
+    return n;
 }
 
 int
-socket_tcp_send_iovs(int fd, const struct iovec *iov, int iovcnt)
+socket_tcp_send_iovs(int fd, const struct iovec *iov, int iovcnt, int flags)
 {
     if(fd < 0 || !iov || iovcnt <= 0) {
         return -1;
     }
-    return writev(fd, iov, iovcnt);
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = (struct iovec *)iov;
+    msg.msg_iovlen = iovcnt;
+
+    return sendmsg(fd, &msg, flags);
 }
 
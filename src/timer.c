@@ -1,4 +1,3 @@
-#include <sys/timerfd.h>
 #include <sys/epoll.h> /* EPOLLIN */
 #include <unistd.h>
 #include <errno.h>
@@ -7,12 +6,15 @@
 #include <stdio.h>
 #include "timer.h"
 #include "event.h"
+#include "utils.h"
+#include "mempool.h"
 #include "log.h"
 
-#define SECOND(time) (M_SECOND(time) / 1000)
-#define M_SECOND(time) ((time)*TIME_UNIT)
-#define MICRO_SECOND(time) (M_SECOND(time)*1000)
-#define N_SECOND(time) (M_SECOND(time) % 1000) * 1000000
+#define TIMER_ID_MASK ((1 << TIMER_ID_BITS) - 1)
+#define TIMER_NODES_MIN 64
+
+/* ticks the last level reaches, a later timer is put at its end */
+#define TIMER_MAX_TICKS ((int64)1 << (TVR_BITS + TVN_LEVELS * TVN_BITS))
 
 enum {
     TIMER_OP_CREATE = 0,
@@ -21,22 +23,348 @@ enum {
     TIMER_OP_DESTROY,
 };
 
+static struct timer_wheel *timer_wheels[TIMER_MAX_WHEELS];
+static pthread_mutex_t timer_wheels_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int64
+timer_now_tick(void)
+{
+    return utils_mtime() / TIME_UNIT;
+}
+
+static void
+timer_list_init(struct timer_list *head)
+{
+    head->prev = head->next = head;
+}
+
+static int
+timer_list_empty(struct timer_list *head)
+{
+    return head->next == head;
+}
+
+static void
+timer_list_add_tail(struct timer_list *head, struct timer_list *node)
+{
+    node->prev = head->prev;
+    node->next = head;
+    head->prev->next = node;
+    head->prev = node;
+}
+
+static void
+timer_list_del(struct timer_list *node)
+{
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    node->prev = node->next = node;
+}
+
+/* moves all of 'from' to the empty 'to' */
+static void
+timer_list_splice(struct timer_list *from, struct timer_list *to)
+{
+    timer_list_init(to);
+    if(timer_list_empty(from)) {
+        return;
+    }
+
+    to->next = from->next;
+    to->prev = from->prev;
+    to->next->prev = to;
+    to->prev->next = to;
+    timer_list_init(from);
+}
+
+static struct timer_wheel *
+timer_wheel_find(int epfd)
+{
+    int i;
+    for(i = 0; i < TIMER_MAX_WHEELS; i++) {
+        if(timer_wheels[i] && timer_wheels[i]->epfd == epfd) {
+            return timer_wheels[i];
+        }
+    }
+    return NULL;
+}
+
+static struct timer_wheel *
+timer_wheel_new(int epfd)
+{
+    struct timer_wheel *tw;
+
+    int i;
+    for(i = 0; i < TIMER_MAX_WHEELS && timer_wheels[i]; i++) {
+        ;
+    }
+
+    if(i == TIMER_MAX_WHEELS) {
+        LOG_ERROR("too many timer wheels!\n");
+        return NULL;
+    }
+
+    if(!(tw = GCALLOC(1, sizeof(*tw)))) {
+        LOG_ERROR("out of memory!\n");
+        return NULL;
+    }
+
+    tw->nodes = GCALLOC(TIMER_NODES_MIN, sizeof(*tw->nodes));
+    tw->freeid = GCALLOC(TIMER_NODES_MIN, sizeof(*tw->freeid));
+    if(!tw->nodes || !tw->freeid) {
+        LOG_ERROR("out of memory!\n");
+        GFREE(tw->nodes);
+        GFREE(tw->freeid);
+        GFREE(tw);
+        return NULL;
+    }
+
+    int level, j;
+    for(j = 0; j < TVR_SIZE; j++) {
+        timer_list_init(&tw->tv1[j]);
+    }
+    for(level = 0; level < TVN_LEVELS; level++) {
+        for(j = 0; j < TVN_SIZE; j++) {
+            timer_list_init(&tw->tvn[level][j]);
+        }
+    }
+
+    pthread_mutex_init(&tw->lock, NULL);
+    tw->epfd = epfd;
+    tw->widx = i;
+    tw->tick = tw->next = timer_now_tick();
+    tw->maxnode = TIMER_NODES_MIN;
+    tw->nnode = 1; /* id 0 is not a timer */
+
+    timer_wheels[i] = tw;
+
+    return tw;
+}
+
+static struct timer_wheel *
+timer_wheel_get(int epfd)
+{
+    pthread_mutex_lock(&timer_wheels_lock);
+    struct timer_wheel *tw = timer_wheel_find(epfd);
+    if(!tw) {
+        tw = timer_wheel_new(epfd);
+    }
+    pthread_mutex_unlock(&timer_wheels_lock);
+
+    return tw;
+}
+
+/* the timer with its wheel locked, a wheel is never freed */
+static struct timer_node *
+timer_node_find(int id, struct timer_wheel **ptw)
+{
+    int widx = id >> TIMER_ID_BITS, nid = id & TIMER_ID_MASK;
+    if(id <= 0 || widx >= TIMER_MAX_WHEELS || !timer_wheels[widx]) {
+        return NULL;
+    }
+
+    struct timer_wheel *tw = timer_wheels[widx];
+    pthread_mutex_lock(&tw->lock);
+    if(nid >= tw->nnode || !tw->nodes[nid]) {
+        pthread_mutex_unlock(&tw->lock);
+        return NULL;
+    }
+
+    *ptw = tw;
+    return tw->nodes[nid];
+}
+
+static int
+timer_node_id(struct timer_wheel *tw)
+{
+    if(tw->nfree) {
+        return tw->freeid[--tw->nfree];
+    }
+
+    if(tw->nnode == tw->maxnode) {
+        int maxnode = tw->maxnode * 2;
+        if(maxnode > TIMER_ID_MASK + 1) {
+            LOG_ERROR("too many timers!\n");
+            return -1;
+        }
+
+        struct timer_node **nodes = GREALLOC(tw->nodes, maxnode * sizeof(*nodes));
+        if(!nodes) {
+            LOG_ERROR("out of memory!\n");
+            return -1;
+        }
+        tw->nodes = nodes;
+
+        int *freeid = GREALLOC(tw->freeid, maxnode * sizeof(*freeid));
+        if(!freeid) {
+            LOG_ERROR("out of memory!\n");
+            return -1;
+        }
+        tw->freeid = freeid;
+        tw->maxnode = maxnode;
+    }
+
+    return tw->nnode++;
+}
+
+/* the slot of a timer from how many ticks away it expires */
+static void
+timer_node_link(struct timer_wheel *tw, struct timer_node *tn)
+{
+    int64 expires = tn->expires;
+    int64 idx = expires - tw->tick;
+    struct timer_list *vec;
+
+    if(idx < 0) {
+        vec = &tw->tv1[tw->tick & TVR_MASK];
+    } else if(idx < TVR_SIZE) {
+        vec = &tw->tv1[expires & TVR_MASK];
+    } else {
+        if(idx >= TIMER_MAX_TICKS) {
+            expires = tn->expires = tw->tick + TIMER_MAX_TICKS - 1;
+        }
+
+        int level = 0;
+        while(idx >= (int64)1 << (TVR_BITS + (level + 1) * TVN_BITS) && level < TVN_LEVELS - 1) {
+            level++;
+        }
+        vec = &tw->tvn[level][(expires >> (TVR_BITS + level * TVN_BITS)) & TVN_MASK];
+    }
+
+    timer_list_add_tail(vec, &tn->link);
+}
+
+static void
+timer_node_add(struct timer_wheel *tw, struct timer_node *tn, int64 expires)
+{
+    tn->expires = expires;
+    tn->active = 1;
+    tw->nactive++;
+
+    timer_node_link(tw, tn);
+
+    if(tn->expires < tw->next) {
+        tw->next = tn->expires;
+
+        /* the loop sleeps with a later timeout, or none before its wheel was made */
+        if(!tw->owned || !pthread_equal(tw->owner, pthread_self())) {
+            event_wakeup(tw->epfd);
+        }
+    }
+}
+
+static void
+timer_node_del(struct timer_wheel *tw, struct timer_node *tn)
+{
+    if(!tn->active) {
+        return;
+    }
+
+    timer_list_del(&tn->link);
+    tn->active = 0;
+    tw->nactive--;
+}
+
+/* moves the timers of a slot one level down, returns the slot index */
 static int
-time_setting(int tmrfd, int time, int interval)
+timer_cascade(struct timer_wheel *tw, int level)
+{
+    int index = (tw->tick >> (TVR_BITS + level * TVN_BITS)) & TVN_MASK;
+
+    struct timer_list list;
+    timer_list_splice(&tw->tvn[level][index], &list);
+
+    while(!timer_list_empty(&list)) {
+        struct timer_node *tn = (struct timer_node *)list.next;
+        timer_list_del(&tn->link);
+        timer_node_link(tw, tn);
+    }
+
+    return index;
+}
+
+/*
+ * a handler may start, stop or destroy any timer, its own too. the expired
+ * ones are moved to a list of their own and taken off one at a time, the
+ * lock is dropped while a handler runs.
+ */
+static void
+timer_run(struct timer_wheel *tw, int64 now)
 {
-    struct itimerspec itmr;
-    itmr.it_value.tv_sec = SECOND(time);
-    itmr.it_value.tv_nsec = N_SECOND(time);
+    while(tw->tick <= now) {
+        if(!tw->nactive) {
+            tw->tick = now + 1;
+            break;
+        }
+
+        int index = tw->tick & TVR_MASK;
+        if(!index) {
+            int level = 0;
+            while(level < TVN_LEVELS && !timer_cascade(tw, level)) {
+                level++;
+            }
+        }
+
+        struct timer_list work;
+        timer_list_splice(&tw->tv1[index], &work);
+        tw->tick++;
 
-    itmr.it_interval.tv_sec = SECOND(interval);
-    itmr.it_interval.tv_nsec = N_SECOND(interval);
+        while(!timer_list_empty(&work)) {
+            struct timer_node *tn = (struct timer_node *)work.next;
+            timer_node_del(tw, tn);
+
+            if(tn->interval > 0) {
+                timer_node_add(tw, tn, now + tn->interval);
+            }
 
-    if(timerfd_settime(tmrfd, 0, &itmr, NULL)) {
-        LOG_ERROR("timerfd_settime failed:%s\n", strerror(errno));
+            event_handle_t hdl = tn->tmr_hdl;
+            void *ctx = tn->tmr_ctx;
+
+            pthread_mutex_unlock(&tw->lock);
+            (*hdl)(EPOLLIN, ctx);
+            pthread_mutex_lock(&tw->lock);
+        }
+    }
+}
+
+int
+timer_expire(int epfd)
+{
+    struct timer_wheel *tw = timer_wheel_find(epfd);
+    if(!tw) {
         return -1;
     }
 
-    return 0;
+    pthread_mutex_lock(&tw->lock);
+
+    if(!tw->owned) {
+        tw->owner = pthread_self();
+        tw->owned = 1;
+    }
+
+    int64 now = utils_mtime();
+    timer_run(tw, now / TIME_UNIT);
+
+    if(!tw->nactive) {
+        pthread_mutex_unlock(&tw->lock);
+        return -1;
+    }
+
+    /* the first busy slot up to the next cascade, which may bring more */
+    if(tw->next < tw->tick) {
+        int64 tick, end = (tw->tick | TVR_MASK) + 1;
+        for(tick = tw->tick; tick < end; tick++) {
+            if(!timer_list_empty(&tw->tv1[tick & TVR_MASK])) {
+                break;
+            }
+        }
+        tw->next = tick;
+    }
+
+    int64 timeout = tw->next * TIME_UNIT - now;
+    pthread_mutex_unlock(&tw->lock);
+
+    return timeout > 0 ? (int)timeout : 0;
 }
 
 static int
@@ -50,20 +378,20 @@ check_timer_param(struct timer_param *tp, int op)
         case TIMER_OP_CREATE:
             if(tp->epfd < 0 || !tp->tmr_hdl) {
                 return -1;
-            } 
+            }
             return 0;
         case TIMER_OP_START:
-            if(tp->tmrfd < 0 || tp->time <= 0) {
+            if(tp->tmrfd <= 0 || tp->time <= 0) {
                 return -1;
             }
             return 0;
         case TIMER_OP_STOP:
-            if(tp->tmrfd < 0) {
+            if(tp->tmrfd <= 0) {
                 return -1;
             }
             return 0;
         case TIMER_OP_DESTROY:
-            if(tp->epfd < 0 || tp->tmrfd < 0) {
+            if(tp->epfd < 0 || tp->tmrfd <= 0) {
                 return -1;
             }
             return 0;
@@ -82,31 +410,36 @@ timer_creat(struct timer_param *tp)
         return -1;
     }
 
-    tp->tmrfd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK);
-    if(tp->tmrfd < 0) {
-        LOG_ERROR("timerfd_create failed:%s\n", strerror(errno));
+    struct timer_wheel *tw = timer_wheel_get(tp->epfd);
+    if(!tw) {
         return -1;
     }
 
-    if(time_setting(tp->tmrfd, 0, 0)) {
-        close(tp->tmrfd);
-        tp->tmrfd = -1;
+    struct timer_node *tn = GCALLOC(1, sizeof(*tn));
+    if(!tn) {
+        LOG_ERROR("out of memory!\n");
         return -1;
     }
 
-    struct event_param ep;
-    ep.fd = tp->tmrfd;
-    ep.event = EPOLLIN;
-    ep.evt_ctx = tp->tmr_ctx;
-    ep.evt_hdl = tp->tmr_hdl;
+    pthread_mutex_lock(&tw->lock);
 
-    if(event_add(tp->epfd, &ep)) {
-        LOG_ERROR("timer add failed!\n");
-        close(tp->tmrfd);
-        tp->tmrfd = -1;
+    int nid = timer_node_id(tw);
+    if(nid < 0) {
+        pthread_mutex_unlock(&tw->lock);
+        GFREE(tn);
         return -1;
     }
 
+    timer_list_init(&tn->link);
+    tn->id = (tw->widx << TIMER_ID_BITS) | nid;
+    tn->tmr_hdl = tp->tmr_hdl;
+    tn->tmr_ctx = tp->tmr_ctx;
+    tw->nodes[nid] = tn;
+
+    pthread_mutex_unlock(&tw->lock);
+
+    tp->tmrfd = tn->id;
+
     return 0;
 }
 
@@ -117,10 +450,20 @@ timer_start(struct timer_param *tp)
         return -1;
     }
 
-    if(time_setting(tp->tmrfd, tp->time, tp->interval)) {
+    struct timer_wheel *tw;
+    struct timer_node *tn = timer_node_find(tp->tmrfd, &tw);
+    if(!tn) {
+        LOG_ERROR("no found timer[%d]!\n", tp->tmrfd);
         return -1;
     }
 
+    timer_node_del(tw, tn);
+
+    tn->interval = tp->interval;
+    timer_node_add(tw, tn, timer_now_tick() + tp->time);
+
+    pthread_mutex_unlock(&tw->lock);
+
     return 0;
 }
 
@@ -131,29 +474,42 @@ timer_stop(struct timer_param *tp)
         return -1;
     }
 
-    if(time_setting(tp->tmrfd, 0, 0)) {
+    struct timer_wheel *tw;
+    struct timer_node *tn = timer_node_find(tp->tmrfd, &tw);
+    if(!tn) {
+        LOG_ERROR("no found timer[%d]!\n", tp->tmrfd);
         return -1;
     }
 
+    timer_node_del(tw, tn);
+    pthread_mutex_unlock(&tw->lock);
+
     return 0;
 }
 
 int
 timer_destroy(struct timer_param *tp)
 {
-    if(timer_stop(tp)) {
+    if(check_timer_param(tp, TIMER_OP_DESTROY)) {
         return -1;
     }
 
-    struct event_param ep;
-    memset(&ep, 0, sizeof(ep));
-    ep.fd = tp->tmrfd;
-
-    if(event_del(tp->epfd, &ep)) {
-        LOG_ERROR("timer del failed!\n");
+    struct timer_wheel *tw;
+    struct timer_node *tn = timer_node_find(tp->tmrfd, &tw);
+    if(!tn) {
+        LOG_ERROR("no found timer[%d]!\n", tp->tmrfd);
         return -1;
     }
 
+    timer_node_del(tw, tn);
+
+    int nid = tn->id & TIMER_ID_MASK;
+    tw->nodes[nid] = NULL;
+    tw->freeid[tw->nfree++] = nid;
+
+    pthread_mutex_unlock(&tw->lock);
+
+    GFREE(tn);
+
     return 0;
 }
-
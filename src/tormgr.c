@@ -0,0 +1,529 @@
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include "btype.h"
+#include "log.h"
+#include "torrent.h"
+#include "tortask.h"
+#include "tormgr.h"
+#include "timer.h"
+#include "peer.h"
+#include "mempool.h"
+#include "socket.h"
+#include "utils.h"
+
+static int torrent_mgr_listen(struct torrent_mgr *mgr);
+static int torrent_mgr_create_timer(struct torrent_mgr *mgr);
+static int torrent_mgr_create_loops(struct torrent_mgr *mgr, int nloop);
+static int torrent_mgr_conn_unlink(struct torrent_mgr *mgr, struct torrent_conn *conn);
+static int torrent_mgr_conn_close(struct torrent_mgr *mgr, struct torrent_conn *conn, int closefd);
+
+static int torrent_mgr_listen_handle(int event, void *evt_ctx);
+static int torrent_mgr_conn_handle(int event, void *evt_ctx);
+static int torrent_mgr_conn_park(struct torrent_mgr *mgr, struct torrent_conn *conn, int park);
+static int torrent_mgr_conn_accept(int event, void *evt_ctx);
+static int torrent_mgr_unthrottle_task(int event, void *evt_ctx);
+static int torrent_mgr_timeout_handle(int event, void *evt_ctx);
+
+int
+torrent_mgr_init(struct torrent_mgr *mgr, int epfd, int nloop)
+{
+    memset(mgr, 0, sizeof(*mgr));
+
+    mgr->epfd = epfd;
+    mgr->tmrfd = -1;
+    mgr->listenfd = -1;
+    mgr->nloop = 1;
+    mgr->loop_epfd[0] = epfd;
+    mgr->max_peer = MGR_MAX_PEERS;
+
+    if(!(mgr->dio = torrent_io_create(epfd, DISK_IO_THREADS))) {
+        LOG_ERROR("torrent create disk io failed!\n");
+        return -1;
+    }
+
+    if(torrent_mgr_create_loops(mgr, nloop)) {
+        LOG_ALARM("only %d event loops created!\n", mgr->nloop);
+    }
+
+    if(torrent_mgr_listen(mgr)) {
+        LOG_ERROR("torrent listen failed!\n");
+        return -1;
+    }
+
+    if(torrent_mgr_create_timer(mgr)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+int
+torrent_mgr_uninit(struct torrent_mgr *mgr)
+{
+    while(mgr->conn_list) {
+        torrent_mgr_conn_close(mgr, mgr->conn_list, 1);
+    }
+
+    struct torrent_task *tsk;
+    for(tsk = mgr->tsklist; tsk; tsk = tsk->next) {
+        torrent_task_stop(tsk);
+    }
+
+    if(mgr->dio) {
+        torrent_io_destroy(mgr->dio);
+        mgr->dio = NULL;
+    }
+
+    while(mgr->tsklist) {
+        tsk = mgr->tsklist;
+        mgr->tsklist = tsk->next;
+        torrent_task_uninit(tsk);
+        GFREE(tsk);
+    }
+    mgr->ntask = 0;
+
+    /* the first loop is the caller's */
+    for(; mgr->nloop > 1; mgr->nloop--) {
+        event_destroy(mgr->loop_epfd[mgr->nloop-1]);
+    }
+
+    return 0;
+}
+
+/* the loops are created with the manager, before the tasks spread their peers over them */
+static int
+torrent_mgr_create_loops(struct torrent_mgr *mgr, int nloop)
+{
+    if(nloop <= 0) {
+        nloop = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    nloop = nloop <= 0 ? 1 : (nloop > EVENT_MAX_LOOPS ? EVENT_MAX_LOOPS : nloop);
+
+    for(; mgr->nloop < nloop; mgr->nloop++) {
+        int epfd = event_create();
+        if(epfd < 0) {
+            return -1;
+        }
+
+        if(torrent_io_attach(mgr->dio, epfd)) {
+            event_destroy(epfd);
+            return -1;
+        }
+        mgr->loop_epfd[mgr->nloop] = epfd;
+    }
+
+    return 0;
+}
+
+int
+torrent_mgr_start_loops(struct torrent_mgr *mgr)
+{
+    int i;
+    for(i = 1; i < mgr->nloop; i++) {
+        if(event_loop_spawn(mgr->loop_epfd[i])) {
+            LOG_ERROR("start event loop[%d] failed!\n", i);
+            return -1;
+        }
+    }
+
+    LOG_DEBUG("tasks on %d event loops\n", mgr->nloop);
+
+    return 0;
+}
+
+static struct torrent_task *
+torrent_mgr_find_task(struct torrent_mgr *mgr, const char *info_hash)
+{
+    struct torrent_task *tsk;
+    for(tsk = mgr->tsklist; tsk; tsk = tsk->next) {
+        if(!memcmp(tsk->tor.info_hash, info_hash, SHA1_LEN)) {
+            return tsk;
+        }
+    }
+
+    return NULL;
+}
+
+int
+torrent_mgr_add_task(struct torrent_mgr *mgr, char *torfile)
+{
+    struct torrent_task *tsk = GCALLOC(1, sizeof(*tsk));
+    if(!tsk) {
+        LOG_ERROR("out of memory!\n");
+        return -1;
+    }
+
+    /* a failed init has released what it got, no disk job points at it */
+    if(torrent_task_init(tsk, mgr, torfile)) {
+        GFREE(tsk);
+        return -1;
+    }
+
+    tsk->next = mgr->tsklist;
+    mgr->tsklist = tsk;
+    mgr->ntask++;
+
+    LOG_INFO("task %s added, %d tasks\n", tsk->tor.pathname, mgr->ntask);
+
+    return 0;
+}
+
+int
+torrent_mgr_set_limit(struct torrent_mgr *mgr, int max_peer, int down_rate, int up_rate)
+{
+    if(max_peer < 0 || down_rate < 0 || up_rate < 0) {
+        LOG_ERROR("invalid limit[%d,%d,%d]!\n", max_peer, down_rate, up_rate);
+        return -1;
+    }
+
+    mgr->max_peer = max_peer;
+    mgr->limit[RATE_DOWN].rate = down_rate;
+    mgr->limit[RATE_UP].rate = up_rate;
+
+    LOG_INFO("limit %d peers, down %d B/s, up %d B/s\n", max_peer, down_rate, up_rate);
+
+    return 0;
+}
+
+int
+torrent_mgr_quota(struct torrent_task *tsk, int dir, int want)
+{
+    /* blocks read while the disk queue is full would only pile up in memory */
+    if(dir == RATE_DOWN && torrent_io_busy(tsk->dio)) {
+        __atomic_store_n(&tsk->throttled, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+
+    struct rate_limit *rl = &tsk->mgr->limit[dir];
+    if(!rl->rate) {
+        return want;
+    }
+
+    int64 tokens = __atomic_load_n(&rl->tokens, __ATOMIC_RELAXED);
+    if(tokens <= 0) {
+        __atomic_store_n(&tsk->throttled, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+
+    return tokens < want ? tokens : want;
+}
+
+void
+torrent_mgr_charge(struct torrent_task *tsk, int dir, int len)
+{
+    struct rate_limit *rl = &tsk->mgr->limit[dir];
+    if(rl->rate) {
+        __atomic_sub_fetch(&rl->tokens, len, __ATOMIC_RELAXED);
+    }
+}
+
+static int
+torrent_mgr_listen(struct torrent_mgr *mgr)
+{
+    int sock = socket_tcp_create();
+    if(sock < 0) {
+        return -1;
+    }
+
+    if(set_socket_unblock(sock)) {
+        close(sock);
+        return -1;
+    }
+
+    if(set_socket_opt(sock)) {
+        close(sock);
+        return -1;
+    }
+
+    int i, ip = 0;
+    for(i = 6881; i < 65535; i++) {
+        uint16 bport = socket_htons(i);
+        if(!socket_tcp_bind(sock, ip, bport)) {
+            break;
+        }
+    }
+
+    if(i >= 65535) {
+        close(sock);
+        return -1;
+    }
+
+    if(socket_tcp_listen(sock, 1024)) {
+        close(sock);
+        return -1;
+    }
+
+    struct event_param ep;
+    ep.event = EPOLLIN;
+    ep.fd = sock;
+    ep.evt_hdl = torrent_mgr_listen_handle;
+    ep.evt_ctx = mgr;
+
+    if(event_add(mgr->epfd, &ep)) {
+        LOG_ERROR("listen add event failed!\n");
+        close(sock);
+        return -1;
+    }
+
+    mgr->listenfd = sock;
+    mgr->listen_port = i;
+
+    LOG_DEBUG("listen port : %hu\n", mgr->listen_port);
+
+    return 0;
+}
+
+static int
+torrent_mgr_create_timer(struct torrent_mgr *mgr)
+{
+    struct timer_param tp;
+    memset(&tp, 0, sizeof(tp));
+    tp.epfd = mgr->epfd;
+    tp.tmr_hdl = torrent_mgr_timeout_handle;
+    tp.tmr_ctx = mgr;
+
+    if(timer_creat(&tp)) {
+        LOG_ERROR("manager create timer failed!\n");
+        return -1;
+    }
+    mgr->tmrfd = tp.tmrfd;
+
+    tp.time = tp.interval = MGR_TICK;
+    if(timer_start(&tp)) {
+        LOG_ERROR("manager start timer failed!\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int
+torrent_mgr_conn_unlink(struct torrent_mgr *mgr, struct torrent_conn *conn)
+{
+    struct torrent_conn **iter;
+    for(iter = &mgr->conn_list; *iter; iter = &(*iter)->next) {
+        if(*iter == conn) {
+            *iter = conn->next;
+            break;
+        }
+    }
+
+    struct event_param ep;
+    memset(&ep, 0, sizeof(ep));
+    ep.fd = conn->fd;
+
+    return event_del(mgr->epfd, &ep);
+}
+
+static int
+torrent_mgr_conn_close(struct torrent_mgr *mgr, struct torrent_conn *conn, int closefd)
+{
+    torrent_mgr_conn_unlink(mgr, conn);
+
+    if(closefd) {
+        close(conn->fd);
+    }
+    GFREE(conn);
+
+    return 0;
+}
+
+static int
+torrent_mgr_listen_handle(int event, void *evt_ctx)
+{
+    struct torrent_mgr *mgr = (struct torrent_mgr *)evt_ctx;
+
+    uint16 port;
+    int ip, clisock;
+
+    clisock = socket_tcp_accept(mgr->listenfd, &ip, &port);
+    if(clisock < 0) {
+        LOG_ERROR("accept %hu failed:%s\n", mgr->listen_port, strerror(errno));
+        return -1;
+    }
+
+    /* the peer code expects what peer_socket_init sets up */
+    if(set_socket_unblock(clisock)) {
+        close(clisock);
+        return -1;
+    }
+
+    int npeer = __atomic_load_n(&mgr->npeer, __ATOMIC_RELAXED);
+    if(mgr->max_peer > 0 && npeer >= mgr->max_peer) {
+        LOG_DEBUG("%d peers already, incoming client dropped!\n", npeer);
+        close(clisock);
+        return -1;
+    }
+
+    struct torrent_conn *conn = GCALLOC(1, sizeof(*conn));
+    if(!conn) {
+        LOG_ERROR("out of memory!\n");
+        close(clisock);
+        return -1;
+    }
+
+    conn->fd = clisock;
+    conn->ip = ip;
+    conn->port = port;
+    conn->expire = time(NULL) + MGR_HANDSHAKE_TIMEOUT;
+    conn->mgr = mgr;
+
+    struct event_param ep;
+    ep.event = EPOLLIN;
+    ep.fd = clisock;
+    ep.evt_hdl = torrent_mgr_conn_handle;
+    ep.evt_ctx = conn;
+
+    if(event_add(mgr->epfd, &ep)) {
+        LOG_ERROR("incoming client add event failed!\n");
+        close(clisock);
+        GFREE(conn);
+        return -1;
+    }
+
+    conn->next = mgr->conn_list;
+    mgr->conn_list = conn;
+
+    return 0;
+}
+
+/*
+ * a short peek stays readable, level triggered it would spin the loop
+ * until the rest comes. it sits out the tick with no events instead.
+ */
+static int
+torrent_mgr_conn_park(struct torrent_mgr *mgr, struct torrent_conn *conn, int park)
+{
+    struct event_param ep;
+    ep.event = park ? 0 : EPOLLIN;
+    ep.fd = conn->fd;
+    ep.evt_hdl = torrent_mgr_conn_handle;
+    ep.evt_ctx = conn;
+
+    if(event_mod(mgr->epfd, &ep)) {
+        LOG_ERROR("incoming client mod event failed!\n");
+        return -1;
+    }
+    conn->parked = park;
+
+    return 0;
+}
+
+/* the handshake is only peeked at, the peer of the task reads all of it */
+static int
+torrent_mgr_conn_handle(int event, void *evt_ctx)
+{
+    struct torrent_conn *conn = (struct torrent_conn *)evt_ctx;
+    struct torrent_mgr *mgr = conn->mgr;
+
+    /* 19+bt_proto_str+reserved+info_hash */
+    char handshake[48];
+    int rcvlen = socket_tcp_recv(conn->fd, handshake, sizeof(handshake), MSG_PEEK);
+    if(rcvlen < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return 0;
+    }
+
+    /* the rest may be on its way, the timeout sweep drops a silent one */
+    if(rcvlen > 0 && rcvlen < (int)sizeof(handshake)) {
+        return torrent_mgr_conn_park(mgr, conn, 1);
+    }
+
+    struct torrent_task *tsk = NULL;
+    if(rcvlen == sizeof(handshake)) {
+        tsk = torrent_mgr_find_task(mgr, handshake+28);
+    }
+
+    if(!tsk) {
+        char peeraddr[32];
+        utils_strf_addrinfo(conn->ip, conn->port, peeraddr, 32);
+        LOG_DEBUG("peer[%s] handshake[%d] for no task!\n", peeraddr, rcvlen);
+        torrent_mgr_conn_close(mgr, conn, 1);
+        return -1;
+    }
+
+    /* the peer is set up by the task's own loop */
+    torrent_mgr_conn_unlink(mgr, conn);
+    conn->tsk = tsk;
+    if(event_call(tsk->epfd, torrent_mgr_conn_accept, conn)) {
+        close(conn->fd);
+        GFREE(conn);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int
+torrent_mgr_conn_accept(int event, void *evt_ctx)
+{
+    struct torrent_conn *conn = (struct torrent_conn *)evt_ctx;
+
+    int ret = torrent_task_accept(conn->tsk, conn->fd, conn->ip, conn->port);
+    GFREE(conn);
+
+    return ret;
+}
+
+static int
+torrent_mgr_unthrottle_task(int event, void *evt_ctx)
+{
+    struct torrent_task *tsk = (struct torrent_task *)evt_ctx;
+
+    /* the peers on the other loops too, their events are set from here */
+    pthread_mutex_lock(&tsk->lock);
+    int i;
+    for(i = 0; i < MAX_PEER_NUM; i++) {
+        if(tsk->pr[i].isused && tsk->pr[i].throttled) {
+            peer_unthrottle(&tsk->pr[i]);
+        }
+    }
+    pthread_mutex_unlock(&tsk->lock);
+
+    return 0;
+}
+
+static int
+torrent_mgr_timeout_handle(int event, void *evt_ctx)
+{
+    struct torrent_mgr *mgr = (struct torrent_mgr *)evt_ctx;
+
+    /* at most a tick of tokens is saved up, the task loops charge them meanwhile */
+    int dir;
+    for(dir = 0; dir < RATE_DIR_NUM; dir++) {
+        struct rate_limit *rl = &mgr->limit[dir];
+        int64 fill = (int64)rl->rate * MGR_TICK * TIME_UNIT / 1000;
+        int64 old = __atomic_load_n(&rl->tokens, __ATOMIC_RELAXED), tokens;
+        do {
+            tokens = old + fill < fill ? old + fill : fill;
+        } while(!__atomic_compare_exchange_n(&rl->tokens, &old, tokens, 0,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    }
+
+    /* the throttled peers are woken by the loop of their task */
+    struct torrent_task *tsk;
+    for(tsk = mgr->tsklist; tsk; tsk = tsk->next) {
+        if(__atomic_exchange_n(&tsk->throttled, 0, __ATOMIC_RELAXED)) {
+            event_call(tsk->epfd, torrent_mgr_unthrottle_task, tsk);
+        }
+    }
+
+    int now = time(NULL);
+    struct torrent_conn *conn, *next;
+    for(conn = mgr->conn_list; conn; conn = next) {
+        next = conn->next;
+        if(now >= conn->expire) {
+            torrent_mgr_conn_close(mgr, conn, 1);
+        } else if(conn->parked && torrent_mgr_conn_park(mgr, conn, 0)) {
+            torrent_mgr_conn_close(mgr, conn, 1);
+        }
+    }
+
+    return 0;
+}
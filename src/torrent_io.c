@@ -1,132 +1,400 @@
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <signal.h>
 #include "btype.h"
 #include "utils.h"
 #include "log.h"
 #include "mempool.h"
-
-#define DOWNLOAD_DIR "./download/"
+#include "event.h"
+#include "torrent.h"
+#include "bitfield.h"
+#include "sha1_accel.h"
+#include "tortask.h"
+
+enum {
+    TORRENT_IO_READ = 0,
+    TORRENT_IO_WRITE,
+    TORRENT_IO_READAHEAD,
+};
 
 static int
 torrent_create_dir(const char *dirname)
 {
-    char command[1024];
-    /* 'dirname' in case space etc character when create dir */
-    snprintf(command, sizeof(command), "%s %s%s%s", "mkdir -p", "\'", dirname, "\'"); 
-    int ret = system(command);
-    if(ret == -1) {
+    char dir[1024];
+    snprintf(dir, sizeof(dir), "%s", dirname);
+
+    /* mkdir -p without forking a shell */
+    char *s;
+    for(s = dir+1; *s; s++) {
+        if(*s != '/') {
+            continue;
+        }
+        *s = '\0';
+        if(mkdir(dir, 0755) && errno != EEXIST) {
+            LOG_ERROR("mkdir %s:%s\n", dir, strerror(errno));
+            return -1;
+        }
+        *s = '/';
+    }
+
+    if(mkdir(dir, 0755) && errno != EEXIST) {
+        LOG_ERROR("mkdir %s:%s\n", dir, strerror(errno));
         return -1;
     }
+
     return 0;
 }
 
 static int
-torrent_create_file(const char *subdir1, const char *subdir2, const char *filename, FILE **setme_fp)
+torrent_file_fullname(struct torrent_task *tsk, int fidx, char *dir, int dirlen,
+                                                        char *fullname, int namelen)
 {
-    char dir[1024] = {'\0', };
+    if(tsk->tor.isSingleDown) {
+        snprintf(dir, dirlen, "%s", DOWNLOAD_DIR);
+        snprintf(fullname, namelen, "%s%s", DOWNLOAD_DIR, tsk->tor.pathname);
+        return 0;
+    }
 
-    int offs = snprintf(dir, sizeof(dir), "%s", DOWNLOAD_DIR);
+    struct single_file *sfile = &tsk->tor.mfile.files[fidx];
 
-    if(subdir1) {
-        offs += snprintf(dir+offs, sizeof(dir)-offs, "%s/", subdir1);
+    int offs = snprintf(dir, dirlen, "%s%s", DOWNLOAD_DIR, tsk->tor.pathname);
+    if(sfile->subdir) {
+        snprintf(dir+offs, dirlen-offs, "/%s", sfile->subdir);
     }
 
-    if(subdir2) {
-        offs += snprintf(dir+offs, sizeof(dir)-offs, "%s", subdir2);
+    snprintf(fullname, namelen, "%s/%s", dir, sfile->pathname);
+
+    return 0;
+}
+
+static int
+torrent_file_cache_init(struct torrent_task *tsk)
+{
+    struct file_cache *fc = &tsk->fc;
+
+    fc->nfiles = tsk->tor.isSingleDown ? 1 : tsk->tor.mfile.files_num;
+    fc->nopen = 0;
+    fc->lru_head = fc->lru_tail = NULL;
+    pthread_mutex_init(&fc->lock, NULL);
+
+    fc->files = GCALLOC(fc->nfiles, sizeof(struct open_file));
+    if(!fc->files) {
+        LOG_ERROR("out of memory!\n");
+        return -1;
     }
 
-    char fullname[2048];
-    snprintf(fullname, sizeof(fullname), "%s/%s", dir, filename);
+    int i;
+    int64 offset = 0;
+    for(i = 0; i < fc->nfiles; i++) {
+        fc->files[i].fd = -1;
+        fc->files[i].offset = offset;
+        fc->files[i].size = tsk->tor.isSingleDown ?
+                    tsk->tor.totalsz : tsk->tor.mfile.files[i].file_size;
+        offset += fc->files[i].size;
+    }
+
+    return 0;
+}
+
+static void
+torrent_file_lru_unlink(struct file_cache *fc, struct open_file *of)
+{
+    if(of->prev) {
+        of->prev->next = of->next;
+    } else {
+        fc->lru_head = of->next;
+    }
+
+    if(of->next) {
+        of->next->prev = of->prev;
+    } else {
+        fc->lru_tail = of->prev;
+    }
+
+    of->prev = of->next = NULL;
+}
+
+static void
+torrent_file_lru_push(struct file_cache *fc, struct open_file *of)
+{
+    of->prev = NULL;
+    of->next = fc->lru_head;
+    if(fc->lru_head) {
+        fc->lru_head->prev = of;
+    } else {
+        fc->lru_tail = of;
+    }
+    fc->lru_head = of;
+}
+
+/* open fds are shared by disk threads, a referenced fd is never evicted */
+static int
+torrent_file_cache_get(struct torrent_task *tsk, int fidx)
+{
+    struct file_cache *fc = &tsk->fc;
+    struct open_file *of = &fc->files[fidx];
+
+    pthread_mutex_lock(&fc->lock);
 
-    struct stat st;
-    if(stat(fullname, &st) || !S_ISREG(st.st_mode)) {
+    if(of->fd >= 0) {
+        if(of != fc->lru_head) {
+            torrent_file_lru_unlink(fc, of);
+            torrent_file_lru_push(fc, of);
+        }
+        of->ref++;
+        pthread_mutex_unlock(&fc->lock);
+        return of->fd;
+    }
+
+    /* over fd budget, close the least recently used one */
+    struct open_file *victim = fc->lru_tail;
+    for(; fc->nopen >= MAX_OPEN_FILES && victim; victim = victim->prev) {
+        if(!victim->ref) {
+            torrent_file_lru_unlink(fc, victim);
+            close(victim->fd);
+            victim->fd = -1;
+            fc->nopen--;
+            break;
+        }
+    }
+
+    char dir[1024], fullname[2048];
+    torrent_file_fullname(tsk, fidx, dir, sizeof(dir), fullname, sizeof(fullname));
+
+    int fd = open(fullname, O_RDWR|O_CREAT, 0644);
+    if(fd < 0 && errno == ENOENT) {
         if(torrent_create_dir(dir)) {
             LOG_ERROR("torrent create dir failed!\n");
+            pthread_mutex_unlock(&fc->lock);
             return -1;
         }
+        fd = open(fullname, O_RDWR|O_CREAT, 0644);
     }
 
-    FILE *fp = fopen(fullname, "r+");
-    if(!fp && !(fp = fopen(fullname, "w+")) ) {
-        LOG_ERROR("fopen %s : %s\n", fullname, strerror(errno));
+    if(fd < 0) {
+        LOG_ERROR("open %s : %s\n", fullname, strerror(errno));
+        pthread_mutex_unlock(&fc->lock);
         return -1;
     }
 
-    if(setme_fp) {
-        *setme_fp = fp;
-    } else {
-        fclose(fp);
-    } 
+    of->fd = fd;
+    of->ref = 1;
+    fc->nopen++;
+    torrent_file_lru_push(fc, of);
+
+    pthread_mutex_unlock(&fc->lock);
+
+    return fd;
+}
+
+static void
+torrent_file_cache_put(struct torrent_task *tsk, int fidx)
+{
+    pthread_mutex_lock(&tsk->fc.lock);
+    tsk->fc.files[fidx].ref--;
+    pthread_mutex_unlock(&tsk->fc.lock);
+}
+
+/* find the file which the torrent byte 'offset' lies in */
+static int
+torrent_file_find(struct file_cache *fc, int64 offset)
+{
+    int low = 0, high = fc->nfiles - 1;
+    while(low < high) {
+        int mid = (low + high + 1) >> 1;
+        if(fc->files[mid].offset <= offset) {
+            low = mid;
+        } else {
+            high = mid - 1;
+        }
+    }
+
+    /* skip zero length files */
+    while(low < fc->nfiles - 1 && fc->files[low].offset + fc->files[low].size <= offset) {
+        low++;
+    }
+
+    return low;
+}
+
+static int
+torrent_file_io(int fd, int op, int64 offset, char *buffer, int64 buflen)
+{
+    if(op == TORRENT_IO_READAHEAD) {
+        posix_fadvise(fd, offset, buflen, POSIX_FADV_WILLNEED);
+        return 0;
+    }
+
+    while(buflen > 0) {
+        ssize_t n = op == TORRENT_IO_WRITE ? pwrite(fd, buffer, buflen, offset)
+                                           : pread(fd, buffer, buflen, offset);
+        if(n < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if(n <= 0) { /* read: not enough data in file */
+            return -1;
+        }
+
+        buffer += n;
+        offset += n;
+        buflen -= n;
+    }
 
     return 0;
 }
 
-int
-torrent_create_downfiles(struct torrent_task *tsk)
+static int
+torrent_piece_io(struct torrent_task *tsk, int op, int64 offset, char *buffer, int64 buflen)
 {
-    if(tsk->tor.isSingleDown) {
-        if(torrent_create_file(NULL, NULL, tsk->tor.pathname, NULL)) {
-            LOG_ERROR("torrent create file failed!\n");
+    struct file_cache *fc = &tsk->fc;
+
+    int i = torrent_file_find(fc, offset);
+    for(; buflen > 0 && i < fc->nfiles; i++) {
+        struct open_file *of = &fc->files[i];
+
+        int64 iolen = of->offset + of->size - offset;
+        if(iolen <= 0) {
+            continue;
+        }
+        iolen = iolen < buflen ? iolen : buflen;
+
+        int fd = torrent_file_cache_get(tsk, i);
+        if(fd < 0) {
             return -1;
         }
-        return 0;
+
+        int ret = torrent_file_io(fd, op, offset - of->offset, buffer, iolen);
+        torrent_file_cache_put(tsk, i);
+
+        if(ret) {
+            if(op == TORRENT_IO_WRITE) {
+                LOG_ERROR("write file[%d] %lld:%s\n", i, offset, strerror(errno));
+            }
+            return -1;
+        }
+
+        buffer = buffer ? buffer + iolen : NULL;
+        offset += iolen;
+        buflen -= iolen;
+    }
+
+    return buflen > 0 ? -1 : 0;
+}
+
+int
+torrent_create_downfiles(struct torrent_task *tsk)
+{
+    if(torrent_file_cache_init(tsk)) {
+        return -1;
     }
 
     int i;
-    for(i = 0; i < tsk->tor.mfile.files_num; i++) {
-        int ret = torrent_create_file(tsk->tor.pathname, tsk->tor.mfile.files[i].subdir,
-                                                        tsk->tor.mfile.files[i].pathname, NULL);
-        if(ret) {
+    for(i = 0; i < tsk->fc.nfiles; i++) {
+        if(torrent_file_cache_get(tsk, i) < 0) {
             LOG_ERROR("torrent create file failed!\n");
             return -1;
         }
+        torrent_file_cache_put(tsk, i);
     }
 
     return 0;
 }
 
-static int
-torrent_read_single_file(const char *subdir1, const char *subdir2, const char *filename, 
-                                            int64 offset, char *buffer, int64 buflen)
+int
+torrent_close_downfiles(struct torrent_task *tsk)
 {
-    FILE *fp;
-    if(torrent_create_file(subdir1, subdir2, filename, &fp)) {
-        LOG_ERROR("create file for write failed!\n");
+    struct file_cache *fc = &tsk->fc;
+
+    while(fc->lru_head) {
+        struct open_file *of = fc->lru_head;
+        torrent_file_lru_unlink(fc, of);
+        close(of->fd);
+        of->fd = -1;
+    }
+    fc->nopen = 0;
+
+    GFREE(fc->files);
+    fc->files = NULL;
+    fc->nfiles = 0;
+    pthread_mutex_destroy(&fc->lock);
+
+    return 0;
+}
+
+int
+torrent_read_data(struct torrent_task *tsk, int64 offset, char *buffer, int buflen)
+{
+    return torrent_piece_io(tsk, TORRENT_IO_READ, offset, buffer, buflen);
+}
+
+int
+torrent_write_data(struct torrent_task *tsk, int64 offset, const char *buffer, int buflen)
+{
+    return torrent_piece_io(tsk, TORRENT_IO_WRITE, offset, (char *)buffer, buflen);
+}
+
+/*
+ * the cached fd of the file holding torrent byte 'offset' with a ref on it,
+ * 'fileoff' is the offset in that file and 'filelen' the bytes left in it.
+ */
+int
+torrent_data_fd_get(struct torrent_task *tsk, int64 offset, int *fidx,
+                                        int64 *fileoff, int64 *filelen)
+{
+    struct file_cache *fc = &tsk->fc;
+    if(offset < 0 || offset >= tsk->tor.totalsz) {
         return -1;
     }
 
-    struct stat st;
-    if(fstat(fileno(fp), &st)) {
-        LOG_ERROR("fstat %s failed:%s\n", strerror(errno));
-        fclose(fp);
+    int i = torrent_file_find(fc, offset);
+    struct open_file *of = &fc->files[i];
+    if(offset >= of->offset + of->size) {
         return -1;
     }
 
-    if(st.st_size < offset + buflen) {
-        /* LOG_ERROR("read piece failed, not enough data for reading!\n"); */
-        fclose(fp);
+    int fd = torrent_file_cache_get(tsk, i);
+    if(fd < 0) {
         return -1;
     }
 
-    if(utils_lseek(fileno(fp), offset, SEEK_SET) != offset) {
-        LOG_ERROR("lseek %s:%s\n", filename, strerror(errno));
-        fclose(fp);
+    *fidx = i;
+    *fileoff = offset - of->offset;
+    *filelen = of->offset + of->size - offset;
+
+    return fd;
+}
+
+void
+torrent_data_fd_put(struct torrent_task *tsk, int fidx)
+{
+    torrent_file_cache_put(tsk, fidx);
+}
+
+int
+torrent_stat_file(struct torrent_task *tsk, int fidx, struct stat *st)
+{
+    if(fidx < 0 || fidx >= tsk->fc.nfiles) {
         return -1;
     }
 
-    if(fread(buffer, 1, buflen, fp) != buflen) {
-        LOG_ERROR("fread %s:%s\n", buflen, filename, strerror(errno));
-        fclose(fp);
+    int fd = torrent_file_cache_get(tsk, fidx);
+    if(fd < 0) {
         return -1;
     }
 
-    fclose(fp);
-    return 0;
+    int ret = fstat(fd, st);
+    torrent_file_cache_put(tsk, fidx);
+
+    return ret;
 }
 
 int
@@ -150,193 +418,590 @@ torrent_read_piece(struct torrent_task *tsk, int pieceid, char **setme_buffer, i
     }
 
     int64 offset = (int64)tsk->tor.piece_len * pieceid;
-    if(tsk->tor.isSingleDown) {
-        int ret = torrent_read_single_file(NULL, NULL, tsk->tor.pathname,
-                                         offset, buffer, buflen);
-        if(ret) {
-            GFREE(buffer);
-            return -1;
+    if(torrent_piece_io(tsk, TORRENT_IO_READ, offset, buffer, buflen)) {
+        GFREE(buffer);
+        return -1;
+    }
+
+    *setme_buffer = buffer;
+    *setme_buflen = buflen;
+    return 0;
+}
+
+int
+torrent_write_piece(struct torrent_task *tsk, int pieceid, const char *buffer, int buflen)
+{
+    if(!tsk || !buffer || buflen <= 0 || pieceid < 0 || pieceid >= tsk->tor.pieces_num) {
+        LOG_ERROR("invalid param!\n");
+        return -1;
+    }
+
+    int64 offset = (int64)tsk->tor.piece_len * pieceid;
+    if(torrent_piece_io(tsk, TORRENT_IO_WRITE, offset, (char *)buffer, buflen)) {
+        LOG_ERROR("write piece[%d] failed!\n", pieceid);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int torrent_check_piece_done(struct disk_job *job);
+
+static int
+torrent_check_next_piece(struct torrent_task *tsk)
+{
+    struct torrent_check *chk = &tsk->chk;
+
+    for(; chk->next < tsk->bf.npieces; chk->next++) {
+        int idx = chk->next;
+        if(!chk->check_map || (chk->check_map[idx >> 3] & (1 << (7 - (idx & 7))))) {
+            return idx;
         }
-        *setme_buffer = buffer;
-        *setme_buflen = buflen;
+    }
+
+    return -1;
+}
+
+static int
+torrent_check_submit(struct torrent_task *tsk, char *buffer)
+{
+    struct torrent_check *chk = &tsk->chk;
+
+    int idx = torrent_check_next_piece(tsk);
+    if(idx < 0) {
+        return -1;
+    }
+    chk->next++;
+    int buflen = idx == tsk->bf.npieces-1 ? tsk->bf.last_piecesz : tsk->bf.piecesz;
+
+    struct disk_job *job = torrent_io_job_create(tsk, DISK_JOB_CHECK, idx,
+                                    buffer, buflen, torrent_check_piece_done, NULL);
+    if(!job || torrent_io_submit(tsk->dio, job)) {
+        LOG_ERROR("submit check piece[%d] failed!\n", idx);
+        GFREE(job);
+        return -1;
+    }
+
+    chk->inflight++;
+
+    return 0;
+}
+
+static int
+torrent_check_finish(struct torrent_task *tsk)
+{
+    struct torrent_check *chk = &tsk->chk;
+
+    chk->checking = 0;
+
+    GFREE(chk->check_map);
+    chk->check_map = NULL;
+
+    LOG_DUMP(tsk->bf.bitmap, tsk->bf.nbyte, "%s local bitfield[%d/%d] checked in %lld ms:",
+                tsk->tor.pathname, tsk->bf.npieces - tsk->leftpieces, tsk->bf.npieces,
+                utils_mtime() - chk->start_time);
+
+    return 0;
+}
+
+static int
+torrent_check_piece_done(struct disk_job *job)
+{
+    struct torrent_task *tsk = job->tsk;
+    struct torrent_check *chk = &tsk->chk;
+    int total = chk->total;
+
+    chk->inflight--;
+    chk->done++;
+
+    /* verified pieces can be served at once, peers already sent our bitfield get a have */
+    if(!job->result && !bitfield_local_have(&tsk->bf, job->pieceidx)) {
+        torrent_add_having_piece(tsk, job->pieceidx);
+        chk->have++;
+        tsk->leftpieces--;
+    }
+
+    if(chk->done * 10 / total != (chk->done - 1) * 10 / total) {
+        LOG_INFO("%s checking %d%% [%d/%d], have %d\n", tsk->tor.pathname,
+                        chk->done * 100 / total, chk->done, total, chk->have);
+    }
+
+    /* reuse the buffer for the next piece */
+    if(!torrent_check_submit(tsk, job->buffer)) {
+        return 0;
+    }
+
+    GFREE(job->buffer);
+
+    if(!chk->inflight) {
+        torrent_check_finish(tsk);
+    }
+
+    return 0;
+}
+
+/* 
+ * hash the pieces on the disk threads, the task runs meanwhile and
+ * serves the pieces already verified, downloading waits for the end.
+ * only the pieces in chk.check_map are hashed when it is set.
+ */
+int
+torrent_check_downfiles_bitfield(struct torrent_task *tsk)
+{
+    struct torrent_check *chk = &tsk->chk;
+
+    chk->checking = 1;
+    chk->next = chk->done = chk->have = chk->inflight = 0;
+    chk->start_time = utils_mtime();
+    /* a worker takes up to 'lanes' check jobs at once, keep every one of them fed */
+    int lanes = sha1_accel_lanes();
+    chk->window = tsk->dio->nthread * (lanes > 1 ? lanes : 2);
+
+    int idx, have = 0;
+    chk->total = chk->check_map ? 0 : tsk->bf.npieces;
+    for(idx = 0; idx < tsk->bf.npieces; idx++) {
+        if(!bitfield_is_local_have(&tsk->bf, idx)) {
+            have++;
+        } else if(chk->check_map && (chk->check_map[idx >> 3] & (1 << (7 - (idx & 7))))) {
+            chk->total++;
+        }
+    }
+    tsk->leftpieces = tsk->bf.npieces - have;
+
+    LOG_DEBUG("%s local bitfield checking %d pieces...\n", tsk->tor.pathname, chk->total);
+
+    if(!chk->total) {
+        torrent_check_finish(tsk);
         return 0;
     }
 
     int i;
-    int64 invalid_offset = 0, fsize = 0;
-    struct single_file *sfile =  tsk->tor.mfile.files;
-    for(i = 0; i < tsk->tor.mfile.files_num; i++) {
-        invalid_offset = fsize;
-        fsize += sfile[i].file_size;
-        if(fsize > offset) {
+    for(i = 0; i < chk->window; i++) {
+        char *buffer = GMALLOC(tsk->bf.piecesz);
+        if(!buffer) {
+            LOG_ERROR("out of memory!\n");
+            break;
+        }
+
+        if(torrent_check_submit(tsk, buffer)) {
+            GFREE(buffer);
             break;
         }
     }
-   
-    if(i == tsk->tor.mfile.files_num) {
-        LOG_ERROR("Error, can't find the file to read piece!\n");
+
+    if(!chk->inflight) {
+        LOG_ERROR("%s local bitfield check failed!\n", tsk->tor.pathname);
+        torrent_check_finish(tsk);
         return -1;
     }
 
-    int64 readsz = buflen; 
-    int64 leftsz = offset + buflen - fsize;
-    if(leftsz > 0) {
-        readsz = buflen - leftsz;
+    return 0;
+}
+
+static int
+torrent_io_check_read(struct disk_job *job)
+{
+    struct torrent_task *tsk = job->tsk;
+    int64 offset = (int64)tsk->tor.piece_len * job->pieceidx;
+
+    /* keep the disk busy with the pieces queued after the window */
+    int64 ahead = offset + (int64)tsk->tor.piece_len * tsk->chk.window;
+    if(tsk->chk.checking && ahead < tsk->tor.totalsz) {
+        int64 len = tsk->tor.totalsz - ahead;
+        len = len < tsk->tor.piece_len ? len : tsk->tor.piece_len;
+        torrent_piece_io(tsk, TORRENT_IO_READAHEAD, ahead, NULL, len);
     }
 
-    if(torrent_read_single_file(tsk->tor.pathname, sfile[i].subdir, sfile[i].pathname,
-                                            offset-invalid_offset, buffer, readsz)) {
-        GFREE(buffer);
-        return -1; 
+    return torrent_piece_io(tsk, TORRENT_IO_READ, offset, job->buffer, job->buflen);
+}
+
+/* check jobs queued back to back are hashed together by the multi-buffer sha1 */
+static void
+torrent_io_do_check_batch(struct disk_job **jobs, int njob)
+{
+    const unsigned char *data[SHA1_MB_LANES];
+    size_t len[SHA1_MB_LANES];
+    unsigned char digest[SHA1_MB_LANES * 20];
+    struct disk_job *hjobs[SHA1_MB_LANES];
+
+    int i, n = 0;
+    for(i = 0; i < njob; i++) {
+        if((jobs[i]->result = torrent_io_check_read(jobs[i]))) {
+            continue;
+        }
+        data[n] = (const unsigned char *)jobs[i]->buffer;
+        len[n] = jobs[i]->buflen;
+        hjobs[n++] = jobs[i];
+    }
+
+    sha1_accel_digest_multi(data, len, n, digest);
+
+    for(i = 0; i < n; i++) {
+        struct torrent_task *tsk = hjobs[i]->tsk;
+        hjobs[i]->result = memcmp(digest + i * 20,
+                    &tsk->tor.pieces[hjobs[i]->pieceidx*20], 20) ? -1 : 0;
+    }
+}
+
+static int
+torrent_io_do_job(struct disk_job *job)
+{
+    struct torrent_task *tsk = job->tsk;
+    int64 offset = (int64)tsk->tor.piece_len * job->pieceidx;
+
+    switch(job->type) {
+        case DISK_JOB_READ:
+            return torrent_piece_io(tsk, TORRENT_IO_READ, offset, job->buffer, job->buflen);
+        case DISK_JOB_WRITE:
+            return torrent_piece_io(tsk, TORRENT_IO_WRITE, offset + job->offset,
+                                                    job->buffer, job->buflen);
+        case DISK_JOB_HASH:
+            return utils_sha1_check(job->buffer, job->buflen,
+                                    &tsk->tor.pieces[job->pieceidx*20], 20);
+        case DISK_JOB_CHECK:
+            if(torrent_io_check_read(job)) {
+                return -1;
+            }
+            return utils_sha1_check(job->buffer, job->buflen,
+                                    &tsk->tor.pieces[job->pieceidx*20], 20);
+        case DISK_JOB_RESUME:
+            return torrent_resume_write(tsk, job->buffer, job->buflen);
+        default:
+            LOG_ERROR("invalid disk job type[%d]!\n", job->type);
+            break;
+    }
+
+    return -1;
+}
+
+/* with dio->lock held, the port of the loop the job's task runs on */
+static struct disk_port *
+torrent_io_job_port(struct disk_io *dio, struct disk_job *job)
+{
+    int i;
+    for(i = 1; i < dio->nport; i++) {
+        if(dio->port[i].epfd == job->tsk->epfd) {
+            return &dio->port[i];
+        }
     }
+    return &dio->port[0];
+}
+
+static void
+torrent_io_job_complete(struct disk_io *dio, struct disk_job *job)
+{
+    pthread_mutex_lock(&dio->lock);
+    struct disk_port *port = torrent_io_job_port(dio, job);
+    job->next = NULL;
+    *port->done_tail = job;
+    port->done_tail = &job->next;
+    pthread_mutex_unlock(&dio->lock);
+
+    uint64 one = 1;
+    if(write(port->efd, &one, sizeof(one)) != sizeof(one)) {
+        LOG_ALARM("disk io notify failed:%s\n", strerror(errno));
+    }
+}
+
+void*
+torrent_io_thread_func(void *thread_ctx)
+{
+    struct disk_io *dio = (struct disk_io *)thread_ctx;
 
-    int64 bufoffset = readsz;
-    for(i++; leftsz > 0 && i < tsk->tor.mfile.files_num; i++) {
-        readsz = leftsz;
-        leftsz = leftsz - sfile[i].file_size; 
-        if(leftsz > 0) {
-            readsz = sfile[i].file_size;
+    pthread_mutex_lock(&dio->lock);
+    while(1) {
+        while(!dio->job_list && !dio->stop) {
+            pthread_cond_wait(&dio->cond, &dio->lock);
         }
 
-        if(torrent_read_single_file(tsk->tor.pathname, sfile[i].subdir, sfile[i].pathname,
-                                            0, buffer+bufoffset, readsz)) {
-            GFREE(buffer);
-            return -1;
+        /* finish the queued jobs before quit */
+        if(!dio->job_list) {
+            break;
+        }
+
+        struct disk_job *jobs[SHA1_MB_LANES];
+        int i, njob = 0, lanes = sha1_accel_lanes();
+        do {
+            jobs[njob++] = dio->job_list;
+            dio->job_list = dio->job_list->next;
+        } while(jobs[0]->type == DISK_JOB_CHECK && njob < lanes
+                    && dio->job_list && dio->job_list->type == DISK_JOB_CHECK);
+        if(!dio->job_list) {
+            dio->job_tail = &dio->job_list;
         }
+        pthread_mutex_unlock(&dio->lock);
 
-        bufoffset += readsz;
+        if(njob > 1) {
+            torrent_io_do_check_batch(jobs, njob);
+        } else {
+            jobs[0]->result = torrent_io_do_job(jobs[0]);
+        }
+
+        for(i = 0; i < njob; i++) {
+            torrent_io_job_complete(dio, jobs[i]);
+        }
+
+        pthread_mutex_lock(&dio->lock);
+    }
+    pthread_mutex_unlock(&dio->lock);
+
+    return NULL;
+}
+
+static int
+torrent_io_dispatch_done(struct disk_port *port)
+{
+    struct disk_io *dio = port->dio;
+
+    pthread_mutex_lock(&dio->lock);
+    struct disk_job *job = port->done_list;
+    port->done_list = NULL;
+    port->done_tail = &port->done_list;
+    pthread_mutex_unlock(&dio->lock);
+
+    while(job) {
+        struct disk_job *tmp = job;
+        job = job->next;
+
+        __atomic_sub_fetch(&dio->njob, 1, __ATOMIC_RELAXED);
+        if(tmp->done) {
+            pthread_mutex_lock(&tmp->tsk->lock);
+            tmp->done(tmp);
+            pthread_mutex_unlock(&tmp->tsk->lock);
+        }
+        GFREE(tmp);
     }
 
-    *setme_buffer = buffer;
-    *setme_buflen = buflen;
     return 0;
 }
 
 static int
-torrent_write_single_file(const char *subdir1, const char *subdir2, const char *filename, 
-                                                int64 offset, const char *buffer, int64 buflen)
+torrent_io_event_handle(int event, void *evt_ctx)
+{
+    struct disk_port *port = (struct disk_port *)evt_ctx;
+
+    uint64 cnt;
+    if(read(port->efd, &cnt, sizeof(cnt)) != sizeof(cnt)) {
+        if(errno == EAGAIN || errno == EWOULDBLOCK) {
+            return 0;
+        }
+        LOG_ALARM("disk io eventfd read failed:%s\n", strerror(errno));
+    }
+
+    return torrent_io_dispatch_done(port);
+}
+
+static int
+torrent_io_port_open(struct disk_io *dio, int epfd)
 {
-    FILE *fp;
-    if(torrent_create_file(subdir1, subdir2, filename, &fp)) {
-        LOG_ERROR("create file for write failed!\n");
+    if(dio->nport == EVENT_MAX_LOOPS) {
+        LOG_ERROR("too many disk io ports!\n");
         return -1;
     }
 
-    if(utils_lseek(fileno(fp), offset, SEEK_SET) != offset) {
-        LOG_ERROR("lseek[%lld] %s:%s\n", offset, filename, strerror(errno));
-        fclose(fp);
+    struct disk_port *port = &dio->port[dio->nport];
+    port->epfd = epfd;
+    port->dio = dio;
+    port->done_list = NULL;
+    port->done_tail = &port->done_list;
+
+    port->efd = eventfd(0, EFD_NONBLOCK);
+    if(port->efd < 0) {
+        LOG_ERROR("eventfd failed:%s\n", strerror(errno));
         return -1;
     }
 
-    if(fwrite(buffer, 1, buflen, fp) != buflen) {
-        LOG_ERROR("fwrite %s:%s\n", filename, strerror(errno));
-        fclose(fp);
+    struct event_param ep;
+    ep.fd = port->efd;
+    ep.event = EPOLLIN;
+    ep.evt_hdl = torrent_io_event_handle;
+    ep.evt_ctx = port;
+
+    if(event_add(epfd, &ep)) {
+        LOG_ERROR("disk io add event failed!\n");
+        close(port->efd);
         return -1;
     }
 
-    fclose(fp);
+    /* the workers look the port up under the lock */
+    pthread_mutex_lock(&dio->lock);
+    dio->nport++;
+    pthread_mutex_unlock(&dio->lock);
+
     return 0;
 }
 
-int
-torrent_write_piece(struct torrent_task *tsk, int pieceid, const char *buffer, int buflen)
+static void
+torrent_io_port_close(struct disk_port *port)
 {
-    if(!tsk || !buffer || buflen <= 0 || pieceid < 0 || pieceid >= tsk->tor.pieces_num) {
-        LOG_ERROR("invalid param!\n");
-        return -1;
+    /* its slot points at the port */
+    struct event_param ep;
+    memset(&ep, 0, sizeof(ep));
+    ep.fd = port->efd;
+    event_del(port->epfd, &ep);
+    close(port->efd);
+}
+
+struct disk_io*
+torrent_io_create(int epfd, int nthread)
+{
+    if(nthread <= 0) {
+        nthread = sysconf(_SC_NPROCESSORS_ONLN);
     }
+    nthread = nthread <= 0 ? 1 : (nthread > DISK_IO_MAX_THREADS ? DISK_IO_MAX_THREADS : nthread);
 
-    int64 offset = (int64)tsk->tor.piece_len * pieceid;
-    if(tsk->tor.isSingleDown) {
-        return torrent_write_single_file(NULL, NULL, tsk->tor.pathname,
-                                         offset, buffer, buflen);
-    } 
+    struct disk_io *dio = GCALLOC(1, sizeof(*dio));
+    if(!dio) {
+        LOG_ERROR("out of memory!\n");
+        return NULL;
+    }
 
-    int i;
-    int64 invalid_offset = 0, fsize = 0;
-    struct single_file *sfile =  tsk->tor.mfile.files;
-    for(i = 0; i < tsk->tor.mfile.files_num; i++) {
-        invalid_offset = fsize;
-        fsize += sfile[i].file_size;
-        if(fsize > offset) {
+    dio->job_tail = &dio->job_list;
+    pthread_mutex_init(&dio->lock, NULL);
+    pthread_cond_init(&dio->cond, NULL);
+
+    if(torrent_io_port_open(dio, epfd)) {
+        goto FAILED;
+    }
+
+    dio->threads = GCALLOC(nthread, sizeof(pthread_t));
+    if(!dio->threads) {
+        LOG_ERROR("out of memory!\n");
+        goto FAILED;
+    }
+
+    /* signals are for the main loop, the workers inherit a full mask */
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    for(; dio->nthread < nthread; dio->nthread++) {
+        int ret = pthread_create(&dio->threads[dio->nthread], NULL, torrent_io_thread_func, dio);
+        if(ret) {
+            LOG_ERROR("create disk io thread failed:%s\n", strerror(ret));
             break;
         }
     }
-   
-    if(i == tsk->tor.mfile.files_num) {
-        LOG_ERROR("Error, can't find the file to write piece!\n");
-        return -1;
-    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
 
-    int64 writesz = buflen; 
-    int64 leftsz = offset + buflen - fsize;
-    if(leftsz > 0) {
-        writesz = buflen - leftsz;
+    if(!dio->nthread) {
+        goto FAILED;
     }
 
-    if(torrent_write_single_file(tsk->tor.pathname, sfile[i].subdir, sfile[i].pathname,
-                                            offset-invalid_offset, buffer, writesz)) {
-        return -1; 
+    LOG_DEBUG("disk io: %d threads\n", dio->nthread);
+
+    return dio;
+
+FAILED:
+    if(dio->nport) {
+        torrent_io_port_close(&dio->port[0]);
     }
+    pthread_mutex_destroy(&dio->lock);
+    pthread_cond_destroy(&dio->cond);
+    GFREE(dio->threads);
+    GFREE(dio);
+    return NULL;
+}
 
-    int64 bufoffset = writesz;
-    for(i++; leftsz > 0 && i < tsk->tor.mfile.files_num; i++) {
-        writesz = leftsz;
-        leftsz = leftsz - sfile[i].file_size; 
-        if(leftsz > 0) {
-            writesz = sfile[i].file_size;
-        }
+/* the tasks on epfd's loop get their completions there, before it starts */
+int
+torrent_io_attach(struct disk_io *dio, int epfd)
+{
+    if(!dio) {
+        return -1;
+    }
 
-        if(torrent_write_single_file(tsk->tor.pathname, sfile[i].subdir, sfile[i].pathname,
-                                            0, buffer+bufoffset, writesz)) {
-            return -1;
+    int i;
+    for(i = 0; i < dio->nport; i++) {
+        if(dio->port[i].epfd == epfd) {
+            return 0;
         }
-
-        bufoffset += writesz;
     }
 
-    return 0;
+    return torrent_io_port_open(dio, epfd);
 }
 
+/* wait for all queued jobs and run their completions */
 int
-torrent_check_downfiles_bitfield(struct torrent_task *tsk)
+torrent_io_destroy(struct disk_io *dio)
 {
-    char *bitmap = tsk->bf.bitmap;
-    int idx, havepices = 0, npieces = tsk->bf.npieces;
+    if(!dio) {
+        return -1;
+    }
 
-    LOG_DEBUG("%s local bitfield checking...\n", tsk->tor.pathname);
+    pthread_mutex_lock(&dio->lock);
+    dio->stop = 1;
+    pthread_cond_broadcast(&dio->cond);
+    pthread_mutex_unlock(&dio->lock);
 
-    char *buffer;
-    int buflen;
-    for(idx = 0; idx < npieces; idx++) {
-        if(torrent_read_piece(tsk, idx, &buffer, &buflen)) {
-            continue;
-        }
+    int i;
+    for(i = 0; i < dio->nthread; i++) {
+        pthread_join(dio->threads[i], NULL);
+    }
 
-        if(utils_sha1_check(buffer, buflen, &tsk->tor.pieces[idx*20], 20)) {
-            GFREE(buffer);
-            continue;
-        }
-        GFREE(buffer);
+    for(i = 0; i < dio->nport; i++) {
+        torrent_io_dispatch_done(&dio->port[i]);
+        torrent_io_port_close(&dio->port[i]);
+    }
+
+    pthread_mutex_destroy(&dio->lock);
+    pthread_cond_destroy(&dio->cond);
+    GFREE(dio->threads);
+    GFREE(dio);
 
-        havepices++;
+    return 0;
+}
 
-        int pidx = idx >> 3; /* idx/8 */
-        int bidx = idx & 7;  /* idx%8 */
-        unsigned char *byte = (unsigned char *)&bitmap[pidx];
-        *byte |= (1 << (7-bidx));        
+/* the job is owned by disk io until its done callback returns */
+int
+torrent_io_submit(struct disk_io *dio, struct disk_job *job)
+{
+    if(!dio || !job || !job->tsk || !job->buffer || job->buflen <= 0) {
+        LOG_ERROR("invalid param!\n");
+        return -1;
+    }
+
+    /* completions run by torrent_io_destroy can't queue more */
+    if(dio->stop) {
+        return -1;
     }
 
-    LOG_DUMP(bitmap, tsk->bf.nbyte, "%s local bitfield[%d/%d]:",
-                                    tsk->tor.pathname, havepices, npieces);
+    /* never done on the loop, a full queue stops the peers reading instead */
+    __atomic_add_fetch(&dio->njob, 1, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&dio->lock);
+    job->next = NULL;
+    *dio->job_tail = job;
+    dio->job_tail = &job->next;
+    pthread_cond_signal(&dio->cond);
+    pthread_mutex_unlock(&dio->lock);
 
-    tsk->leftpieces = npieces - havepices;
     return 0;
 }
 
-void*
-torrent_io_thread_func(void *thread_ctx)
+/* the jobs submitted but not dispatched yet reached DISK_IO_MAX_JOBS */
+int
+torrent_io_busy(struct disk_io *dio)
 {
-    return NULL;
+    return __atomic_load_n(&dio->njob, __ATOMIC_RELAXED) >= DISK_IO_MAX_JOBS;
 }
 
+struct disk_job*
+torrent_io_job_create(struct torrent_task *tsk, int type, int pieceidx,
+                    char *buffer, int buflen, disk_job_done_t done, void *ctx)
+{
+    struct disk_job *job = GCALLOC(1, sizeof(*job));
+    if(!job) {
+        LOG_ERROR("out of memory!\n");
+        return NULL;
+    }
+
+    job->tsk = tsk;
+    job->type = type;
+    job->pieceidx = pieceidx;
+    job->buffer = buffer;
+    job->buflen = buflen;
+    job->done = done;
+    job->ctx = ctx;
+
+    return job;
+}
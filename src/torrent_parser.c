@@ -446,6 +446,37 @@ dump_torrent_info(struct torrent_file *tor)
 
 }
 
+/* everything the two parsers allocated, a failed parse included */
+int
+torrent_info_free(struct torrent_file *tor)
+{
+    destroy_dict(&tor->bt);
+
+    int i;
+    for(i = 0; i < tor->tracker_num; i++) {
+        GFREE(tor->tracker_url[i]);
+        tor->tracker_url[i] = NULL;
+    }
+    tor->tracker_num = 0;
+
+    for(i = 0; tor->mfile.files && i < tor->mfile.files_num; i++) {
+        GFREE(tor->mfile.files[i].subdir);
+        GFREE(tor->mfile.files[i].pathname);
+    }
+    GFREE(tor->mfile.files);
+    tor->mfile.files = NULL;
+    tor->mfile.files_num = 0;
+
+    GFREE(tor->torfile);
+    GFREE(tor->pieces);
+    GFREE(tor->pathname);
+    GFREE(tor->comment);
+    GFREE(tor->creator);
+    tor->torfile = tor->pieces = tor->pathname = tor->comment = tor->creator = NULL;
+
+    return 0;
+}
+
 int
 torrent_info_parser(struct torrent_file *tor)
 {
@@ -0,0 +1,458 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "btype.h"
+#include "torrent.h"
+#include "bitfield.h"
+#include "log.h"
+#include "mempool.h"
+
+/*
+ * fast resume file: header + local bitmap + (size, mtime) of every file
+ * + the partial pieces in download with a bit per received block. it is only
+ * trusted for the files whose size and mtime still match.
+ */
+
+#define RESUME_MAGIC 0x52465442 /* "BTFR" */
+#define RESUME_VERSION 1
+
+struct resume_header {
+    int magic, version;
+    char info_hash[SHA1_LEN];
+    int npieces, nfiles, npartial;
+    int64 down_size, upload_size;
+};
+
+struct resume_file {
+    int64 size;
+    int64 mtime_sec, mtime_nsec;
+};
+
+struct resume_partial {
+    int idx, nslice;
+};
+
+static int
+torrent_resume_path(struct torrent_task *tsk, char *path, int pathlen)
+{
+    snprintf(path, pathlen, "%s%s.resume", DOWNLOAD_DIR, tsk->tor.pathname);
+    return 0;
+}
+
+static int
+torrent_resume_stat(struct torrent_task *tsk, int fidx, struct resume_file *rf)
+{
+    struct stat st;
+    if(torrent_stat_file(tsk, fidx, &st)) {
+        return -1;
+    }
+
+    rf->size = st.st_size;
+    rf->mtime_sec = st.st_mtim.tv_sec;
+    rf->mtime_nsec = st.st_mtim.tv_nsec;
+
+    return 0;
+}
+
+static void
+torrent_resume_mark_file(struct torrent_task *tsk, int fidx, char *map)
+{
+    struct open_file *of = &tsk->fc.files[fidx];
+    if(of->size <= 0) {
+        return;
+    }
+
+    int idx = of->offset / tsk->tor.piece_len;
+    int last = (of->offset + of->size - 1) / tsk->tor.piece_len;
+    for(; idx <= last; idx++) {
+        map[idx >> 3] |= (1 << (7 - (idx & 7)));
+    }
+}
+
+/* received blocks of a piece not complete yet, a full one is in the hash job */
+static int
+torrent_resume_is_partial(struct down_piece *dp)
+{
+    return dp->nrecv && !dp->verifying;
+}
+
+/* a bit per block of the piece that is already received */
+static int
+torrent_resume_partial_map(struct torrent_task *tsk, struct down_piece *dp, char *donemap)
+{
+    int i;
+
+    memset(donemap, 0, (dp->nblock + 7) / 8);
+    for(i = 0; i < dp->nblock; i++) {
+        if(dp->blocks[i].state == BLOCK_RECEIVED) {
+            donemap[i >> 3] |= 1 << (7 - (i & 7));
+        }
+    }
+
+    return dp->nblock;
+}
+
+/*
+ * what the loop hands the disk thread to save: the partial blocks that only
+ * live in piece buffers, the header, the bitmap and the partial records.
+ * the file (size, mtime) entries are taken there, after the blocks are on disk.
+ */
+struct resume_snapshot {
+    int nblock, blocklen; /* resume_block + data each */
+    int nbyte;            /* of the bitmap */
+    int partlen;          /* resume_partial + done map each */
+    struct resume_header hdr;
+};
+
+struct resume_block {
+    int64 offset;
+    int len;
+};
+
+/* received blocks of a piece buffer, 'buf' NULL only counts the bytes */
+static int
+torrent_resume_copy_blocks(struct torrent_task *tsk, struct down_piece *dp, char *buf, int *nblock)
+{
+    if(!dp->piecebuf) {
+        return 0;
+    }
+
+    int i, len = 0;
+    int piecesz = dp->idx == tsk->bf.npieces-1 ? tsk->bf.last_piecesz : tsk->bf.piecesz;
+
+    for(i = 0; i < dp->nblock; i++) {
+        if(dp->blocks[i].state != BLOCK_RECEIVED) {
+            continue;
+        }
+
+        struct resume_block rb;
+        int off = i * SLICE_SZ;
+        rb.offset = (int64)tsk->tor.piece_len * dp->idx + off;
+        rb.len = piecesz - off < SLICE_SZ ? piecesz - off : SLICE_SZ;
+        if(buf) {
+            memcpy(buf + len, &rb, sizeof(rb));
+            memcpy(buf + len + sizeof(rb), dp->piecebuf + off, rb.len);
+        }
+        len += sizeof(rb) + rb.len;
+        (*nblock)++;
+    }
+
+    return len;
+}
+
+/* taken on the loop thread, the task state is only read here */
+static char*
+torrent_resume_snapshot(struct torrent_task *tsk, int *setme_len)
+{
+    /* bitmap is not complete, the old resume file is still the right one */
+    if(tsk->chk.checking) {
+        return NULL;
+    }
+
+    struct down_piece *dp;
+    int nblock = 0, blocklen = 0, partlen = 0, npartial = 0;
+    for(dp = tsk->bf.down_pieces; dp; dp = dp->next) {
+        if(torrent_resume_is_partial(dp)) {
+            npartial++;
+            partlen += sizeof(struct resume_partial) + (dp->nblock + 7) / 8;
+            blocklen += torrent_resume_copy_blocks(tsk, dp, NULL, &nblock);
+        }
+    }
+
+    int len = sizeof(struct resume_snapshot) + blocklen + tsk->bf.nbyte + partlen;
+    char *buf = GCALLOC(1, len);
+    if(!buf) {
+        LOG_ERROR("out of memory!\n");
+        return NULL;
+    }
+
+    struct resume_snapshot *snap = (struct resume_snapshot *)buf;
+    snap->blocklen = blocklen;
+    snap->nbyte = tsk->bf.nbyte;
+    snap->partlen = partlen;
+    snap->hdr.magic = RESUME_MAGIC;
+    snap->hdr.version = RESUME_VERSION;
+    memcpy(snap->hdr.info_hash, tsk->tor.info_hash, SHA1_LEN);
+    snap->hdr.npieces = tsk->bf.npieces;
+    snap->hdr.nfiles = tsk->fc.nfiles;
+    snap->hdr.npartial = npartial;
+    snap->hdr.down_size = tsk->down_size;
+    snap->hdr.upload_size = tsk->upload_size;
+
+    char *pos = buf + sizeof(*snap);
+    for(dp = tsk->bf.down_pieces; dp; dp = dp->next) {
+        if(torrent_resume_is_partial(dp)) {
+            pos += torrent_resume_copy_blocks(tsk, dp, pos, &snap->nblock);
+        }
+    }
+
+    memcpy(pos, tsk->bf.bitmap, tsk->bf.nbyte);
+    pos += tsk->bf.nbyte;
+
+    for(dp = tsk->bf.down_pieces; dp; dp = dp->next) {
+        if(!torrent_resume_is_partial(dp)) {
+            continue;
+        }
+
+        struct resume_partial rp;
+        rp.idx = dp->idx;
+        rp.nslice = torrent_resume_partial_map(tsk, dp, pos + sizeof(rp));
+        memcpy(pos, &rp, sizeof(rp));
+        pos += sizeof(rp) + (rp.nslice + 7) / 8;
+    }
+
+    *setme_len = len;
+
+    return buf;
+}
+
+/* may run on a disk thread, it only touches the files and the snapshot */
+int
+torrent_resume_write(struct torrent_task *tsk, char *buf, int len)
+{
+    struct resume_snapshot *snap = (struct resume_snapshot *)buf;
+    if(len < (int)sizeof(*snap)
+            || len != (int)sizeof(*snap) + snap->blocklen + snap->nbyte + snap->partlen) {
+        LOG_ERROR("invalid resume snapshot!\n");
+        return -1;
+    }
+
+    /* partial data first, so the file mtimes below cover it */
+    int i;
+    char *pos = buf + sizeof(*snap);
+    for(i = 0; i < snap->nblock; i++) {
+        struct resume_block rb;
+        memcpy(&rb, pos, sizeof(rb));
+        if(torrent_write_data(tsk, rb.offset, pos + sizeof(rb), rb.len)) {
+            return -1;
+        }
+        pos += sizeof(rb) + rb.len;
+    }
+
+    char path[1024], tmppath[1100];
+    torrent_resume_path(tsk, path, sizeof(path));
+    snprintf(tmppath, sizeof(tmppath), "%s.tmp", path);
+
+    FILE *fp = fopen(tmppath, "w");
+    if(!fp) {
+        LOG_ERROR("fopen %s : %s\n", tmppath, strerror(errno));
+        return -1;
+    }
+
+    if(fwrite(&snap->hdr, sizeof(snap->hdr), 1, fp) != 1
+            || fwrite(pos, snap->nbyte, 1, fp) != 1) {
+        goto WRITE_FAILED;
+    }
+    pos += snap->nbyte;
+
+    for(i = 0; i < snap->hdr.nfiles; i++) {
+        struct resume_file rf;
+        if(torrent_resume_stat(tsk, i, &rf)) {
+            goto FAILED;
+        }
+        if(fwrite(&rf, sizeof(rf), 1, fp) != 1) {
+            goto WRITE_FAILED;
+        }
+    }
+
+    if(snap->partlen && fwrite(pos, snap->partlen, 1, fp) != 1) {
+        goto WRITE_FAILED;
+    }
+
+    if(fclose(fp)) {
+        LOG_ERROR("fclose %s : %s\n", tmppath, strerror(errno));
+        unlink(tmppath);
+        return -1;
+    }
+
+    if(rename(tmppath, path)) {
+        LOG_ERROR("rename %s : %s\n", path, strerror(errno));
+        unlink(tmppath);
+        return -1;
+    }
+
+    LOG_DEBUG("%s resume saved, %d partial pieces\n", tsk->tor.pathname, snap->hdr.npartial);
+
+    return 0;
+
+WRITE_FAILED:
+    LOG_ERROR("fwrite %s : %s\n", tmppath, strerror(errno));
+FAILED:
+    fclose(fp);
+    unlink(tmppath);
+    return -1;
+}
+
+int
+torrent_resume_save(struct torrent_task *tsk)
+{
+    int len;
+    char *buf = torrent_resume_snapshot(tsk, &len);
+    if(!buf) {
+        return -1;
+    }
+
+    int ret = torrent_resume_write(tsk, buf, len);
+    GFREE(buf);
+
+    return ret;
+}
+
+static int
+torrent_resume_save_done(struct disk_job *job)
+{
+    job->tsk->resume_saving = 0;
+    GFREE(job->buffer);
+    return 0;
+}
+
+/* the periodic save, only the snapshot is taken on the loop */
+int
+torrent_resume_save_async(struct torrent_task *tsk)
+{
+    if(tsk->resume_saving || !tsk->dio) {
+        return 0;
+    }
+
+    int len;
+    char *buf = torrent_resume_snapshot(tsk, &len);
+    if(!buf) {
+        return -1;
+    }
+
+    struct disk_job *job = torrent_io_job_create(tsk, DISK_JOB_RESUME, 0, buf, len,
+                                                torrent_resume_save_done, NULL);
+    if(!job) {
+        GFREE(buf);
+        return -1;
+    }
+
+    tsk->resume_saving = 1;
+    if(torrent_io_submit(tsk->dio, job)) {
+        tsk->resume_saving = 0;
+        GFREE(buf);
+        GFREE(job);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int
+torrent_resume_load_partial(struct torrent_task *tsk, struct resume_partial *rp,
+                                                const char *donemap, const char *map)
+{
+    int idx = rp->idx;
+    if(idx < 0 || idx >= tsk->bf.npieces || rp->nslice != bitfield_piece_slices(&tsk->bf, idx)) {
+        return -1;
+    }
+
+    /* in a changed file, or already complete */
+    if((map[idx >> 3] & (1 << (7 - (idx & 7)))) || !bitfield_is_local_have(&tsk->bf, idx)) {
+        return 0;
+    }
+
+    /* the blocks stay on disk, the piece is hashed from there when complete */
+    return bitfield_restore_down_piece(&tsk->bf, idx, donemap);
+}
+
+/*
+ * on success the local bitmap is set from the resume file and
+ * chk.check_map holds the pieces of the changed files.
+ */
+int
+torrent_resume_load(struct torrent_task *tsk)
+{
+    char path[1024];
+    torrent_resume_path(tsk, path, sizeof(path));
+
+    FILE *fp = fopen(path, "r");
+    if(!fp) {
+        LOG_DEBUG("no resume file %s\n", path);
+        return -1;
+    }
+
+    char *bitmap = NULL, *map = NULL, *donemap = NULL;
+
+    struct resume_header hdr;
+    if(fread(&hdr, sizeof(hdr), 1, fp) != 1
+            || hdr.magic != RESUME_MAGIC || hdr.version != RESUME_VERSION
+            || memcmp(hdr.info_hash, tsk->tor.info_hash, SHA1_LEN)
+            || hdr.npieces != tsk->bf.npieces || hdr.nfiles != tsk->fc.nfiles
+            || hdr.npartial < 0 || hdr.npartial > tsk->bf.npieces) {
+        LOG_ALARM("resume file %s invalid!\n", path);
+        goto FAILED;
+    }
+
+    bitmap = GMALLOC(tsk->bf.nbyte);
+    map = GCALLOC(1, tsk->bf.nbyte);
+    if(!bitmap || !map) {
+        LOG_ERROR("out of memory!\n");
+        goto FAILED;
+    }
+
+    if(fread(bitmap, tsk->bf.nbyte, 1, fp) != 1) {
+        goto FAILED;
+    }
+
+    int i, nchanged = 0;
+    for(i = 0; i < hdr.nfiles; i++) {
+        struct resume_file rf, cur;
+        if(fread(&rf, sizeof(rf), 1, fp) != 1) {
+            goto FAILED;
+        }
+
+        if(torrent_resume_stat(tsk, i, &cur) || rf.size != cur.size
+                || rf.mtime_sec != cur.mtime_sec || rf.mtime_nsec != cur.mtime_nsec) {
+            torrent_resume_mark_file(tsk, i, map);
+            nchanged++;
+        }
+    }
+
+    int idx;
+    for(idx = 0; idx < tsk->bf.npieces; idx++) {
+        int bit = 1 << (7 - (idx & 7));
+        if((bitmap[idx >> 3] & bit) && !(map[idx >> 3] & bit)) {
+            bitfield_local_have(&tsk->bf, idx);
+        }
+    }
+
+    int nslice = bitfield_piece_slices(&tsk->bf, 0);
+    if(!(donemap = GMALLOC((nslice + 7) / 8))) {
+        LOG_ERROR("out of memory!\n");
+        goto FAILED;
+    }
+
+    for(i = 0; i < hdr.npartial; i++) {
+        struct resume_partial rp;
+        if(fread(&rp, sizeof(rp), 1, fp) != 1 || rp.nslice <= 0 || rp.nslice > nslice
+                || fread(donemap, (rp.nslice + 7) / 8, 1, fp) != 1) {
+            break;
+        }
+        torrent_resume_load_partial(tsk, &rp, donemap, map);
+    }
+
+    tsk->down_size = hdr.down_size;
+    tsk->upload_size = hdr.upload_size;
+
+    GFREE(bitmap);
+    GFREE(donemap);
+    fclose(fp);
+
+    tsk->chk.check_map = map;
+
+    LOG_INFO("%s resumed, %d/%d files changed\n", tsk->tor.pathname, nchanged, hdr.nfiles);
+
+    return 0;
+
+FAILED:
+    GFREE(bitmap);
+    GFREE(map);
+    GFREE(donemap);
+    fclose(fp);
+    return -1;
+}
@@ -1,5 +1,6 @@
 #include <sys/epoll.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -17,7 +18,6 @@
 #include "mempool.h"
 #include "socket.h"
 
-static int torrent_listen(struct torrent_task *tsk);
 static int torrent_stop_timer(struct torrent_task *tsk);
 static int torrent_start_timer(struct torrent_task *tsk);
 static int torrent_create_timer(struct torrent_task *tsk);
@@ -25,23 +25,27 @@ static int torrent_get_free_peer(struct torrent_task *tsk, struct peer **pr);
 static int torrent_peer_notify(struct torrent_task *tsk);
 static int torrent_tracker_announce(struct torrent_task *tsk);
 static int torrent_peer_init(struct torrent_task *tsk);
+static int torrent_peer_loop(struct torrent_task *tsk);
 static int torrent_init_tracker_annoucelist(struct torrent_task *tsk);
 static int torrent_find_peer_addrinfo(struct torrent_task *tsk, struct peer_addrinfo *ai);
 static int torrent_free_inactive_peer_addrinfo(struct torrent_task *tsk, int idx);
-static int torrent_add_event(struct torrent_task *tsk, int event);
-static int torrent_del_event(struct torrent_task *tsk);
 
-static int torrent_listen_handle(int event, void *evt_ctx);
 static int torrent_timeout_handle(int event, void *evt_ctx);
+static void torrent_task_release(struct torrent_task *tsk);
 
+/* the listen port and disk io of the task are the ones of 'mgr', its loop is the next one */
 int
-torrent_task_init(struct torrent_task *tsk, int epfd, char *torfile)
+torrent_task_init(struct torrent_task *tsk, struct torrent_mgr *mgr, char *torfile)
 {
 	memset(tsk, 0, sizeof(*tsk));
 	
-	tsk->epfd = epfd;
+    pthread_mutex_init(&tsk->lock, NULL);
+    tsk->mgr = mgr;
+	tsk->epfd = mgr->loop_epfd[mgr->next_loop++ % mgr->nloop];
 	tsk->tmrfd = -1;
-    tsk->listen_port = 6881;
+    tsk->listen_port = mgr->listen_port;
+    tsk->max_reqdepth = PEER_REQ_DEPTH_MAX;
+    tsk->dio = mgr->dio;
 
     tsk->tr_inactive_list_tail = &tsk->tr_inactive_list;
 
@@ -50,94 +54,136 @@ torrent_task_init(struct torrent_task *tsk, int epfd, char *torfile)
         tsk->pr_list[i].tail = &tsk->pr_list[i].head;
     }
 
-	if(torrent_create_timer(tsk)) {
-		return -1;
-	}
-
     if(torrent_file_parser(torfile, &tsk->tor)) {
         LOG_ERROR("parser %s failed!\n", torfile);
-        return -1;
+        goto FAILED;
 	}
 
 	if(torrent_info_parser(&tsk->tor)) {
 		LOG_ERROR("parser torrent info failed!\n");
-		return -1;
+		goto FAILED;
+	}
+
+    struct torrent_task *iter;
+    for(iter = mgr->tsklist; iter; iter = iter->next) {
+        if(!memcmp(iter->tor.info_hash, tsk->tor.info_hash, SHA1_LEN)) {
+            LOG_ERROR("%s is added already!\n", torfile);
+            goto FAILED;
+        }
+    }
+
+	if(torrent_init_tracker_annoucelist(tsk)) {
+		goto FAILED;
+	}
+
+	if(torrent_create_timer(tsk)) {
+		goto FAILED;
 	}
 
     if(bitfield_create(&tsk->bf, tsk->tor.pieces_num, tsk->tor.piece_len, tsk->tor.totalsz)) {
         LOG_ERROR("bitfield creat failed!\n");
-        return -1;
+        goto FAILED;
     }
 
-    if(torrent_create_downfiles(tsk)) {
-        LOG_ERROR("torrent create downfile failed!\n");
-        return -1;
+    if(bitfield_avail_create(&tsk->bf)) {
+        LOG_ERROR("bitfield availability create failed!\n");
+        goto FAILED;
     }
 
-    torrent_check_downfiles_bitfield(tsk);
-
-	if(torrent_init_tracker_annoucelist(tsk)) {
-		return -1;
-	}
-
-    if(torrent_listen(tsk)) {
-        LOG_ERROR("torrent listen failed!\n");
-        return -1;
+    if(bitfield_down_create(&tsk->bf)) {
+        LOG_ERROR("bitfield download index create failed!\n");
+        goto FAILED;
     }
 
-    if(torrent_add_event(tsk, EPOLLIN)) {
-        return -1;
+    if(torrent_create_downfiles(tsk)) {
+        LOG_ERROR("torrent create downfile failed!\n");
+        goto FAILED;
     }
 
 	if(torrent_start_timer(tsk)) {
-		return -1;
+		goto FAILED;
 	}
-	
+
+    /* without a usable resume file every piece is hashed */
+    torrent_resume_load(tsk);
+
+    tsk->resume_time = time(NULL);
+
+    /* last, nothing can fail once its jobs are in flight */
+    torrent_check_downfiles_bitfield(tsk);
+
 	return 0;
+
+FAILED:
+    torrent_task_release(tsk);
+    return -1;
 }
 
-static int
-torrent_listen(struct torrent_task *tsk)
+/* drops the peers, the disk jobs they queued are still in the manager's disk io */
+int
+torrent_task_stop(struct torrent_task *tsk)
 {
-    int sock = socket_tcp_create();
-    if(sock < 0) {
-        return -1;
-    }
+    torrent_stop_timer(tsk);
 
-    if(set_socket_unblock(sock)) {
-        close(sock);
-        return -1;
+    int i;
+    for(i = 0; i < MAX_PEER_NUM; i++) {
+        if(tsk->pr[i].isused) {
+            peer_uninit(&tsk->pr[i]);
+        }
     }
 
-    if(set_socket_opt(sock)) {
-        close(sock);
-        return -1;
-    }
+    return 0;
+}
 
-    int i, ip = 0;
-    for(i = 6881; i < 65535; i++) {
-        uint16 bport = socket_htons(i);
-        if(!socket_tcp_bind(sock, ip, bport)) {
-            break;
-        }
+/* after the disk io is drained, so the resume file matches the data on disk */
+int
+torrent_task_uninit(struct torrent_task *tsk)
+{
+    tsk->dio = NULL;
+
+    torrent_resume_save(tsk);
+
+    torrent_close_downfiles(tsk);
+
+    pthread_mutex_destroy(&tsk->lock);
+
+    return 0;
+}
+
+/* what a failed init got so far, no peer, tracker or disk job uses it yet */
+static void
+torrent_task_release(struct torrent_task *tsk)
+{
+    struct tracker *tr;
+    while((tr = tsk->tr_inactive_list)) {
+        tsk->tr_inactive_list = tr->next;
+        GFREE(tr->tp.host);
+        GFREE(tr->tp.port);
+        GFREE(tr->tp.reqpath);
+        GFREE(tr);
     }
+    tsk->tr_inactive_list_tail = &tsk->tr_inactive_list;
 
-    if(i >= 65535) {
-        close(sock);
-        return -1;
+    if(tsk->tmrfd >= 0) {
+        struct timer_param tp;
+        memset(&tp, 0, sizeof(tp));
+        tp.epfd = tsk->epfd;
+        tp.tmrfd = tsk->tmrfd;
+        timer_destroy(&tp);
+        tsk->tmrfd = -1;
     }
 
-    if(socket_tcp_listen(sock, 1024)) {
-        close(sock);
-        return -1;
+    if(tsk->fc.files) {
+        torrent_close_downfiles(tsk);
     }
 
-    tsk->listenfd = sock;
-    tsk->listen_port = i; 
+    GFREE(tsk->chk.check_map);
+    tsk->chk.check_map = NULL;
 
-    LOG_DEBUG("listen port : %hu\n", tsk->listen_port);
+    bitfield_destroy(&tsk->bf);
+    torrent_info_free(&tsk->tor);
 
-    return 0;
+    pthread_mutex_destroy(&tsk->lock);
 }
 
 static int
@@ -203,45 +249,6 @@ torrent_create_timer(struct torrent_task *tsk)
     return 0;
 }
 
-static int
-torrent_add_event(struct torrent_task *tsk, int event)
-{
-    struct event_param ep;
-    ep.event = event;
-    ep.fd = tsk->listenfd;
-    ep.evt_hdl = torrent_listen_handle;
-    ep.evt_ctx = tsk;
-
-    if(event_add(tsk->epfd, &ep)) {
-        LOG_ERROR("peer add event failed!\n");
-        return -1;
-    }
-
-    return 0;
-}
-
-static int
-torrent_del_event(struct torrent_task *tsk)
-{
-    if(tsk->listenfd < 0) {
-        return -1;
-    }
-
-    struct event_param ep;
-    memset(&ep, 0, sizeof(ep));
-    ep.fd = tsk->listenfd;
-
-    if(event_del(tsk->epfd, &ep)) {
-        LOG_ERROR("peer del event failed!\n");
-        return -1;
-    }
-
-    close(tsk->listenfd);
-    tsk->listenfd = -1;
-
-    return 0;
-}
-
 static int
 torrent_find_peer_addrinfo(struct torrent_task *tsk, struct peer_addrinfo *ai)
 {
@@ -294,13 +301,22 @@ torrent_add_peer_addrinfo(struct torrent_task *tsk, char *peer)
 	return 0;
 }
 
+/* the peer is counted against the limits until torrent_peer_recycle */
 static int
 torrent_get_free_peer(struct torrent_task *tsk, struct peer **pr)
 {
+    struct torrent_mgr *mgr = tsk->mgr;
+    if(mgr->max_peer > 0 && __atomic_load_n(&mgr->npeer, __ATOMIC_RELAXED) >= mgr->max_peer) {
+        return -1;
+    }
+
 	int i;
 	for(i = 0; i < MAX_PEER_NUM; i++) {
 		if(!tsk->pr[i].isused) {
 			*pr = &tsk->pr[i];
+            (*pr)->isused = 1;
+            tsk->npeer++;
+            __atomic_add_fetch(&mgr->npeer, 1, __ATOMIC_RELAXED);
 			return 0;
 		}
 	}
@@ -375,7 +391,7 @@ torrent_peer_init(struct torrent_task *tsk)
             tmp->next = NULL;
             pr->ipaddr = tmp; 
             pr->tsk = tsk;
-            pr->isused = 1;
+            pr->epfd = torrent_peer_loop(tsk);
             peer_init(pr);
         }
     }
@@ -386,6 +402,9 @@ torrent_peer_init(struct torrent_task *tsk)
 int
 torrent_peer_recycle(struct torrent_task *tsk, struct peer *pr, int how_active)
 {
+    tsk->npeer--;
+    __atomic_sub_fetch(&tsk->mgr->npeer, 1, __ATOMIC_RELAXED);
+
     if(pr->ipaddr->client) {
         GFREE(pr->ipaddr);
         pr->isused = 0;
@@ -551,25 +570,24 @@ torrent_peer_notify(struct torrent_task *tsk)
 	return 0;
 }
 
+/*
+ * a peer goes to the next loop, the events and timers of a loop may be set
+ * up from any other one.
+ */
 static int
-torrent_listen_handle(int event, void *evt_ctx)
+torrent_peer_loop(struct torrent_task *tsk)
 {
-	struct torrent_task *tsk;
-	tsk = (struct torrent_task *)evt_ctx;
-
-    uint16 port;
-    int ip, clisock;
-
-    clisock = socket_tcp_accept(tsk->listenfd, &ip, &port);
-    if(clisock < 0) {
-        LOG_ERROR("accept %hu failed:%s\n", tsk->listen_port, strerror(errno));
-        return -1;
-    }
+    struct torrent_mgr *mgr = tsk->mgr;
+    return mgr->loop_epfd[tsk->next_loop++ % mgr->nloop];
+}
 
+static int
+torrent_task_accept_peer(struct torrent_task *tsk, int sock, int ip, uint16 port)
+{
     struct peer_addrinfo *ai;
     ai = GCALLOC(1,sizeof(*ai));
     if(!ai) {
-        close(clisock);
+        close(sock);
         LOG_ERROR("out of memory!\n");
         return -1;
     }
@@ -585,30 +603,43 @@ torrent_listen_handle(int event, void *evt_ctx)
     struct peer *pr;
     if(torrent_get_free_peer(tsk, &pr)) {
         LOG_DEBUG("have no free peer slot for incoming client!\n");
-        close(clisock);
+        close(sock);
         GFREE(ai);
         return -1;
     }
 
-    pr->isused = 1;
-    pr->sockid = clisock;
+    pr->sockid = sock;
     pr->ipaddr = ai;
     pr->tsk = tsk;
+    pr->epfd = torrent_peer_loop(tsk);
 
     peer_init(pr);
 
     return 0;
 }
 
+/* an incoming connection the manager found to be for this task */
+int
+torrent_task_accept(struct torrent_task *tsk, int sock, int ip, uint16 port)
+{
+    pthread_mutex_lock(&tsk->lock);
+    int ret = torrent_task_accept_peer(tsk, sock, ip, port);
+    pthread_mutex_unlock(&tsk->lock);
+
+    return ret;
+}
+
 static int
 torrent_timeout_handle(int event, void *evt_ctx)
 {
 	struct torrent_task *tsk;
 	tsk = (struct torrent_task *)evt_ctx;
 
+    pthread_mutex_lock(&tsk->lock);
+
 	torrent_stop_timer(tsk);
 
-	if(tsk->leftpieces > 0) {
+	if(tsk->leftpieces > 0 && !tsk->chk.checking) {
 		torrent_peer_init(tsk);	
 	}
 
@@ -616,8 +647,15 @@ torrent_timeout_handle(int event, void *evt_ctx)
 
 	torrent_tracker_announce(tsk);
 
+    if(time(NULL) - tsk->resume_time >= RESUME_SAVE_INTERVAL) {
+        torrent_resume_save_async(tsk);
+        tsk->resume_time = time(NULL);
+    }
+
 	torrent_start_timer(tsk);
 
+    pthread_mutex_unlock(&tsk->lock);
+
 	return 0;
 }
 
@@ -17,7 +17,7 @@ tracker_reset_members(struct tracker *tr)
     }
 
     if(tr->tmrfd > 0) {
-        close(tr->tmrfd);
+        tracker_destroy_timer(tr);
     }
 
     tr->sockid = -1;
@@ -45,7 +45,6 @@ tracker_destroy_timer(struct tracker *tr)
         return -1;
     }
 
-    close(tr->tmrfd);
     tr->tmrfd = -1;
 
     return 0;
@@ -431,11 +431,8 @@ FREE:
 }
 
 static int
-tracker_udp_event_handle(int event, void *evt)
+tracker_udp_event_state(int event, struct tracker *tr)
 {
-    struct tracker *tr;
-
-    tr = (struct tracker *)evt;
     switch(tr->state) {
         case TRACKER_STATE_UDP_CONNECT_REQ:
             return tracker_udp_connect_req(tr);
@@ -457,15 +454,21 @@ tracker_udp_event_handle(int event, void *evt)
 }
 
 static int
-tracker_udp_timeout_handle(int event, void *evt_ctx)
+tracker_udp_event_handle(int event, void *evt)
 {
-    struct tracker *tr = (struct tracker *) evt_ctx;
+    struct tracker *tr = (struct tracker *)evt;
+    struct torrent_task *tsk = tr->tsk;
 
-    int64 tmrbuf;
-    if(read(tr->tmrfd, &tmrbuf, sizeof(tmrbuf)) != sizeof(tmrbuf)) {
-        LOG_ALARM("[%s:%s] read timer fd failed\n", tr->tp.host, tr->tp.port);
-    }
+    pthread_mutex_lock(&tsk->lock);
+    int ret = tracker_udp_event_state(event, tr);
+    pthread_mutex_unlock(&tsk->lock);
+
+    return ret;
+}
 
+static int
+tracker_udp_timeout_state(int event, struct tracker *tr)
+{
     if(++tr->connect_cnt > 4) {
         LOG_INFO("(%s:%s) timeout\n", tr->tp.host, tr->tp.port);
         goto FAILED;
@@ -497,6 +500,19 @@ FAILED:
     return 0;
 }
 
+static int
+tracker_udp_timeout_handle(int event, void *evt_ctx)
+{
+    struct tracker *tr = (struct tracker *)evt_ctx;
+    struct torrent_task *tsk = tr->tsk;
+
+    pthread_mutex_lock(&tsk->lock);
+    int ret = tracker_udp_timeout_state(event, tr);
+    pthread_mutex_unlock(&tsk->lock);
+
+    return ret;
+}
+
 int
 tracker_udp_announce(struct tracker *tr)
 {
@@ -7,10 +7,11 @@
 #include <stdio.h>
 #include <errno.h>
 #include <ctype.h>
+#include <time.h>
 #include "utils.h"
 #include "log.h"
 #include "socket.h"
-#include "sha1.h"
+#include "sha1_accel.h"
 #include "mempool.h"
 
 int
@@ -64,6 +65,17 @@ utils_lseek(int fd, int64 offset, int whence)
 	return lseek(fd, offset, whence);
 }
 
+/* monotonic milliseconds */
+int64
+utils_mtime(void)
+{
+    struct timespec tp;
+    if(clock_gettime(CLOCK_MONOTONIC, &tp)) {
+        return 0;
+    }
+    return (int64)tp.tv_sec * 1000 + tp.tv_nsec / 1000000;
+}
+
 int
 utils_sha1_check(const char *buffer, int buflen, const char *sha1, int sha1len)
 {
@@ -87,37 +99,7 @@ utils_sha1_gen(const char *buffer, int buflen, char *sha1, int sha1len)
         return -1;
     }
 
-    struct SHA1Context ctx;
-
-    SHA1Reset(&ctx);
-
-    SHA1Input(&ctx, (unsigned char *)buffer, buflen);
-
-    if(!SHA1Result(&ctx)) {
-        LOG_ERROR("compute memssage Digest failed!\n");
-        return -1;
-    }
-
-    int i;
-    for(i = 0; i < 5; i ++) {
-        int bigend = ctx.Message_Digest[i];
-        bigend = socket_htonl(bigend);
-        memcpy(sha1+i*4, &bigend, 4);
-    }
-
-#if 0
-    char info_hash_hex[40+1];
-
-    snprintf(info_hash_hex, sizeof(info_hash_hex), "%08X%08X%08X%08X%08X",
-            ctx.Message_Digest[0],
-            ctx.Message_Digest[1],
-            ctx.Message_Digest[2],
-            ctx.Message_Digest[3],
-            ctx.Message_Digest[4]
-            );
-    LOG_DEBUG("info_hash_hex:%.40s\n", info_hash_hex);
-
-#endif
+    sha1_accel_digest((const unsigned char *)buffer, buflen, (unsigned char *)sha1);
 
     return 0;
 }